@@ -0,0 +1,23 @@
+// Depth view
+//
+// For debugging: shows the G-buffer's depth texture in grey, with
+// 0=near as black and 1=far as white.  The depth texture can't be
+// blitted into the window like the colour textures, so it's drawn
+// with this shader instead.
+
+#version 300 es
+
+uniform mediump sampler2D depthSampler;
+
+in mediump vec2 texCoords;
+
+out mediump vec4 outputColour;
+
+
+void main()
+
+{
+  mediump float depth = texture( depthSampler, texCoords ).r;
+
+  outputColour = vec4( depth, depth, depth, 1.0 );
+}
@@ -7,12 +7,13 @@
 uniform mat4 MVP;
 
 layout (location = 0) in mediump vec3 vertPosition;
+layout (location = 3) in mat4 instanceTransform; // identity unless instanced
 
 out mediump vec3 colour;
 
 void main()
 
 {
-  gl_Position = MVP * vec4( vertPosition, 1.0 );
+  gl_Position = MVP * instanceTransform * vec4( vertPosition, 1.0 );
   colour = vec3( 0.66, 0.84, 0.36 );
 }
@@ -0,0 +1,91 @@
+// Fused pass 2 and 3 fragment shader
+//
+// Does the work of pass 2 and pass 3 in one pass: the Laplacian of
+// the depths is computed here, where it's needed, rather than being
+// written to a texture by pass 2 and read back.
+//
+// Pass 3 needs the Laplacian at each texel within kernelRadius of
+// this one, and each Laplacian needs the depths of the 3x3 texels
+// around it, so the depths of the (2 kernelRadius + 3)^2 texels
+// around this one are read once into an array, from which all of
+// the Laplacians are found.  (textureGather() would read them four at
+// a time, but it isn't in OpenGL ES 3.0 or OpenGL 3.3.)
+
+#version 300 es
+
+uniform mediump vec3 lightDir;     // direction toward the light in the VCS
+uniform mediump vec2 texCoordInc;  // texture coord difference between adjacent texels
+
+// texCoords and the colour, normal, and depth samplers are declared
+// in gbuffer.glsl
+
+out mediump vec4 outputColour;          // the output fragment colour as RGBA with A=1
+
+const int kernelRadius = 3;                 // as in pass 3
+const mediump float threshold = 0.1;
+
+const int footprintRadius = kernelRadius + 1;
+const int footprintWidth  = 2 * footprintRadius + 1;
+
+mediump float depths[ footprintWidth * footprintWidth ];
+
+
+// The Laplacian at offset (i,j) from this texel, with the 3x3 kernel
+// of pass 2
+
+mediump float laplacian( int i, int j )
+
+{
+  mediump float sum = 0.0;
+
+  for (int y = j-1; y <= j+1; y++)
+    for (int x = i-1; x <= i+1; x++)
+      sum += depths[ (y + footprintRadius) * footprintWidth + (x + footprintRadius) ];
+
+  return 9.0 * depths[ (j + footprintRadius) * footprintWidth + (i + footprintRadius) ] - sum;
+}
+
+
+void main()
+
+{
+  // Read the depths around this texel
+
+  for (int y = -footprintRadius; y <= footprintRadius; y++)
+    for (int x = -footprintRadius; x <= footprintRadius; x++)
+      depths[ (y + footprintRadius) * footprintWidth + (x + footprintRadius) ]
+	= texture( depthSampler, texCoords + vec2( float(x), float(y) ) * texCoordInc ).r;
+
+  // Discard background texels away from the silhouette
+
+  mediump float depth = depths[ footprintRadius * footprintWidth + footprintRadius ];
+
+  if (depth >= 1.0 && abs( laplacian( 0, 0 ) ) < threshold)
+    discard;
+
+  // Cel shading, as in pass 3
+
+  mediump vec3 colour, normal;
+  readColourAndNormal( colour, normal );
+
+  const mediump float numQuanta = 3.0;
+
+  mediump float NdotL = max( 0.2, dot( normal, lightDir ) );
+  mediump float quantizedNdotL = floor( NdotL * numQuanta ) / numQuanta;
+  mediump vec3 celColour = colour * quantizedNdotL;
+
+  // Distance to the nearest neighbouring edge texel, as in pass 3
+
+  mediump float maxDist = float( kernelRadius );
+  mediump float minDist = maxDist;
+
+  for (int j = -kernelRadius; j <= kernelRadius; j++)
+    for (int i = -kernelRadius; i <= kernelRadius; i++)
+      if ((i != 0 || j != 0) && abs( laplacian( i, j ) ) > threshold)
+	minDist = min( minDist, length( vec2( float(i), float(j) ) ) );
+
+  if (minDist < maxDist)
+    outputColour = vec4( mix( vec3(0.0), celColour, minDist / maxDist ), 1.0 );
+  else
+    outputColour = vec4( celColour, 1.0 );
+}
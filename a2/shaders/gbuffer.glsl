@@ -0,0 +1,89 @@
+// G-buffer reading, shared by the fragment shaders that shade from
+// the G-buffer (pass3.frag, fused.frag, and outline.frag).  This is
+// inserted after each shader's #version line by GPUProgram, since
+// GLSL ES has no #include.
+
+in mediump vec2 texCoords;              // texture coordinates at this fragment
+
+uniform sampler2D colourSampler;
+uniform sampler2D normalSampler;
+uniform mediump sampler2D depthSampler;
+
+// The G-buffer can be smaller than the window, with dynamic
+// resolution.  Then 'upsampling' is true and the colour and normal
+// are upsampled (see below).
+
+uniform bool upsampling;
+uniform mediump vec2 gbufferSize;  // in texels
+
+
+// Decode a normal stored with an octahedral encoding by pass 1
+
+mediump vec3 decodeOctahedral( mediump vec2 e )
+
+{
+  mediump vec3 n = vec3( e, 1.0 - abs(e.x) - abs(e.y) );
+
+  if (n.z < 0.0)
+    n.xy = (1.0 - abs(n.yx)) * vec2( n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0 );
+
+  return normalize( n );
+}
+
+
+// Upsample the colour and normal from a G-buffer that's smaller than
+// the window.  Within a surface, they're interpolated bilinearly from
+// the four nearest texels.  Where those texels' depths differ, as at a
+// silhouette, the nearest texel is used instead, so that the
+// silhouette stays sharp rather than being blended with the
+// background.
+
+const mediump float depthTolerance = 0.01;
+
+void upsample( out mediump vec3 colour, out mediump vec3 normal )
+
+{
+  highp vec2 st = texCoords * gbufferSize - 0.5;
+  highp vec2 texel = floor( st );
+  mediump vec2 f = st - texel;
+
+  highp vec2 tc00 = (texel + vec2( 0.5, 0.5 )) / gbufferSize;
+  highp vec2 tc10 = (texel + vec2( 1.5, 0.5 )) / gbufferSize;
+  highp vec2 tc01 = (texel + vec2( 0.5, 1.5 )) / gbufferSize;
+  highp vec2 tc11 = (texel + vec2( 1.5, 1.5 )) / gbufferSize;
+
+  mediump vec4 d = vec4( texture( depthSampler, tc00 ).r, texture( depthSampler, tc10 ).r,
+			 texture( depthSampler, tc01 ).r, texture( depthSampler, tc11 ).r );
+
+  mediump float dMin = min( min( d.x, d.y ), min( d.z, d.w ) );
+  mediump float dMax = max( max( d.x, d.y ), max( d.z, d.w ) );
+
+  if (dMax - dMin > depthTolerance) {
+    colour = texture( colourSampler, texCoords ).rgb;
+    normal = decodeOctahedral( texture( normalSampler, texCoords ).xy );
+    return;
+  }
+
+  colour = mix( mix( texture( colourSampler, tc00 ).rgb, texture( colourSampler, tc10 ).rgb, f.x ),
+		mix( texture( colourSampler, tc01 ).rgb, texture( colourSampler, tc11 ).rgb, f.x ), f.y );
+
+  normal = normalize( mix( mix( decodeOctahedral( texture( normalSampler, tc00 ).xy ),
+				decodeOctahedral( texture( normalSampler, tc10 ).xy ), f.x ),
+			   mix( decodeOctahedral( texture( normalSampler, tc01 ).xy ),
+				decodeOctahedral( texture( normalSampler, tc11 ).xy ), f.x ), f.y ) );
+}
+
+
+// The colour and normal at this fragment, upsampled if the G-buffer
+// is smaller than the window
+
+void readColourAndNormal( out mediump vec3 colour, out mediump vec3 normal )
+
+{
+  if (upsampling)
+    upsample( colour, normal );
+  else {
+    colour = texture( colourSampler, texCoords ).rgb;
+    normal = decodeOctahedral( texture( normalSampler, texCoords ).xy );
+  }
+}
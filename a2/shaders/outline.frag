@@ -0,0 +1,58 @@
+// Outline fragment shader
+//
+// Cel shading as in pass 3, with an outline of any width around the
+// edges.  The distance to the nearest edge texel was found by the
+// outline passes (outlineX.frag and outlineY.frag), so the cost of
+// this pass doesn't depend on the outline width.
+
+#version 300 es
+
+uniform mediump vec3 lightDir;     // direction toward the light in the VCS
+uniform mediump float outlineWidth; // in G-buffer texels
+
+// texCoords and the colour, normal, and depth samplers are declared
+// in gbuffer.glsl
+
+uniform mediump sampler2D outlineSampler; // distance to the nearest edge texel
+
+out mediump vec4 outputColour;
+
+
+void main()
+
+{
+  mediump float depth = texture( depthSampler, texCoords ).r;
+  mediump float dist  = texture( outlineSampler, texCoords ).r;
+
+  // Discard background texels outside the outline
+
+  bool background = (depth >= 1.0);
+
+  if (background && dist >= outlineWidth)
+    discard;
+
+  // Cel shading, as in pass 3.  The outline blends to white over the
+  // background.
+
+  mediump vec3 base;
+
+  if (background)
+    base = vec3( 1.0 );
+  else {
+    mediump vec3 colour, normal;
+    readColourAndNormal( colour, normal );
+
+    const mediump float numQuanta = 3.0;
+
+    mediump float NdotL = max( 0.2, dot( normal, lightDir ) );
+    base = colour * (floor( NdotL * numQuanta ) / numQuanta);
+  }
+
+  // Black at an edge, blending to the shaded colour at the outline's
+  // width
+
+  if (dist < outlineWidth)
+    outputColour = vec4( mix( vec3(0.0), base, dist / outlineWidth ), 1.0 );
+  else
+    outputColour = vec4( base, 1.0 );
+}
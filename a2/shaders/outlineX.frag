@@ -0,0 +1,60 @@
+// Outline horizontal pass
+//
+// The first half of a separable dilation of the edges found by pass
+// 2.  For each texel, this finds the horizontal distance to the
+// nearest edge texel in its row, up to 'radius' texels away.  The
+// vertical pass then finds the distance to the nearest edge texel in
+// any direction from these.  Each pass takes O(radius) texture reads
+// per texel, where a search of the whole neighbourhood would take
+// O(radius^2).
+//
+// This pass can be drawn at a lower resolution than the Laplacian, in
+// which case each of its texels covers scale x scale Laplacian texels
+// and is an edge texel if any of those are.  Distances are always in
+// Laplacian texels.
+
+#version 300 es
+
+uniform mediump sampler2D laplacianSampler;
+uniform mediump vec2 texCoordInc;  // between adjacent Laplacian texels
+
+uniform int radius;                // in texels of this pass
+uniform int scale;                 // Laplacian texels per texel of this pass, across
+uniform mediump float maxDistance; // output if there's no edge within 'radius'
+
+in mediump vec2 texCoords;
+
+layout (location = 0) out mediump float fragDistance;
+
+const mediump float threshold = 0.1;  // as in pass 3
+
+
+// Is there an edge in the texel at offset k from this one?
+
+bool isEdge( int k )
+
+{
+  // Centre of the bottom-left Laplacian texel of the block
+
+  mediump vec2 corner = texCoords + (vec2( float(k * scale), 0.0 ) - 0.5 * float(scale - 1)) * texCoordInc;
+
+  for (int y = 0; y < scale; y++)
+    for (int x = 0; x < scale; x++)
+      if (abs( texture( laplacianSampler, corner + vec2( float(x), float(y) ) * texCoordInc ).r ) > threshold)
+	return true;
+
+  return false;
+}
+
+
+void main()
+
+{
+  mediump float d = maxDistance;
+
+  for (int k = -radius; k <= radius; k++)
+    if (isEdge( k ))
+      d = min( d, float( abs(k) * scale ) );
+
+  fragDistance = d;
+}
@@ -0,0 +1,35 @@
+// Outline vertical pass
+//
+// The second half of the separable dilation (see outlineX.frag).
+// Given the horizontal distance to the nearest edge texel in each
+// row, the distance to the nearest edge texel in the neighbourhood is
+// the least of sqrt( horizontal distance^2 + vertical distance^2 )
+// over the rows within 'radius' texels.
+
+#version 300 es
+
+uniform mediump sampler2D horizontalSampler;
+uniform mediump vec2 texCoordInc;  // between adjacent texels of this pass
+
+uniform int radius;                // in texels of this pass
+uniform int scale;                 // Laplacian texels per texel of this pass, across
+uniform mediump float maxDistance;
+
+in mediump vec2 texCoords;
+
+layout (location = 0) out mediump float fragDistance;
+
+
+void main()
+
+{
+  mediump float d = maxDistance;
+
+  for (int k = -radius; k <= radius; k++) {
+    mediump float dx = texture( horizontalSampler, texCoords + vec2( 0.0, float(k) ) * texCoordInc ).r;
+    if (dx < maxDistance)
+      d = min( d, length( vec2( dx, float( k * scale ) ) ) );
+  }
+
+  fragDistance = d;
+}
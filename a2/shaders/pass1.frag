@@ -1,28 +1,40 @@
 // Pass 1 fragment shader
 //
-// Outputs colour, normal, depth to three textures
+// Outputs colour and normal to two textures.  The depth goes to the
+// depth texture.
 
 #version 300 es
 
 in mediump vec3 colour;
 in mediump vec3 normal;
-in mediump float depth;
 
-// Output to the three textures.  Location i corresponds to
+// Output to the two textures.  Location i corresponds to
 // GL_COLOUR_ATTACHMENT + i in the Framebuffer Object (FBO).
+//
+// The normal is stored in two components with an octahedral encoding
+// (Cigolle et al., "A Survey of Efficient Representations for
+// Independent Unit Vectors", JCGT 2014): the unit sphere is projected
+// onto the octahedron |x|+|y|+|z| = 1, and the lower half of the
+// octahedron is folded over the upper half.
+
+layout (location = 0) out mediump vec4 fragColour;
+layout (location = 1) out mediump vec2 fragNormal;
+
+mediump vec2 encodeOctahedral( mediump vec3 n )
+
+{
+  n /= abs(n.x) + abs(n.y) + abs(n.z);
+
+  if (n.z < 0.0)
+    n.xy = (1.0 - abs(n.yx)) * vec2( n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0 );
 
-layout (location = 0) out mediump vec3 fragColour;
-layout (location = 1) out mediump vec3 fragNormal;
-layout (location = 2) out mediump vec3 fragDepth;
+  return n.xy;
+}
 
-// Interpolated inputs as simply copied to the three outputs.  You do
-// not have to modify this shader.
 
 void main()
 
 {
-  fragColour = colour;
-  fragNormal = normal;
-  fragDepth  = vec3( depth );   // depth is stored (inefficiently) in an RGB texture
+  fragColour = vec4( colour, 1.0 );
+  fragNormal = encodeOctahedral( normal );
 }
-
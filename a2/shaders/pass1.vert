@@ -1,6 +1,6 @@
 // Pass 1 vertex shader
 //
-// Stores colour, normal, depth
+// Stores colour and normal.  The depth is the fragment depth.
 
 #version 300 es
 
@@ -8,24 +8,56 @@ uniform mat4 M;
 uniform mat4 MV;
 uniform mat4 MVP;
 
+// Normals are octahedral-encoded in vertNormal.xy if the model's
+// vertices are quantized (see quantize.h)
+
+uniform bool octahedralNormals;
+
+// Material of the triangles being drawn (see wfModel::draw())
+
+layout (std140) uniform Material {
+  mediump vec4  kd;
+  mediump vec4  ks;
+  mediump vec4  Ia;
+  mediump vec4  Ie;
+  mediump float shininess;
+  int           texturing;
+};
+
 layout (location = 0) in mediump vec3 vertPosition;
 layout (location = 1) in mediump vec3 vertNormal;
 layout (location = 2) in mediump vec3 vertTexCoord;
 
-// Your shader should compute the colour, normal (in the VCS), and
-// depth (in the range [0,1] with 0=near and 1=far) and store these
-// values in the corresponding variables.
+// Transformation of the instance being drawn, before M, MV, and MVP.
+// This is the identity unless the model is instanced (see
+// wfModel::drawInstanced()).
+
+layout (location = 3) in mat4 instanceTransform;
+
+// Your shader should compute the colour and normal (in the VCS) and
+// store these values in the corresponding variables.
 
 out mediump vec3 colour;
 out mediump vec3 normal;
-out mediump float depth;
+
+vec3 decodeOctahedral( vec2 e )
+
+{
+  vec3 n = vec3( e, 1.0 - abs(e.x) - abs(e.y) );
+
+  if (n.z < 0.0)
+    n.xy = (1.0 - abs(n.yx)) * sign(n.xy);
+
+  return normalize( n );
+}
+
 
 void main()
 
 {
   // calc vertex position in CCS (always required)
 
-  gl_Position = MVP * vec4( vertPosition, 1.0 );
+  gl_Position = MVP * instanceTransform * vec4( vertPosition, 1.0 );
 
   // Provide a colour 
 
@@ -33,9 +65,8 @@ void main()
 
   // calculate normal in VCS
 
-  normal = (MV * vec4(vertNormal, 0.0)).xyz;         // YOUR CODE HERE
-
-  // Calculate the depth in [0,1]
-
-  depth = (gl_Position.z/gl_Position.w+1.0)/2.0;                  // YOUR CODE HERE
+  if (octahedralNormals) // MV includes the scaling of quantized positions, so normalize
+    normal = normalize( (MV * instanceTransform * vec4( decodeOctahedral( vertNormal.xy ), 0.0 )).xyz );
+  else
+    normal = (MV * instanceTransform * vec4(vertNormal, 0.0)).xyz;         // YOUR CODE HERE
 }
@@ -14,15 +14,15 @@ uniform mediump vec2 texCoordInc;
 
 in mediump vec2 texCoords;
 
-// depthSampler = texture sampler for the depths.
+// depthSampler = texture sampler for the depths (the depth texture,
+// so only the R component is used).
 
 uniform mediump sampler2D depthSampler;
 
-// fragLaplacian = an RGB value that is output from this shader.  All
-// three components should be identical.  This RGB value will be
+// fragLaplacian = the value output from this shader.  It will be
 // stored in the Laplacian texture.
 
-layout (location = 0) out mediump vec3 fragLaplacian;
+layout (location = 0) out mediump float fragLaplacian;
 
 
 void main()
@@ -41,7 +41,7 @@ void main()
   // Store a signed value for the Laplacian; do not take its absolute
   // value.
 
-  fragLaplacian = 8.0 * texture(depthSampler, texCoords).xyz;
+  fragLaplacian = 8.0 * texture(depthSampler, texCoords).r;
 
   for(int y = -1; y <= 1; y++) {
     for(int x = -1; x <= 1; x++) {
@@ -50,9 +50,8 @@ void main()
         
       // Calculate sample position and subtract from result (weight of -1)
       mediump vec2 offset = vec2(float(x) * texCoordInc.x, float(y) * texCoordInc.y);
-      fragLaplacian -= texture(depthSampler, texCoords + offset).xyz;
+      fragLaplacian -= texture(depthSampler, texCoords + offset).r;
     }
   }
 
-  // fragLaplacian = vec3( 0.1, 0.2, 0.3 );
 }
@@ -9,14 +9,11 @@
 uniform mediump vec3 lightDir;     // direction toward the light in the VCS
 uniform mediump vec2 texCoordInc;  // texture coord difference between adjacent texels
 
-in mediump vec2 texCoords;              // texture coordinates at this fragment
-
 // The following four textures are now available and can be sampled
-// using 'texCoords'
+// using 'texCoords'.  'texCoords' and the colour, normal, and depth
+// samplers are declared in gbuffer.glsl, with the functions that read
+// the colour and normal.
 
-uniform sampler2D colourSampler;
-uniform sampler2D normalSampler;
-uniform sampler2D depthSampler;
 uniform sampler2D laplacianSampler;
 
 out mediump vec4 outputColour;          // the output fragment colour as RGBA with A=1
@@ -47,8 +44,8 @@ void main()
   // components of the texture as texture2D( ... ).rgb or texture2D( ... ).xyz.
 
   // YOUR CODE HERE
-  mediump vec3 colour = texture(colourSampler, texCoords).rgb;
-  mediump vec3 normal = texture(normalSampler, texCoords).xyz;  
+  mediump vec3 colour, normal;
+  readColourAndNormal( colour, normal );
 
 
   // [2 marks] Compute Cel shading, in which the diffusely shaded
@@ -0,0 +1,585 @@
+// bvh.cpp
+//
+// See bvh.h
+
+
+#include "headers.h"
+#include "bvh.h"
+#include "seq.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+
+#define BVH_MAX_DEPTH 64	/* nodes below this are split at the median, which adds at most 32 levels */
+#define BVH_STACK_SIZE (BVH_MAX_DEPTH + 32)
+#define PARALLEL_NODE_SIZE 65536 /* nodes with this many triangles are binned in parallel */
+#define TRAVERSAL_COST 1.0	/* cost of visiting a node, relative to intersecting a triangle */
+
+
+// What the builder needs for each triangle
+
+class BVHBuilder {
+ public:
+  vec3 *centroids;
+  vec3 *triMin, *triMax;	/* bounds of each triangle */
+  int  *order;			/* triangles, partitioned as the tree is built */
+};
+
+
+class BVHBin {
+ public:
+  vec3 min, max;
+  int  count;
+
+  BVHBin() {
+    min = vec3( MAXFLOAT, MAXFLOAT, MAXFLOAT );
+    max = vec3( -MAXFLOAT, -MAXFLOAT, -MAXFLOAT );
+    count = 0;
+  }
+
+  void add( vec3 &lo, vec3 &hi ) {
+    if (lo.x < min.x) min.x = lo.x;
+    if (lo.y < min.y) min.y = lo.y;
+    if (lo.z < min.z) min.z = lo.z;
+    if (hi.x > max.x) max.x = hi.x;
+    if (hi.y > max.y) max.y = hi.y;
+    if (hi.z > max.z) max.z = hi.z;
+  }
+
+  float area() {
+    if (count == 0)
+      return 0;
+    vec3 d = max - min;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+};
+
+
+// Find the bounds of triangles order[start..end) and of their
+// centroids.  Large ranges are done in parallel.
+
+static void findBounds( BVHBuilder &b, int start, int end, BVHBin &bounds, BVHBin &centroidBounds )
+
+{
+  int n = end - start;
+
+  bounds = BVHBin();
+  centroidBounds = BVHBin();
+
+  bounds.count = centroidBounds.count = n;
+
+  if (n < PARALLEL_NODE_SIZE) {
+    for (int i=start; i<end; i++) {
+      int t = b.order[i];
+      bounds.add( b.triMin[t], b.triMax[t] );
+      centroidBounds.add( b.centroids[t], b.centroids[t] );
+    }
+    return;
+  }
+
+  int numBlocks = 4 * numThreads();
+
+  BVHBin *blockBounds   = new BVHBin[ numBlocks ];
+  BVHBin *blockCentroid = new BVHBin[ numBlocks ];
+
+  parallelForBlocks( numBlocks, [&]( int k ) {
+    int first = start + (int) ((long long) n * k / numBlocks);
+    int last  = start + (int) ((long long) n * (k+1) / numBlocks);
+    for (int i=first; i<last; i++) {
+      int t = b.order[i];
+      blockBounds[k].add( b.triMin[t], b.triMax[t] );
+      blockCentroid[k].add( b.centroids[t], b.centroids[t] );
+    }
+  } );
+
+  for (int k=0; k<numBlocks; k++) {
+    bounds.add( blockBounds[k].min, blockBounds[k].max );
+    centroidBounds.add( blockCentroid[k].min, blockCentroid[k].max );
+  }
+
+  delete [] blockBounds;
+  delete [] blockCentroid;
+}
+
+
+// Choose where to split triangles order[start..end), which have the
+// given bounds, and partition them there.  Returns false if the
+// triangles should instead be a leaf.
+
+static bool splitNode( BVHBuilder &b, int start, int end, BVHBin &bounds, BVHBin &centroidBounds, int depth, int &mid )
+
+{
+  int n = end - start;
+
+  if (n <= 1)
+    return false;
+
+  // Split along the longest axis of the centroids
+
+  vec3 extent = centroidBounds.max - centroidBounds.min;
+
+  int axis = 0;
+  if (extent.y > extent[axis]) axis = 1;
+  if (extent.z > extent[axis]) axis = 2;
+
+  float lo = centroidBounds.min[axis];
+  float width = extent[axis];
+
+  if (width <= 0 || depth >= BVH_MAX_DEPTH) {	/* centroids coincide: split at the median */
+    if (n <= BVH_MAX_LEAF_SIZE)
+      return false;
+    mid = start + n/2;
+    return true;
+  }
+
+  float binScale = BVH_BINS / width;
+
+  auto binOf = [&]( int t ) {
+    int k = (int) ((b.centroids[t][axis] - lo) * binScale);
+    return (k < BVH_BINS ? k : BVH_BINS-1);
+  };
+
+  // Put the triangles in bins, in parallel if there are many
+
+  BVHBin bins[ BVH_BINS ];
+
+  auto fillBins = [&]( BVHBin *bins, int first, int last ) {
+    for (int i=first; i<last; i++) {
+      int t = b.order[i];
+      BVHBin &bin = bins[ binOf( t ) ];
+      bin.add( b.triMin[t], b.triMax[t] );
+      bin.count++;
+    }
+  };
+
+  if (n < PARALLEL_NODE_SIZE)
+    fillBins( bins, start, end );
+  else {
+    int numBlocks = 4 * numThreads();
+
+    BVHBin *blockBins = new BVHBin[ numBlocks * BVH_BINS ];
+
+    parallelForBlocks( numBlocks, [&]( int k ) {
+      fillBins( &blockBins[ k * BVH_BINS ],
+		start + (int) ((long long) n * k / numBlocks),
+		start + (int) ((long long) n * (k+1) / numBlocks) );
+    } );
+
+    for (int k=0; k<numBlocks; k++)
+      for (int j=0; j<BVH_BINS; j++) {
+	BVHBin &bin = blockBins[ k * BVH_BINS + j ];
+	if (bin.count > 0) {
+	  bins[j].add( bin.min, bin.max );
+	  bins[j].count += bin.count;
+	}
+      }
+
+    delete [] blockBins;
+  }
+
+  // Sweep from the right to find the area and count of each right
+  // side, then from the left to find the cheapest split
+
+  float rightArea[ BVH_BINS ];
+  int   rightCount[ BVH_BINS ];
+
+  BVHBin right;
+  for (int j=BVH_BINS-1; j>0; j--) {
+    if (bins[j].count > 0) {
+      right.add( bins[j].min, bins[j].max );
+      right.count += bins[j].count;
+    }
+    rightArea[j] = right.area();
+    rightCount[j] = right.count;
+  }
+
+  float bestCost = MAXFLOAT;
+  int   bestSplit = -1;		/* triangles in bins <= bestSplit go left */
+
+  BVHBin left;
+  for (int j=0; j<BVH_BINS-1; j++) {
+    if (bins[j].count > 0) {
+      left.add( bins[j].min, bins[j].max );
+      left.count += bins[j].count;
+    }
+    if (left.count == 0 || rightCount[j+1] == 0)
+      continue;
+    float cost = left.area() * left.count + rightArea[j+1] * rightCount[j+1];
+    if (cost < bestCost) {
+      bestCost = cost;
+      bestSplit = j;
+    }
+  }
+
+  // Make a leaf if it's small enough and splitting isn't cheaper
+
+  float leafCost = bounds.area() * n;
+
+  if (n <= BVH_MAX_LEAF_SIZE && (bestSplit < 0 || TRAVERSAL_COST * bounds.area() + bestCost >= leafCost))
+    return false;
+
+  if (bestSplit < 0) {		/* all centroids fell in one bin */
+    mid = start + n/2;
+    return true;
+  }
+
+  mid = std::partition( &b.order[start], &b.order[end], [&]( int t ) { return binOf( t ) <= bestSplit; } ) - b.order;
+
+  return true;
+}
+
+
+// Build the subtree for triangles order[start..end) below 'node',
+// adding its descendants to 'nodes'.  Returns the depth of its
+// deepest leaf.
+
+static int buildSubtree( BVHBuilder &b, int start, int end, BVHNode &node, seq<BVHNode> &nodes, int depth )
+
+{
+  BVHBin bounds, centroidBounds;
+  findBounds( b, start, end, bounds, centroidBounds );
+
+  node.min = bounds.min;
+  node.max = bounds.max;
+
+  int mid;
+
+  if (!splitNode( b, start, end, bounds, centroidBounds, depth, mid )) {
+    node.first = start;
+    node.count = end - start;
+    return depth;
+  }
+
+  int children = nodes.size();
+
+  nodes.add( BVHNode() );
+  nodes.add( BVHNode() );
+
+  node.first = children;
+  node.count = 0;
+
+  BVHNode left, right;
+
+  int leftDepth  = buildSubtree( b, start, mid, left, nodes, depth+1 );
+  int rightDepth = buildSubtree( b, mid, end, right, nodes, depth+1 );
+
+  nodes[children]   = left;
+  nodes[children+1] = right;
+
+  return (leftDepth > rightDepth ? leftDepth : rightDepth);
+}
+
+
+// A node at the bottom of the top of the tree, whose subtree is built
+// in parallel with the others
+
+class BVHTask {
+ public:
+  int node, start, end, depth;
+  BVHTask() {}
+  BVHTask( int nd, int s, int e, int d ) { node = nd; start = s; end = e; depth = d; }
+};
+
+
+BVH::BVH( const vec3 *triangleVertices, int n )
+
+{
+  struct timeb startTime, endTime;
+  ftime( &startTime );
+
+  numTriangles = n;
+
+  BVHBuilder b;
+
+  b.centroids = new vec3[ n ];
+  b.triMin    = new vec3[ n ];
+  b.triMax    = new vec3[ n ];
+  b.order     = new int[ n ];
+
+  parallelFor( n, [&]( int t ) {
+    vec3 p0 = triangleVertices[3*t];
+    vec3 p1 = triangleVertices[3*t+1];
+    vec3 p2 = triangleVertices[3*t+2];
+    for (int k=0; k<3; k++) {
+      b.triMin[t][k] = std::min( p0[k], std::min( p1[k], p2[k] ) );
+      b.triMax[t][k] = std::max( p0[k], std::max( p1[k], p2[k] ) );
+    }
+    b.centroids[t] = 0.5 * (b.triMin[t] + b.triMax[t]);
+    b.order[t] = t;
+  } );
+
+  // Split the top of the tree breadth-first, with the binning of each
+  // node done in parallel, until there are enough subtrees to keep
+  // all threads busy
+
+  int subtreeSize = n / (8 * numThreads());
+  if (subtreeSize < 4096)
+    subtreeSize = 4096;
+
+  seq<BVHNode> top;
+  seq<BVHTask> pending;
+  seq<BVHTask> subtrees;
+
+  top.add( BVHNode() );
+  pending.add( BVHTask( 0, 0, n, 0 ) );
+
+  depth = 0;
+
+  for (int i=0; i<pending.size(); i++) {
+
+    BVHTask task = pending[i];
+
+    if (task.end - task.start <= subtreeSize) {
+      subtrees.add( task );
+      continue;
+    }
+
+    BVHBin bounds, centroidBounds;
+    findBounds( b, task.start, task.end, bounds, centroidBounds );
+
+    top[task.node].min = bounds.min;
+    top[task.node].max = bounds.max;
+
+    int mid;
+
+    if (!splitNode( b, task.start, task.end, bounds, centroidBounds, task.depth, mid )) {
+      top[task.node].first = task.start;
+      top[task.node].count = task.end - task.start;
+      if (task.depth > depth)
+	depth = task.depth;
+      continue;
+    }
+
+    int children = top.size();
+
+    top.add( BVHNode() );
+    top.add( BVHNode() );
+
+    top[task.node].first = children;
+    top[task.node].count = 0;
+
+    pending.add( BVHTask( children,   task.start, mid,      task.depth+1 ) );
+    pending.add( BVHTask( children+1, mid,        task.end, task.depth+1 ) );
+  }
+
+  // Build the subtrees in parallel, each into its own array
+
+  seq<BVHNode> *subtreeNodes = new seq<BVHNode>[ subtrees.size() ];
+  BVHNode      *subtreeRoots = new BVHNode[ subtrees.size() ];
+  int          *subtreeDepth = new int[ subtrees.size() ];
+
+  parallelForBlocks( subtrees.size(), [&]( int i ) {
+    BVHTask &task = subtrees[i];
+    subtreeDepth[i] = buildSubtree( b, task.start, task.end, subtreeRoots[i], subtreeNodes[i], task.depth );
+  } );
+
+  // Put the subtrees after the top of the tree
+
+  numNodes = top.size();
+  for (int i=0; i<subtrees.size(); i++)
+    numNodes += subtreeNodes[i].size();
+
+  nodes = new BVHNode[ numNodes ];
+
+  for (int i=0; i<top.size(); i++)
+    nodes[i] = top[i];
+
+  int next = top.size();
+
+  for (int i=0; i<subtrees.size(); i++) {
+
+    int base = next;
+
+    for (int j=0; j<subtreeNodes[i].size(); j++) {
+      BVHNode &node = subtreeNodes[i][j];
+      if (node.count == 0)
+	node.first += base;
+      nodes[next++] = node;
+    }
+
+    BVHNode &root = subtreeRoots[i];
+    if (root.count == 0)
+      root.first += base;
+    nodes[ subtrees[i].node ] = root;
+
+    if (subtreeDepth[i] > depth)
+      depth = subtreeDepth[i];
+  }
+
+  delete [] subtreeNodes;
+  delete [] subtreeRoots;
+  delete [] subtreeDepth;
+
+  // Store the triangles in leaf order
+
+  vertices = new vec3[ 3 * n ];
+  ids = new int[ n ];
+
+  parallelFor( n, [&]( int i ) {
+    int t = b.order[i];
+    vertices[3*i]   = triangleVertices[3*t];
+    vertices[3*i+1] = triangleVertices[3*t+1];
+    vertices[3*i+2] = triangleVertices[3*t+2];
+    ids[i] = t;
+  } );
+
+  delete [] b.centroids;
+  delete [] b.triMin;
+  delete [] b.triMax;
+  delete [] b.order;
+
+  ftime( &endTime );
+  buildSeconds = (endTime.time - startTime.time) + (endTime.millitm - startTime.millitm) / 1000.0;
+}
+
+
+BVH::~BVH()
+
+{
+  delete [] nodes;
+  delete [] vertices;
+  delete [] ids;
+}
+
+
+long long BVH::bytes()
+
+{
+  return (long long) numNodes * sizeof(BVHNode) + (long long) numTriangles * (3 * sizeof(vec3) + sizeof(int));
+}
+
+
+// Distance along the ray at which it enters a node, or -1 if it
+// misses the node or enters beyond maxT
+
+static inline float enterNode( BVHNode &node, vec3 &origin, vec3 &invDir, float maxT )
+
+{
+  float t0 = 0, t1 = maxT;
+
+  for (int k=0; k<3; k++) {
+    float near = (node.min[k] - origin[k]) * invDir[k];
+    float far  = (node.max[k] - origin[k]) * invDir[k];
+    if (near > far)
+      std::swap( near, far );
+    if (near > t0) t0 = near;
+    if (far < t1)  t1 = far;
+    if (t0 > t1)
+      return -1;
+  }
+
+  return t0;
+}
+
+
+// Find the nearest triangle hit by the ray origin + t dir for t in
+// [0,maxT].  Triangles are hit from either side.
+
+bool BVH::raycast( vec3 origin, vec3 dir, BVHHit &hit, float maxT )
+
+{
+  vec3 invDir;
+
+  for (int k=0; k<3; k++)
+    invDir[k] = 1 / (fabs(dir[k]) > 1e-30 ? dir[k] : (dir[k] < 0 ? -1e-30 : 1e-30));
+
+  if (numNodes == 0 || numTriangles == 0 || enterNode( nodes[0], origin, invDir, maxT ) < 0)
+    return false;
+
+  int   stack[ BVH_STACK_SIZE ];
+  float stackT[ BVH_STACK_SIZE ];
+  int   sp = 0;
+
+  float nearest = maxT;
+  bool  found = false;
+  int   n = 0;
+
+  for (;;) {
+
+    BVHNode &node = nodes[n];
+
+    if (node.count > 0) {
+
+      // Intersect the leaf's triangles (Moller and Trumbore, "Fast,
+      // Minimum Storage Ray/Triangle Intersection", JGT 1997)
+
+      for (int i=node.first; i<node.first+node.count; i++) {
+
+	vec3 &a = vertices[3*i];
+	vec3 e1 = vertices[3*i+1] - a;
+	vec3 e2 = vertices[3*i+2] - a;
+
+	vec3  p = dir ^ e2;
+	float det = e1 * p;
+
+	if (det == 0)
+	  continue;
+
+	float invDet = 1 / det;
+	vec3  s = origin - a;
+	float u = (s * p) * invDet;
+
+	if (u < 0 || u > 1)
+	  continue;
+
+	vec3  q = s ^ e1;
+	float v = (dir * q) * invDet;
+
+	if (v < 0 || u + v > 1)
+	  continue;
+
+	float t = (e2 * q) * invDet;
+
+	if (t >= 0 && t <= nearest) {
+	  nearest = t;
+	  hit.triangle = ids[i];
+	  hit.t = t;
+	  hit.u = u;
+	  hit.v = v;
+	  found = true;
+	}
+      }
+
+    } else {
+
+      // Visit the nearer child first
+
+      int   c0 = node.first, c1 = node.first+1;
+      float t0 = enterNode( nodes[c0], origin, invDir, nearest );
+      float t1 = enterNode( nodes[c1], origin, invDir, nearest );
+
+      if (t0 >= 0 && t1 >= 0) {
+	if (t1 < t0) {
+	  std::swap( c0, c1 );
+	  std::swap( t0, t1 );
+	}
+	stack[sp] = c1;
+	stackT[sp] = t1;
+	sp++;
+	n = c0;
+	continue;
+      }
+
+      if (t0 >= 0) {
+	n = c0;
+	continue;
+      }
+
+      if (t1 >= 0) {
+	n = c1;
+	continue;
+      }
+    }
+
+    // Next node from the stack that might be nearer than the nearest hit
+
+    do {
+      if (sp == 0)
+	return found;
+      sp--;
+    } while (stackT[sp] > nearest);
+
+    n = stack[sp];
+  }
+}
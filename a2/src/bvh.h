@@ -0,0 +1,76 @@
+// bvh.h
+//
+// A bounding volume hierarchy over triangles, for casting rays on the
+// CPU (e.g. to find the triangle under the mouse).
+//
+// The hierarchy is built top-down.  Each node is split where the
+// surface area heuristic estimates that rays will be cheapest to
+// trace (MacDonald and Booth, "Heuristics for Ray Tracing Using Space
+// Subdivision", The Visual Computer 1990), choosing among the
+// boundaries of bins of triangle centroids along the longest axis
+// (Wald, "On Fast Construction of SAH-based Bounding Volume
+// Hierarchies", IEEE Symposium on Interactive Ray Tracing 2007).
+// The top of the tree is split with the binning done in parallel,
+// and the subtrees below it are then built in parallel.
+//
+// Usage:
+//
+//   BVH bvh( triangleVertices, numTriangles ); // three vec3 per triangle
+//
+//   BVHHit hit;
+//   if (bvh.raycast( origin, dir, hit ))
+//     ... triangle hit.triangle at origin + hit.t * dir ...
+//
+// The BVH keeps its own copy of the triangles, so the caller's array
+// can be freed.  raycast() can be called from any number of threads.
+
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "headers.h"
+#include "linalg.h"
+
+
+#define BVH_BINS          16	/* candidate split positions per node */
+#define BVH_MAX_LEAF_SIZE 4	/* most triangles in a leaf */
+
+
+class BVHNode {
+ public:
+  vec3 min, max;		/* bounds of the node's triangles */
+  int  first;			/* first triangle if a leaf, else the left child (the right is first+1) */
+  int  count;			/* triangles if a leaf, else 0 */
+};
+
+
+class BVHHit {
+ public:
+  int   triangle;		/* index in the array given to the BVH constructor */
+  float t;			/* hit point is origin + t * dir */
+  float u, v;			/* barycentric coordinates of the hit point: (1-u-v) a + u b + v c */
+};
+
+
+class BVH {
+
+  BVHNode *nodes;		/* nodes[0] is the root */
+  vec3    *vertices;		/* three per triangle, in leaf order */
+  int     *ids;			/* original index of each triangle in leaf order */
+
+ public:
+
+  int   numNodes;
+  int   numTriangles;
+  int   depth;			/* of the deepest leaf */
+  float buildSeconds;
+
+  BVH( const vec3 *triangleVertices, int numTriangles );
+  ~BVH();
+
+  bool raycast( vec3 origin, vec3 dir, BVHHit &hit, float maxT = MAXFLOAT ); /* nearest hit in [0,maxT] */
+
+  long long bytes();		/* memory used */
+};
+
+#endif
@@ -20,7 +20,29 @@
 #include "gbuffer.h"
 
 
-GBuffer::GBuffer( unsigned int width, unsigned int height, int nTextures, GLFWwindow *window )
+// The format and type of pixels for a texture's internal format.
+// The textures are never given pixels, but OpenGL ES requires these
+// to match.
+
+static void pixelFormat( GLenum internalFormat, GLenum &format, GLenum &type, int &bytes )
+
+{
+  switch (internalFormat) {
+  case GL_RGBA8:   format = GL_RGBA; type = GL_UNSIGNED_BYTE; bytes = 4; break;
+  case GL_RGB16F:  format = GL_RGB;  type = GL_HALF_FLOAT;    bytes = 6; break;
+  case GL_RGBA16F: format = GL_RGBA; type = GL_HALF_FLOAT;    bytes = 8; break;
+  case GL_RG16F:   format = GL_RG;   type = GL_HALF_FLOAT;    bytes = 4; break;
+  case GL_R16F:    format = GL_RED;  type = GL_HALF_FLOAT;    bytes = 2; break;
+  case GL_R8:      format = GL_RED;  type = GL_UNSIGNED_BYTE; bytes = 1; break;
+  default:
+    cerr << "GBuffer: unsupported texture format " << internalFormat << endl;
+    exit(1);
+  }
+}
+
+
+GBuffer::GBuffer( unsigned int width, unsigned int height, int nTextures, GLenum *internalFormats, GLFWwindow *window,
+		  float scale, bool withDepth )
 
 {
   // Check that we can attach at least 5 FBOs
@@ -34,14 +56,25 @@ GBuffer::GBuffer( unsigned int width, unsigned int height, int nTextures, GLFWwi
 
   // Get framebuffer size (which can be DIFFERENT than the window size, and *is* different on Macs!)
 
-  glfwGetFramebufferSize( window, &fbWidth, &fbHeight );
+  glfwGetFramebufferSize( window, &windowWidth, &windowHeight );
+
+  fbWidth  = (int) (windowWidth * scale + 0.5);
+  fbHeight = (int) (windowHeight * scale + 0.5);
+
+  if (fbWidth < 1)  fbWidth = 1;
+  if (fbHeight < 1) fbHeight = 1;
   
   numTextures = nTextures;
+  hasDepth = withDepth;
+
+  formats = new GLenum[ numTextures ];
+  for (int i=0; i<numTextures; i++)
+    formats[i] = internalFormats[i];
 
-  // Create the FBO
+  // Create the FBOs
 
   glGenFramebuffers( 1, &FBO );
-  glBindFramebuffer( GL_FRAMEBUFFER, FBO );
+  glGenFramebuffers( 1, &noDepthFBO );
 
   // Create the gbuffer textures
 
@@ -50,42 +83,70 @@ GBuffer::GBuffer( unsigned int width, unsigned int height, int nTextures, GLFWwi
 
   for (int i = 0 ; i < numTextures; i++) {
 
+    GLenum format, type;
+    int    bytes;
+
+    pixelFormat( formats[i], format, type, bytes );
+
     glBindTexture( GL_TEXTURE_2D, textures[i] );
 
-    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGB16F, fbWidth, fbHeight, 0, GL_RGB, GL_FLOAT, NULL );
+    glTexImage2D( GL_TEXTURE_2D, 0, formats[i], fbWidth, fbHeight, 0, format, type, NULL );
 
     glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
     glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-
-    glGenerateMipmap( GL_TEXTURE_2D );
-
-    glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, textures[i], 0 );
   }
 
   // depth
 
-  glGenTextures( 1, &depthTexture );
+  if (hasDepth) {
 
-  glBindTexture( GL_TEXTURE_2D, depthTexture );
+    glGenTextures( 1, &depthTexture );
 
-  glTexImage2D( GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, fbWidth, fbHeight, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL );
+    glBindTexture( GL_TEXTURE_2D, depthTexture );
 
-  glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-  glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, fbWidth, fbHeight, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL );
 
-  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0 );
+    glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+    glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+  }
 
-  // Declare the drawBuffers
+  // Attach the textures and declare the drawBuffers
 
   GLenum *drawBuffers = new GLenum[numTextures];
 
   for (int i=0; i<numTextures; i++)
     drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
 
-  glDrawBuffers( numTextures, drawBuffers );
+  for (int f=0; f<2; f++) {
+
+    glBindFramebuffer( GL_FRAMEBUFFER, f == 0 ? FBO : noDepthFBO );
+
+    for (int i=0; i<numTextures; i++)
+      glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, textures[i], 0 );
+
+    if (f == 0 && hasDepth)
+      glFramebufferTexture2D( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0 );
+
+    glDrawBuffers( numTextures, drawBuffers );
+
+    checkFramebuffer();
+  }
+
+  delete [] drawBuffers;
+
+  // Done
+
+  glBindTexture( GL_TEXTURE_2D, 0 );
+
+  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+}
+
 
-  // Check
+// Check that the bound framebuffer is complete
 
+void GBuffer::checkFramebuffer()
+
+{
   GLenum status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
 
   if (status != GL_FRAMEBUFFER_COMPLETE) {
@@ -111,12 +172,6 @@ GBuffer::GBuffer( unsigned int width, unsigned int height, int nTextures, GLFWwi
       cerr << "glCheckFramebufferStatus() failed.  Status = " << status << endl;
     exit(1);
   }
-
-  // Done
-
-  glBindTexture( GL_TEXTURE_2D, 0 );
-
-  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
 }
 
 
@@ -124,15 +179,20 @@ GBuffer::~GBuffer()
 
 {
   glDeleteFramebuffers( 1, &FBO );
+  glDeleteFramebuffers( 1, &noDepthFBO );
   glDeleteTextures( numTextures, textures );
-  glDeleteTextures( 1, &depthTexture );
+  if (hasDepth)
+    glDeleteTextures( 1, &depthTexture );
+
+  delete [] textures;
+  delete [] formats;
 }
 
 
-void GBuffer::BindForWriting()
+void GBuffer::BindForWriting( bool withDepth )
 
 {
-  glBindFramebuffer( GL_DRAW_FRAMEBUFFER, FBO );
+  glBindFramebuffer( GL_DRAW_FRAMEBUFFER, withDepth ? FBO : noDepthFBO );
 }
 
 
@@ -143,11 +203,21 @@ void GBuffer::BindForReading()
 }
 
 
+// Bind a texture to texture unit 'textureNumber'.  Texture
+// numTextures is the depth.
+
 void GBuffer::BindTexture( int textureNumber )
 
 {
-  glActiveTexture( GL_TEXTURE0 + textureNumber );
-  glBindTexture( GL_TEXTURE_2D, textures[ textureNumber ] );
+  BindTexture( textureNumber, textureNumber );
+}
+
+
+void GBuffer::BindTexture( int textureNumber, int unit )
+
+{
+  glActiveTexture( GL_TEXTURE0 + unit );
+  glBindTexture( GL_TEXTURE_2D, textureNumber == numTextures ? depthTexture : textures[ textureNumber ] );
 }
 
 
@@ -172,12 +242,31 @@ void GBuffer::setDrawBuffers( int numDrawBuffers, int *bufferIDs )
 }
 
 
-// Debugging output
+int GBuffer::bytesPerPixel()
+
+{
+  int total = (hasDepth ? 4 : 0);
+
+  for (int i=0; i<numTextures; i++) {
+    GLenum format, type;
+    int    bytes;
+    pixelFormat( formats[i], format, type, bytes );
+    total += bytes;
+  }
+
+  return total;
+}
+
+
+// Debugging output: the first four textures in the quadrants
+//
+// LL = texture 0
+// UL = texture 1
+// UR = texture 2
+// LR = texture 3
 //
-// LL = position
-// UL = colour
-// UR = normal
-// LR = depth
+// The depth texture can't be blitted into the window's colour buffer,
+// so it's left to the caller to draw it (see Renderer::drawDepthView()).
 
 
 void GBuffer::DrawGBuffers()
@@ -192,18 +281,24 @@ void GBuffer::DrawGBuffers()
 
   glBindFramebuffer( GL_READ_FRAMEBUFFER, FBO );
 
-  GLsizei halfWidth = (GLsizei)(fbWidth / 2.0f);
-  GLsizei halfHeight = (GLsizei)(fbHeight / 2.0f);
+  GLsizei halfWidth = (GLsizei)(windowWidth / 2.0f);
+  GLsizei halfHeight = (GLsizei)(windowHeight / 2.0f);
 
   SetReadBuffer( 0 );
   glBlitFramebuffer(0, 0, fbWidth, fbHeight, 0, 0,                 halfWidth, halfHeight,      GL_COLOR_BUFFER_BIT, GL_NEAREST);
 
-  SetReadBuffer( 1 );
-  glBlitFramebuffer(0, 0, fbWidth, fbHeight, 0, halfHeight,         halfWidth, fbHeight,   GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  if (numTextures > 1) {
+    SetReadBuffer( 1 );
+    glBlitFramebuffer(0, 0, fbWidth, fbHeight, 0, halfHeight,         halfWidth, windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  }
 
-  SetReadBuffer( 2 );
-  glBlitFramebuffer(0, 0, fbWidth, fbHeight, halfWidth, halfHeight, fbWidth, fbHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  if (numTextures > 2) {
+    SetReadBuffer( 2 );
+    glBlitFramebuffer(0, 0, fbWidth, fbHeight, halfWidth, halfHeight, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  }
 
-  SetReadBuffer( 3 );
-  glBlitFramebuffer(0, 0, fbWidth, fbHeight, halfWidth, 0,          fbWidth, halfHeight,   GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  if (numTextures > 3) {
+    SetReadBuffer( 3 );
+    glBlitFramebuffer(0, 0, fbWidth, fbHeight, halfWidth, 0,          windowWidth, halfHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  }
 }
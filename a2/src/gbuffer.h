@@ -15,36 +15,63 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// A framebuffer with colour textures of the given internal formats
+// (e.g. GL_RGBA8, GL_RG16F, GL_R16F) and a depth texture.  The depth
+// texture can be read like the others: it's texture number
+// numTextures, so it's on texture unit numTextures in BindTexture().
+//
+// The colour textures are attached to two FBOs, one with the depth
+// texture and one without, so that a pass that reads depths can write
+// to the other textures without also having the depth texture
+// attached (which would be a feedback loop).
+//
+// The textures are the size of the window's framebuffer times
+// 'scale'.  A GBuffer for intermediate results can be made without a
+// depth texture.
+
+
 #ifndef GBUFFER_H
 #define	GBUFFER_H
 
 class GBuffer
 
 {
-  GLuint FBO;
+  GLuint FBO;			/* colour textures and depth */
+  GLuint noDepthFBO;		/* colour textures only */
   GLuint *textures;
+  GLenum *formats;
   GLuint depthTexture;
+  bool   hasDepth;
 
-  int fbWidth, fbHeight;
+  int fbWidth, fbHeight;	/* of the textures */
+  int windowWidth, windowHeight; /* of the window's framebuffer */
 
   int numTextures;
 
+  void checkFramebuffer();
+
  public:
 
-  GBuffer( unsigned int width, unsigned int height, int nTextures, GLFWwindow *window );
+  GBuffer( unsigned int width, unsigned int height, int nTextures, GLenum *internalFormats, GLFWwindow *window,
+	   float scale = 1, bool withDepth = true );
 
   ~GBuffer();
 
-  void BindForWriting();
+  void BindForWriting( bool withDepth = true );
   void BindForReading();  
   void BindTexture( int textureNumber );
+  void BindTexture( int textureNumber, int unit );
     
   void SetReadBuffer( int textureNumber );
 
   void setDrawBuffers( int numDrawBuffers, int *bufferIDs );
 
+  int  bytesPerPixel();		/* of all textures, including depth */
+
+  int  width()  { return fbWidth; }
+  int  height() { return fbHeight; }
+
   void DrawGBuffers();
 };
 
 #endif
-
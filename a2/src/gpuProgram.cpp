@@ -170,7 +170,7 @@ void GPUProgram::init( char *vsText, char *fsText )
 }
 
 
-void GPUProgram::initFromFile( const char *vsFile, const char *fsFile ) 
+void GPUProgram::initFromFile( const char *vsFile, const char *fsFile, const char *fsCommonFile ) 
 
 {
   char* vsText = textFileRead(vsFile);	
@@ -187,7 +187,55 @@ void GPUProgram::initFromFile( const char *vsFile, const char *fsFile )
     return;
   }
 
+  if (fsCommonFile != NULL) {
+    char *commonText = textFileRead(fsCommonFile);
+    char *text = insertAfterVersion( fsText, commonText );
+    free( fsText );
+    free( commonText );
+    fsText = text;
+  }
+
   // Init the shader using these strings
     
   init( vsText, fsText );
 }
+
+
+// Return a copy of a shader's text with 'common' inserted after the
+// #version line, which must come first.  A #line directive follows
+// it so that errors are still reported at the shader's own line
+// numbers.
+
+char *GPUProgram::insertAfterVersion( char *text, char *common )
+
+{
+  char *p = strstr( text, "#version" );
+  if (p == NULL) {
+    cerr << "No \"#version\" was found in fragment shader." << endl;
+    exit(1);
+  }
+
+  p = strchr( p, '\n' );
+  if (p == NULL) {
+    cerr << "Nothing follows \"#version\" in fragment shader." << endl;
+    exit(1);
+  }
+  p++;
+
+  int line = 1;
+  for (char *q=text; q<p; q++)
+    if (*q == '\n')
+      line++;
+
+  char directive[32];
+  sprintf( directive, "\n#line %d\n", line );
+
+  char *result = (char *) malloc( strlen(text) + strlen(common) + strlen(directive) + 1 );
+
+  strncpy( result, text, p-text );
+  strcpy( result + (p-text), common );
+  strcat( result, directive );
+  strcat( result, p );
+
+  return result;
+}
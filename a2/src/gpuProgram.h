@@ -21,6 +21,13 @@ class GPUProgram {
     initFromFile( vsFile, fsFile );
   }
 
+  // With code shared between fragment shaders, which is inserted
+  // after the fragment shader's #version line
+
+  GPUProgram( const char *vsFile, const char *fsFile, const char *fsCommonFile ) {
+    initFromFile( vsFile, fsFile, fsCommonFile );
+  }
+
   ~GPUProgram() {
     glDetachShader( program_id, shader_vp );
     glDeleteShader( shader_vp );
@@ -85,7 +92,8 @@ class GPUProgram {
       exit(1);
   }
 
-  void initFromFile( const char *vsFile, const char *fsFile );
+  void initFromFile( const char *vsFile, const char *fsFile, const char *fsCommonFile = NULL );
+  char *insertAfterVersion( char *text, char *common );
   void validateShader( GLuint shader, const char* file = 0 );
   void validateProgram();
 };
@@ -0,0 +1,396 @@
+/* ktxCache.cpp
+ *
+ * Read and write the texture cache of a wfTexture, and build the
+ * mipmaps that go into it.
+ *
+ * The cache of an image file (e.g. brick.ppm) is a KTX 1.1 file next
+ * to it (brick.ppm.ktx) that holds the image and all of its mipmap
+ * levels, uncompressed, so that they can be sent to OpenGL without
+ * decoding the image or calling glGenerateMipmap().  The mipmaps are
+ * built with a 2x2 box filter, in parallel.
+ *
+ * The cache is ignored (and rewritten) if the size or modification
+ * time of the image file, which are stored in the "wfSource" key,
+ * have changed.
+ *
+ * Layout (see the KTX 1.1 specification; everything is 4-byte
+ * aligned):
+ *
+ *   identifier  endianness
+ *   glType  glTypeSize  glFormat  glInternalFormat  glBaseInternalFormat
+ *   pixelWidth  pixelHeight  pixelDepth  numberOfArrayElements
+ *   numberOfFaces  numberOfMipmapLevels  bytesOfKeyValueData
+ *   key/value pairs: "KTXorientation" and "wfSource"
+ *   for each mipmap level:
+ *     imageSize  rows (each padded to four bytes)
+ *
+ * As in glTexImage2D(), the first row is the bottom of the image.
+ */
+
+
+#include "headers.h"
+#include "textureCache.h"
+#include "mappedFile.h"
+#include "parallel.h"
+
+
+static const unsigned char KTX_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+#define KTX_ENDIANNESS  0x04030201
+#define KTX_ALIGNMENT   4	/* of rows in the file */
+#define KTX_SOURCE_KEY  "wfSource"
+
+struct KTXHeader {
+  unsigned char identifier[12];
+  GLuint endianness;
+  GLuint glType;
+  GLuint glTypeSize;
+  GLuint glFormat;
+  GLuint glInternalFormat;
+  GLuint glBaseInternalFormat;
+  GLuint pixelWidth;
+  GLuint pixelHeight;
+  GLuint pixelDepth;
+  GLuint numberOfArrayElements;
+  GLuint numberOfFaces;
+  GLuint numberOfMipmapLevels;
+  GLuint bytesOfKeyValueData;
+};
+
+
+// Bytes in a row of 'width' pixels, padded to 'alignment'
+
+static int rowBytes( int width, int bytesPerPixel, int alignment )
+
+{
+  return (width * bytesPerPixel + alignment - 1) / alignment * alignment;
+}
+
+
+static char *cacheFilename( const char *filename )
+
+{
+  char *name = new char[ strlen(filename) + 5 ];
+  strcpy( name, filename );
+  strcat( name, ".ktx" );
+  return name;
+}
+
+
+// The value of the "wfSource" key: the image file's size and
+// modification time
+
+static void sourceStamp( const char *filename, char *stamp )
+
+{
+  unsigned long long size = 0;
+  long long mtime = 0;
+
+  fileStamp( filename, size, mtime );
+  sprintf( stamp, "%llu %lld", size, mtime );
+}
+
+
+// Build the mipmap levels below levels[0] by repeatedly halving the
+// image with a 2x2 box filter.  The rows of each level are tightly
+// packed, as are those of levels[0].  All levels but the first are
+// stored in one new buffer, 'mipmaps'.
+
+void wfTexture::buildMipmaps()
+
+{
+  int n = (hasAlpha ? 4 : 3);
+
+  // Find the size of all levels
+
+  int size = 0;
+  int w = width, h = height;
+
+  numLevels = 1;
+
+  while ((w > 1 || h > 1) && numLevels < MAX_TEXTURE_LEVELS) {
+    w = (w > 1 ? w/2 : 1);
+    h = (h > 1 ? h/2 : 1);
+    size += w * h * n;
+    numLevels++;
+  }
+
+  mipmaps = new GLubyte[ size ];
+
+  // Build each level from the one above it.  Rows are done in
+  // parallel.  A source dimension of odd size loses its last row or
+  // column, as with glGenerateMipmap().
+
+  levels[0] = texmap;
+  rowAlignment = 1;
+
+  w = width;
+  h = height;
+
+  GLubyte *next = mipmaps;
+
+  for (int l=1; l<numLevels; l++) {
+
+    int w2 = (w > 1 ? w/2 : 1);
+    int h2 = (h > 1 ? h/2 : 1);
+
+    GLubyte *src = levels[l-1];
+    GLubyte *dst = next;
+
+    parallelFor( h2, [&]( int y ) {
+
+      GLubyte *row0 = src + (2*y < h ? 2*y : h-1) * w * n;
+      GLubyte *row1 = src + (2*y+1 < h ? 2*y+1 : h-1) * w * n;
+      GLubyte *out  = dst + y * w2 * n;
+
+      int dx = (w > 1 ? n : 0);	// offset to the second column of each 2x2 block
+
+      for (int x=0; x<w2; x++) {
+	GLubyte *a = row0 + 2*x*n;
+	GLubyte *b = row1 + 2*x*n;
+	for (int k=0; k<n; k++)
+	  out[x*n+k] = (a[k] + a[k+dx] + b[k] + b[k+dx] + 2) >> 2;
+      }
+    }, 16 );
+
+    levels[l] = dst;
+    next += w2 * h2 * n;
+
+    w = w2;
+    h = h2;
+  }
+}
+
+
+// Read the texture and its mipmaps from the cache of 'filename'.
+// Returns false if there's no valid cache.  The levels point into the
+// memory-mapped cache file, which stays mapped until the texture is
+// freed.
+
+bool wfTexture::readCache( char *filename )
+
+{
+  char *cacheName = cacheFilename( filename );
+
+  MappedFile *file = new MappedFile();
+  bool opened = file->open( cacheName );
+
+  delete [] cacheName;
+
+  if (!opened || file->size() < sizeof(KTXHeader)) {
+    delete file;
+    return false;
+  }
+
+  const char *data = file->data();
+  const char *end  = data + file->size();
+
+  KTXHeader header;
+  memcpy( &header, data, sizeof(header) );
+
+  // Only the uncompressed 2D RGB and RGBA textures written by
+  // writeCache() are handled
+
+  bool ok = (memcmp( header.identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER) ) == 0 &&
+	     header.endianness == KTX_ENDIANNESS &&
+	     header.glType == GL_UNSIGNED_BYTE &&
+	     (header.glFormat == GL_RGB || header.glFormat == GL_RGBA) &&
+	     header.pixelWidth > 0 && header.pixelHeight > 0 && header.pixelDepth == 0 &&
+	     header.numberOfArrayElements == 0 && header.numberOfFaces == 1 &&
+	     header.numberOfMipmapLevels >= 1 && header.numberOfMipmapLevels <= MAX_TEXTURE_LEVELS &&
+	     header.bytesOfKeyValueData <= (size_t) (end - data) - sizeof(header));
+
+  // Check that the image hasn't changed since the cache was written
+
+  if (ok) {
+
+    char expected[200];
+    int  expectedSize = sizeof(KTX_SOURCE_KEY);
+
+    strcpy( expected, KTX_SOURCE_KEY );
+    sourceStamp( filename, &expected[expectedSize] );
+    expectedSize += strlen( &expected[expectedSize] ) + 1;
+
+    bool found = false;
+
+    const char *p     = data + sizeof(header);
+    const char *kvEnd = p + header.bytesOfKeyValueData;
+
+    while (p + 4 <= kvEnd) {
+
+      GLuint size;
+      memcpy( &size, p, sizeof(size) );
+      p += 4;
+
+      if (size > (size_t) (kvEnd - p))
+	break;
+
+      if (size == (GLuint) expectedSize && memcmp( p, expected, size ) == 0)
+	found = true;
+
+      p += (size + 3) & ~3;
+    }
+
+    ok = found;
+  }
+
+  if (!ok) {
+    delete file;
+    return false;
+  }
+
+  // Find the levels
+
+  int n = (header.glFormat == GL_RGBA ? 4 : 3);
+  int w = header.pixelWidth;
+  int h = header.pixelHeight;
+
+  const char *p = data + sizeof(header) + header.bytesOfKeyValueData;
+
+  for (int l=0; l<(int) header.numberOfMipmapLevels; l++) {
+
+    GLuint imageSize;
+
+    if (end - p < 4) {
+      ok = false;
+      break;
+    }
+
+    memcpy( &imageSize, p, sizeof(imageSize) );
+    p += 4;
+
+    if (imageSize != (GLuint) (rowBytes( w, n, KTX_ALIGNMENT ) * h) || imageSize > (size_t) (end - p)) {
+      ok = false;
+      break;
+    }
+
+    levels[l] = (GLubyte *) p;
+    p += imageSize;
+
+    w = (w > 1 ? w/2 : 1);
+    h = (h > 1 ? h/2 : 1);
+  }
+
+  if (!ok) {
+    delete file;
+    return false;
+  }
+
+  width        = header.pixelWidth;
+  height       = header.pixelHeight;
+  hasAlpha     = (n == 4);
+  numLevels    = header.numberOfMipmapLevels;
+  rowAlignment = KTX_ALIGNMENT;
+  texmap       = levels[0];
+  ktxFile      = file;
+
+  return true;
+}
+
+
+// Write the texture and its mipmaps to the cache of 'filename'
+
+void wfTexture::writeCache( char *filename )
+
+{
+  char *cacheName = cacheFilename( filename );
+
+  // Write to a temporary file, then rename it, so that a partly
+  // written cache is never read.
+
+  char *tmpName = new char[ strlen(cacheName) + 5 ];
+  strcpy( tmpName, cacheName );
+  strcat( tmpName, ".tmp" );
+
+  FILE *f = fopen( tmpName, "wb" );
+
+  if (f == NULL) {
+    cerr << "Warning: couldn't write texture cache '" << tmpName << "'" << endl;
+    delete [] tmpName;
+    delete [] cacheName;
+    return;
+  }
+
+  int n = (hasAlpha ? 4 : 3);
+
+  // Key/value pairs, each a size followed by the key and value (each
+  // with a terminating NUL) and padded to four bytes
+
+  char stamp[100];
+  sourceStamp( filename, stamp );
+
+  const char *keys[2]   = { "KTXorientation", KTX_SOURCE_KEY };
+  const char *values[2] = { "S=r,T=u", stamp };
+
+  char   keyValueData[256];
+  GLuint keyValueSize = 0;
+
+  memset( keyValueData, 0, sizeof(keyValueData) );
+
+  for (int i=0; i<2; i++) {
+    GLuint size = strlen(keys[i]) + 1 + strlen(values[i]) + 1;
+    memcpy( &keyValueData[keyValueSize], &size, sizeof(size) );
+    strcpy( &keyValueData[keyValueSize+4], keys[i] );
+    strcpy( &keyValueData[keyValueSize+4+strlen(keys[i])+1], values[i] );
+    keyValueSize += 4 + ((size + 3) & ~3);
+  }
+
+  // Header
+
+  KTXHeader header;
+
+  memcpy( header.identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER) );
+  header.endianness            = KTX_ENDIANNESS;
+  header.glType                = GL_UNSIGNED_BYTE;
+  header.glTypeSize            = 1;
+  header.glFormat              = (hasAlpha ? GL_RGBA : GL_RGB);
+  header.glInternalFormat      = (hasAlpha ? GL_RGBA8 : GL_RGB8);
+  header.glBaseInternalFormat  = (hasAlpha ? GL_RGBA : GL_RGB);
+  header.pixelWidth            = width;
+  header.pixelHeight           = height;
+  header.pixelDepth            = 0;
+  header.numberOfArrayElements = 0;
+  header.numberOfFaces         = 1;
+  header.numberOfMipmapLevels  = numLevels;
+  header.bytesOfKeyValueData   = keyValueSize;
+
+  bool ok = (fwrite( &header, sizeof(header), 1, f ) == 1 &&
+	     fwrite( keyValueData, keyValueSize, 1, f ) == 1);
+
+  // Levels, with each row padded to KTX_ALIGNMENT bytes
+
+  static const GLubyte zeros[KTX_ALIGNMENT] = { 0 };
+
+  int w = width, h = height;
+
+  for (int l=0; l<numLevels && ok; l++) {
+
+    int    srcRowBytes = rowBytes( w, n, rowAlignment );
+    int    dstRowBytes = rowBytes( w, n, KTX_ALIGNMENT );
+    GLuint imageSize   = dstRowBytes * h;
+
+    ok = (fwrite( &imageSize, sizeof(imageSize), 1, f ) == 1);
+
+    for (int y=0; y<h && ok; y++)
+      ok = (fwrite( levels[l] + y * srcRowBytes, w * n, 1, f ) == 1 &&
+	    (dstRowBytes == w * n || fwrite( zeros, dstRowBytes - w * n, 1, f ) == 1));
+
+    w = (w > 1 ? w/2 : 1);
+    h = (h > 1 ? h/2 : 1);
+  }
+
+  if (fclose( f ) != 0)
+    ok = false;
+
+#ifdef _WIN32
+  remove( cacheName );		// rename() won't replace a file on Windows
+#endif
+
+  if (!ok || rename( tmpName, cacheName ) != 0) {
+    cerr << "Warning: couldn't write texture cache '" << cacheName << "'" << endl;
+    remove( tmpName );
+  }
+
+  delete [] tmpName;
+  delete [] cacheName;
+}
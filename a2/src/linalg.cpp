@@ -418,6 +418,58 @@ mat4 identity4()
 }
 
 
+// Inverse by Gauss-Jordan elimination with partial pivoting.  A
+// singular matrix gives the identity.
+
+mat4 inverse( mat4 const& m )
+
+{
+  double a[4][8];
+
+  for (int i=0; i<4; i++)
+    for (int j=0; j<4; j++) {
+      a[i][j]   = m[i][j];
+      a[i][j+4] = (i == j);
+    }
+
+  for (int c=0; c<4; c++) {
+
+    int pivot = c;
+    for (int r=c+1; r<4; r++)
+      if (fabs(a[r][c]) > fabs(a[pivot][c]))
+	pivot = r;
+
+    if (a[pivot][c] == 0)
+      return identity4();
+
+    for (int j=0; j<8; j++) {
+      double t = a[c][j];
+      a[c][j] = a[pivot][j];
+      a[pivot][j] = t;
+    }
+
+    double k = 1 / a[c][c];
+    for (int j=0; j<8; j++)
+      a[c][j] *= k;
+
+    for (int r=0; r<4; r++)
+      if (r != c && a[r][c] != 0) {
+	double f = a[r][c];
+	for (int j=0; j<8; j++)
+	  a[r][j] -= f * a[c][j];
+      }
+  }
+
+  mat4 out;
+
+  for (int i=0; i<4; i++)
+    for (int j=0; j<4; j++)
+      out[i][j] = a[i][j+4];
+
+  return out;
+}
+
+
 mat4 frustum( float l, float r, float b, float t, float n, float f )
 
 {
@@ -136,6 +136,7 @@ public:
 
 
 mat4 identity4();
+mat4 inverse( mat4 const& m );
 
 
 // Scalar/vec3 multiplication
@@ -0,0 +1,115 @@
+// mappedFile.cpp
+
+
+#include "mappedFile.h"
+
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+  #include <cstdlib>
+#else
+  #include <sys/mman.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+
+bool MappedFile::open( const char *filename )
+
+{
+  close();
+
+#ifdef _WIN32
+
+  FILE *f = fopen( filename, "rb" );
+  if (!f)
+    return false;
+
+  fseek( f, 0, SEEK_END );
+  length = ftell( f );
+  fseek( f, 0, SEEK_SET );
+
+  if (length > 0) {
+    addr = new char[ length ];
+    if (fread( addr, 1, length, f ) != length) {
+      delete [] addr;
+      addr = NULL;
+      length = 0;
+      fclose( f );
+      return false;
+    }
+  }
+
+  fclose( f );
+  isMapped = false;
+  return true;
+
+#else
+
+  int fd = ::open( filename, O_RDONLY );
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat( fd, &st ) != 0) {
+    ::close( fd );
+    return false;
+  }
+
+  length = st.st_size;
+
+  if (length > 0) {
+
+    void *p = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+    if (p == MAP_FAILED) {
+      length = 0;
+      ::close( fd );
+      return false;
+    }
+
+    addr = (char *) p;
+    isMapped = true;
+  }
+
+  ::close( fd );		// the mapping stays valid after the descriptor is closed
+  return true;
+
+#endif
+}
+
+
+void MappedFile::close()
+
+{
+  if (addr != NULL) {
+#ifdef _WIN32
+    delete [] addr;
+#else
+    if (isMapped)
+      munmap( addr, length );
+    else
+      delete [] addr;
+#endif
+  }
+
+  addr = NULL;
+  length = 0;
+  isMapped = false;
+}
+
+
+bool fileStamp( const char *filename, unsigned long long &size, long long &mtime )
+
+{
+  struct stat st;
+
+  if (stat( filename, &st ) != 0)
+    return false;
+
+  size = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
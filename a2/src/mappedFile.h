@@ -0,0 +1,46 @@
+// mappedFile.h
+//
+// Read-only view of a whole file in memory.  The file is
+// memory-mapped where the OS supports it and is read into a buffer
+// otherwise.
+
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+
+
+class MappedFile {
+
+  char   *addr;		/* start of file contents */
+  size_t  length;	/* number of bytes in file */
+  bool    isMapped;	/* true if mmapped; false if read into a buffer */
+
+ public:
+
+  MappedFile() {
+    addr = NULL;
+    length = 0;
+    isMapped = false;
+  }
+
+  ~MappedFile() {
+    close();
+  }
+
+  bool open( const char *filename ); /* returns false if file cannot be read */
+  void close();
+
+  const char *data() { return addr; }
+  size_t      size() { return length; }
+};
+
+
+// Find the size and modification time of a file, e.g. to check that
+// a cache made from it is up to date.  Returns false if the file
+// doesn't exist.
+
+bool fileStamp( const char *filename, unsigned long long &size, long long &mtime );
+
+#endif
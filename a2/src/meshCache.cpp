@@ -0,0 +1,524 @@
+/* meshCache.cpp
+ *
+ * Read and write the mesh cache of a wfModel.
+ *
+ * The cache holds everything that is sent to OpenGL: each group's
+ * interleaved vertex buffer and index buffer, the material table, and
+ * the model extents.  It is keyed on the path, modification time, and
+ * size of the .obj file and of its material library, so it is ignored
+ * (and rewritten) when any of those change.
+ *
+ * Everything in the file is in native byte order and is aligned to
+ * four bytes, so the vertex and index buffers can be passed directly
+ * from the memory-mapped file to glBufferData().
+ *
+ * Layout:
+ *
+ *   "WFCACHE\0"  version  byte-order mark  newGroupWithNewMaterial  optimizeMeshes  generateLODs
+ *   generateNormals  creaseAngle
+ *   number of source files, then for each: path, size, mtime
+ *   hasVertexNormals  hasVertexTexCoords  vertexSize
+ *   objToWorldTransform  centre  radius  min  max
+ *   mtllib name
+ *   number of materials, then for each:
+ *     name  diffuse  ambient  specular  emissive  shininess  texmap filename
+ *   number of groups, then for each:
+ *     name  material index  numVertices  numIndices  numLODs  lodNumIndices  min  max
+ *     vertices  indices
+ *
+ * Strings are stored as a length followed by the characters, padded
+ * to four bytes.
+ */
+
+
+#include "headers.h"
+#include "wavefront.h"
+#include "mappedFile.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+#define CACHE_MAGIC     "WFCACHE"
+#define CACHE_VERSION   5
+#define CACHE_BYTEORDER 0x01020304
+
+
+// Return the material library path relative to the model's directory
+
+static char *mtllibPath( const char *modelPath, const char *mtllib )
+
+{
+  const char *s = strrchr( modelPath, '/' );
+  int dirLen = (s ? s - modelPath + 1 : 0);
+
+  char *path = new char[ dirLen + strlen(mtllib) + 1 ];
+
+  strncpy( path, modelPath, dirLen );
+  strcpy( path + dirLen, mtllib );
+
+  return path;
+}
+
+
+/* Write values to a cache file, keeping everything aligned to four
+ * bytes.  Errors are remembered and checked once at the end.
+ */
+
+
+class CacheWriter {
+
+  FILE *file;
+
+ public:
+
+  bool ok;
+
+  CacheWriter( FILE *f ) {
+    file = f;
+    ok = true;
+  }
+
+  void putBytes( const void *p, size_t n ) {
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    if (n > 0 && fwrite( p, 1, n, file ) != n)
+      ok = false;
+    if (n % 4 != 0 && fwrite( zeros, 1, 4 - n % 4, file ) != 4 - n % 4)
+      ok = false;
+  }
+
+  void putInt( unsigned int x )     { putBytes( &x, sizeof(x) ); }
+  void putFloat( float x )          { putBytes( &x, sizeof(x) ); }
+  void putLong( long long x )       { putBytes( &x, sizeof(x) ); }
+  void putFloats( const float *x, int n ) { putBytes( x, n * sizeof(float) ); }
+
+  void putVec3( vec3 v ) {
+    putFloat( v.x );
+    putFloat( v.y );
+    putFloat( v.z );
+  }
+
+  void putString( const char *s ) {
+    if (s == NULL)
+      s = "";
+    putInt( strlen(s) );
+    putBytes( s, strlen(s) );
+  }
+};
+
+
+/* Read values from a memory-mapped cache file.  Reading past the end
+ * sets 'ok' to false and returns zeros, so a truncated file is
+ * detected once at the end instead of after every read.
+ */
+
+
+class CacheReader {
+
+  const char *p, *end;
+
+ public:
+
+  bool ok;
+
+  CacheReader( const char *data, size_t size ) {
+    p = data;
+    end = data + size;
+    ok = true;
+  }
+
+  const void *getBytes( size_t n ) {
+    size_t padded = (n + 3) & ~(size_t) 3;
+    if (!ok || (size_t) (end - p) < padded) {
+      ok = false;
+      return NULL;
+    }
+    const void *data = p;
+    p += padded;
+    return data;
+  }
+
+  unsigned int getInt() {
+    const void *data = getBytes( sizeof(unsigned int) );
+    return data ? * (const unsigned int *) data : 0;
+  }
+
+  float getFloat() {
+    const void *data = getBytes( sizeof(float) );
+    return data ? * (const float *) data : 0;
+  }
+
+  long long getLong() {
+    long long x = 0;
+    const void *data = getBytes( sizeof(long long) );
+    if (data)
+      memcpy( &x, data, sizeof(x) );
+    return x;
+  }
+
+  void getFloats( float *x, int n ) {
+    const void *data = getBytes( n * sizeof(float) );
+    if (data)
+      memcpy( x, data, n * sizeof(float) );
+  }
+
+  vec3 getVec3() {
+    float x = getFloat();
+    float y = getFloat();
+    float z = getFloat();
+    return vec3(x,y,z);
+  }
+
+  char *getString() {	// returns a new string that the caller must free()
+    unsigned int len = getInt();
+    const char *data = (const char *) getBytes( len );
+    if (!data)
+      return strdup( "" );
+    char *s = (char *) malloc( len+1 );
+    memcpy( s, data, len );
+    s[len] = '\0';
+    return s;
+  }
+
+  bool atEnd() {
+    return p == end;
+  }
+};
+
+
+// The name of the cache file for a model
+
+static char *cacheFilename( const char *filename )
+
+{
+  char *name = new char[ strlen(filename) + 7 ];
+  strcpy( name, filename );
+  strcat( name, ".cache" );
+  return name;
+}
+
+
+// Read the model from its cache.  Returns false if there is no cache
+// or if it is out of date or damaged, in which case the model is
+// left empty.
+
+bool wfModel::readCache( char *filename )
+
+{
+  char *cacheName = cacheFilename( filename );
+
+  MappedFile *file = new MappedFile();
+
+  if (!file->open( cacheName )) {
+    delete file;
+    delete [] cacheName;
+    return false;
+  }
+
+  delete [] cacheName;
+
+  CacheReader in( file->data(), file->size() );
+
+  // Check the header and that the source files haven't changed
+
+  const char *magic = (const char *) in.getBytes( sizeof(CACHE_MAGIC) );
+
+  bool valid = (magic != NULL &&
+		memcmp( magic, CACHE_MAGIC, sizeof(CACHE_MAGIC) ) == 0 &&
+		in.getInt() == CACHE_VERSION &&
+		in.getInt() == CACHE_BYTEORDER &&
+		in.getInt() == (unsigned int) newGroupWithNewMaterial &&
+		in.getInt() == (unsigned int) optimizeMeshes &&
+		in.getInt() == (unsigned int) generateLODs &&
+		in.getInt() == (unsigned int) generateNormals &&
+		in.getFloat() == creaseAngle);
+
+  unsigned int numSources = (valid ? in.getInt() : 0);
+
+  for (unsigned int i=0; i<numSources && valid; i++) {
+
+    char *path = in.getString();
+    unsigned long long size = in.getLong();
+    long long mtime = in.getLong();
+
+    unsigned long long currentSize;
+    long long currentMtime;
+
+    // The first source is the model itself, which must be at the
+    // same path.  Others are relative to the model.
+
+    valid = ((i > 0 || strcmp( path, filename ) == 0) &&
+	     fileStamp( path, currentSize, currentMtime ) &&
+	     size == currentSize && mtime == currentMtime);
+
+    free( path );
+  }
+
+  if (!valid || !in.ok) {
+    delete file;
+    return false;
+  }
+
+  // Model
+
+  hasVertexNormals   = in.getInt();
+  hasVertexTexCoords = in.getInt();
+  vertexSize         = in.getInt();
+
+  for (int r=0; r<4; r++)
+    for (int c=0; c<4; c++)
+      objToWorldTransform[r][c] = in.getFloat();
+
+  centre = in.getVec3();
+  radius = in.getFloat();
+  min    = in.getVec3();
+  max    = in.getVec3();
+
+  mtllibname = in.getString();
+  if (mtllibname[0] == '\0') {
+    free( mtllibname );
+    mtllibname = NULL;
+  }
+
+  // Materials
+
+  vertices.clear();
+  normals.clear();
+  texcoords.clear();
+  facetnorms.clear();
+  materials.clear();
+  groups.clear();
+
+  unsigned int numMaterials = in.getInt();
+
+  for (unsigned int i=0; i<numMaterials && in.ok; i++) {
+
+    char *name = in.getString();
+    wfMaterial *mat = new wfMaterial( name );
+    free( name );
+
+    in.getFloats( mat->diffuse, 4 );
+    in.getFloats( mat->ambient, 4 );
+    in.getFloats( mat->specular, 4 );
+    in.getFloats( mat->emissive, 4 );
+    mat->shininess = in.getFloat();
+
+    mat->texmapFilename = in.getString();
+    if (mat->texmapFilename[0] == '\0') {
+      free( mat->texmapFilename );
+      mat->texmapFilename = NULL;
+    }
+
+    materials.add( mat );
+  }
+
+  // Groups
+
+  unsigned int numGroups = in.getInt();
+
+  for (unsigned int i=0; i<numGroups && in.ok; i++) {
+
+    char *name = in.getString();
+    wfGroup *group = new wfGroup( name );
+    free( name );
+
+    unsigned int materialIndex = in.getInt();
+    if (materialIndex >= (unsigned int) materials.size())
+      in.ok = false;
+    else
+      group->material = materials[ materialIndex ];
+
+    group->numVertices  = in.getInt();
+    group->numIndices   = in.getInt();
+    group->numLODs      = in.getInt();
+
+    if (group->numLODs < 1 || group->numLODs > MAX_LODS) {
+      in.ok = false;
+      group->numLODs = 1;
+    }
+
+    int lodIndices = 0;
+    for (int l=0; l<group->numLODs; l++) {
+      group->lodNumIndices[l] = in.getInt();
+      if (group->lodNumIndices[l] < 0)
+	in.ok = false;
+      lodIndices += group->lodNumIndices[l];
+    }
+
+    if (lodIndices != group->numIndices)
+      in.ok = false;
+
+    group->min = in.getVec3();
+    group->max = in.getVec3();
+
+    group->vertexBuffer = (GLfloat *) in.getBytes( (size_t) group->numVertices * vertexSize * sizeof(GLfloat) );
+    group->indexBuffer  = (GLuint *) in.getBytes( (size_t) group->numIndices * sizeof(GLuint) );
+
+    for (int j=0; j<group->numIndices && in.ok; j++)
+      if (group->indexBuffer[j] >= (GLuint) group->numVertices)
+	in.ok = false;
+
+    groups.add( group );
+  }
+
+  if (!in.ok || !in.atEnd() || materials.size() == 0) {
+
+    cerr << "Warning: mesh cache for '" << filename << "' is damaged and will be rebuilt." << endl;
+
+    for (int i=0; i<materials.size(); i++)
+      delete materials[i];
+    for (int i=0; i<groups.size(); i++)
+      delete groups[i];
+
+    materials.clear();
+    groups.clear();
+
+    free( mtllibname );
+    mtllibname = NULL;
+    objToWorldTransform = identity4();
+
+    delete file;
+    return false;
+  }
+
+  // The texture maps aren't in the cache.  load() reads them next.
+
+  for (int i=0; i<materials.size(); i++)
+    if (materials[i]->texmapFilename != NULL)
+      materials[i]->loadTexmap( materials[i]->texmapFilename );
+
+  pathname = strdup( filename );
+
+  // The group buffers point into the cache, which stays mapped until
+  // finishLoading() has sent them all to OpenGL.
+
+  cacheFile = file;
+
+  return true;
+}
+
+
+// Write the model's cache.  This is called after buildBuffers().  If
+// the cache can't be written, a warning is printed and the model is
+// still usable.
+
+void wfModel::writeCache( char *filename )
+
+{
+  char *cacheName = cacheFilename( filename );
+
+  // Write to a temporary file, then rename it, so that a partly
+  // written cache is never read.
+
+  char *tmpName = new char[ strlen(cacheName) + 5 ];
+  strcpy( tmpName, cacheName );
+  strcat( tmpName, ".tmp" );
+
+  FILE *f = fopen( tmpName, "wb" );
+
+  if (f == NULL) {
+    cerr << "Warning: couldn't write mesh cache '" << tmpName << "'" << endl;
+    delete [] tmpName;
+    delete [] cacheName;
+    return;
+  }
+
+  CacheWriter out( f );
+
+  // Header
+
+  out.putBytes( CACHE_MAGIC, sizeof(CACHE_MAGIC) );
+  out.putInt( CACHE_VERSION );
+  out.putInt( CACHE_BYTEORDER );
+  out.putInt( newGroupWithNewMaterial );
+  out.putInt( optimizeMeshes );
+  out.putInt( generateLODs );
+  out.putInt( generateNormals );
+  out.putFloat( creaseAngle );
+
+  // Source files
+
+  char *mtllib = (mtllibname != NULL ? mtllibPath( filename, mtllibname ) : NULL);
+
+  const char *sources[2] = { filename, mtllib };
+  int numSources = (mtllib != NULL ? 2 : 1);
+
+  out.putInt( numSources );
+
+  for (int i=0; i<numSources; i++) {
+    unsigned long long size = 0;
+    long long mtime = 0;
+    fileStamp( sources[i], size, mtime );
+    out.putString( sources[i] );
+    out.putLong( size );
+    out.putLong( mtime );
+  }
+
+  delete [] mtllib;
+
+  // Model
+
+  out.putInt( hasVertexNormals );
+  out.putInt( hasVertexTexCoords );
+  out.putInt( vertexSize );
+
+  for (int r=0; r<4; r++)
+    for (int c=0; c<4; c++)
+      out.putFloat( modelTransform[r][c] );
+
+  out.putVec3( centre );
+  out.putFloat( radius );
+  out.putVec3( min );
+  out.putVec3( max );
+
+  out.putString( mtllibname );
+
+  // Materials
+
+  out.putInt( materials.size() );
+
+  for (int i=0; i<materials.size(); i++) {
+    wfMaterial *mat = materials[i];
+    out.putString( mat->name );
+    out.putFloats( mat->diffuse, 4 );
+    out.putFloats( mat->ambient, 4 );
+    out.putFloats( mat->specular, 4 );
+    out.putFloats( mat->emissive, 4 );
+    out.putFloat( mat->shininess );
+    out.putString( mat->texmapFilename );
+  }
+
+  // Groups
+
+  out.putInt( groups.size() );
+
+  for (int i=0; i<groups.size(); i++) {
+    wfGroup *group = groups[i];
+    out.putString( group->name );
+    out.putInt( materials.findIndex( group->material ) );
+    out.putInt( group->numVertices );
+    out.putInt( group->numIndices );
+    out.putInt( group->numLODs );
+    for (int l=0; l<group->numLODs; l++)
+      out.putInt( group->lodNumIndices[l] );
+    out.putVec3( group->min );
+    out.putVec3( group->max );
+    out.putBytes( group->vertexBuffer, (size_t) group->numVertices * vertexSize * sizeof(GLfloat) );
+    out.putBytes( group->indexBuffer, (size_t) group->numIndices * sizeof(GLuint) );
+  }
+
+  if (fclose( f ) != 0)
+    out.ok = false;
+
+#ifdef _WIN32
+  remove( cacheName );		// rename() won't replace a file on Windows
+#endif
+
+  if (!out.ok || rename( tmpName, cacheName ) != 0) {
+    cerr << "Warning: couldn't write mesh cache '" << cacheName << "'" << endl;
+    remove( tmpName );
+  }
+
+  delete [] tmpName;
+  delete [] cacheName;
+}
@@ -0,0 +1,423 @@
+// meshOptimize.cpp
+//
+// See meshOptimize.h
+
+
+#include "meshOptimize.h"
+
+
+// Reorder triangles for the vertex cache with Sander et al.'s Tipsify
+// algorithm.  Triangles are emitted in fans around a "fanning"
+// vertex.  The next fanning vertex is one of the vertices just
+// emitted that has triangles remaining and that will still be in the
+// cache when its fan is emitted.  If there is none, the most recently
+// emitted vertex with triangles remaining is used (a "dead end") and
+// a new cluster starts there.
+//
+// 'clusterStarts' gets the first triangle of each cluster.
+
+void reorderForVertexCache( GLuint *indices, int numIndices, int numVertices, int cacheSize, seq<int> &clusterStarts )
+
+{
+  int numTriangles = numIndices / 3;
+
+  clusterStarts.clear();
+
+  if (numTriangles == 0)
+    return;
+
+  // Triangles adjacent to each vertex: vertex v's triangles are
+  // adjTriangles[ adjStart[v] .. adjStart[v+1]-1 ]
+
+  int *adjStart = new int[ numVertices+1 ];
+  int *adjTriangles = new int[ numIndices ];
+  int *liveTriangles = new int[ numVertices ]; // count of unemitted adjacent triangles
+
+  for (int v=0; v<numVertices; v++)
+    liveTriangles[v] = 0;
+
+  for (int i=0; i<numIndices; i++)
+    liveTriangles[ indices[i] ]++;
+
+  adjStart[0] = 0;
+  for (int v=0; v<numVertices; v++)
+    adjStart[v+1] = adjStart[v] + liveTriangles[v];
+
+  int *fill = new int[ numVertices ];
+  for (int v=0; v<numVertices; v++)
+    fill[v] = adjStart[v];
+
+  for (int i=0; i<numIndices; i++)
+    adjTriangles[ fill[ indices[i] ]++ ] = i/3;
+
+  delete [] fill;
+
+  // State
+
+  int  *cacheTime = new int[ numVertices ];	// time at which vertex entered the cache
+  bool *emitted = new bool[ numTriangles ];
+  int  *deadEnds = new int[ numIndices ];	// stack of recently emitted vertices
+  int   numDeadEnds = 0;
+
+  int  *candidates = new int[ 3 * 64 ];	// vertices of the last fan (at most 3 per triangle)
+  int   maxCandidates = 3 * 64;
+
+  for (int v=0; v<numVertices; v++)
+    cacheTime[v] = 0;
+
+  for (int t=0; t<numTriangles; t++)
+    emitted[t] = false;
+
+  GLuint *output = new GLuint[ numIndices ];
+  int numOutput = 0;
+
+  int time = cacheSize+1;
+  int cursor = 0;		// for finding vertices with live triangles
+  int fanVertex = indices[0];
+
+  clusterStarts.add( 0 );
+
+  while (fanVertex >= 0) {
+
+    // Emit the unemitted triangles around the fanning vertex
+
+    int numCandidates = 0;
+
+    int fanSize = adjStart[fanVertex+1] - adjStart[fanVertex];
+    if (3 * fanSize > maxCandidates) {
+      delete [] candidates;
+      maxCandidates = 3 * fanSize;
+      candidates = new int[ maxCandidates ];
+    }
+
+    for (int a=adjStart[fanVertex]; a<adjStart[fanVertex+1]; a++) {
+
+      int t = adjTriangles[a];
+
+      if (emitted[t])
+	continue;
+
+      for (int k=0; k<3; k++) {
+
+	int v = indices[3*t+k];
+
+	output[ numOutput++ ] = v;
+	deadEnds[ numDeadEnds++ ] = v;
+	candidates[ numCandidates++ ] = v;
+	liveTriangles[v]--;
+
+	if (time - cacheTime[v] > cacheSize) { // not in cache, so now added
+	  cacheTime[v] = time;
+	  time++;
+	}
+      }
+
+      emitted[t] = true;
+    }
+
+    // Choose the next fanning vertex: the candidate that will be
+    // oldest in the cache (but still in it) after its fan is emitted
+
+    int bestVertex = -1;
+    int bestPriority = -1;
+
+    for (int c=0; c<numCandidates; c++) {
+
+      int v = candidates[c];
+
+      if (liveTriangles[v] > 0) {
+
+	int priority = 0;
+	if (time - cacheTime[v] + 2 * liveTriangles[v] <= cacheSize)
+	  priority = time - cacheTime[v];
+
+	if (priority > bestPriority) {
+	  bestPriority = priority;
+	  bestVertex = v;
+	}
+      }
+    }
+
+    // None?  Then it's a dead end.  Try recently used vertices, then
+    // any vertex.
+
+    if (bestVertex < 0) {
+
+      while (numDeadEnds > 0 && bestVertex < 0) {
+	int v = deadEnds[ --numDeadEnds ];
+	if (liveTriangles[v] > 0)
+	  bestVertex = v;
+      }
+
+      while (bestVertex < 0 && cursor < numVertices) {
+	if (liveTriangles[cursor] > 0)
+	  bestVertex = cursor;
+	else
+	  cursor++;
+      }
+
+      if (bestVertex >= 0)
+	clusterStarts.add( numOutput/3 );
+    }
+
+    fanVertex = bestVertex;
+  }
+
+  memcpy( indices, output, numIndices * sizeof(GLuint) );
+
+  delete [] output;
+  delete [] candidates;
+  delete [] deadEnds;
+  delete [] emitted;
+  delete [] cacheTime;
+  delete [] liveTriangles;
+  delete [] adjTriangles;
+  delete [] adjStart;
+}
+
+
+// Split the clusters from reorderForVertexCache() into smaller ones
+// so that reorderForOverdraw() has more freedom.  Each cluster starts
+// with an empty cache, so costs a few more cache misses; a cluster is
+// ended only where that keeps its ACMR within 'threshold' times that
+// of the original cluster.
+
+static void splitClusters( const GLuint *indices, int numIndices, int numVertices, int cacheSize,
+			   float threshold, seq<int> &clusterStarts )
+
+{
+  int numTriangles = numIndices / 3;
+
+  int *cacheTime = new int[ numVertices ];
+  for (int v=0; v<numVertices; v++)
+    cacheTime[v] = -cacheSize-1;
+
+  int time = 0;
+
+  seq<int> newStarts;
+
+  for (int c=0; c<clusterStarts.size(); c++) {
+
+    int start = clusterStarts[c];
+    int end = (c < clusterStarts.size()-1 ? clusterStarts[c+1] : numTriangles);
+
+    // ACMR of the whole cluster, starting with an empty cache
+
+    time += cacheSize+1;
+    int clusterMisses = 0;
+
+    for (int i=3*start; i<3*end; i++)
+      if (time - cacheTime[ indices[i] ] > cacheSize) {
+	cacheTime[ indices[i] ] = time++;
+	clusterMisses++;
+      }
+
+    float maxACMR = threshold * clusterMisses / (float) (end - start);
+
+    // Split it
+
+    time += cacheSize+1;
+    int misses = 0;
+    int subStart = start;
+
+    newStarts.add( start );
+
+    for (int t=start; t<end; t++) {
+
+      for (int i=3*t; i<3*t+3; i++)
+	if (time - cacheTime[ indices[i] ] > cacheSize) {
+	  cacheTime[ indices[i] ] = time++;
+	  misses++;
+	}
+
+      if (t+1 < end && misses <= maxACMR * (t+1 - subStart)) {
+	newStarts.add( t+1 );
+	subStart = t+1;
+	misses = 0;
+	time += cacheSize+1;	// empty the cache
+      }
+    }
+  }
+
+  clusterStarts = newStarts;
+
+  delete [] cacheTime;
+}
+
+
+// A cluster of triangles and its sort key for reorderForOverdraw()
+
+struct Cluster {
+  int   start, end;		// triangles [start,end)
+  float key;
+};
+
+
+static int compareClusters( const void *a, const void *b )
+
+{
+  const Cluster *ca = (const Cluster *) a;
+  const Cluster *cb = (const Cluster *) b;
+
+  if (ca->key > cb->key)
+    return -1;
+  if (ca->key < cb->key)
+    return 1;
+
+  return ca->start - cb->start; // keep the sort stable
+}
+
+
+// Sort clusters so that those facing away from the mesh centre come
+// first.  The clusters from reorderForVertexCache() are first split
+// into smaller ones where that doesn't cost many more cache misses.
+//
+// A cluster's key is the dot product of its (area-weighted) normal
+// with the direction from the mesh centroid to the cluster centroid,
+// which is largest for clusters on the outside of the mesh and facing
+// outward.  Those are likely to be in front, from whichever direction
+// the mesh is seen.  The vertex positions are the first three floats
+// of each vertex.
+
+void reorderForOverdraw( GLuint *indices, int numIndices, const GLfloat *vertices, int numVertices, int vertexSize,
+			 int cacheSize, seq<int> &clusterStarts )
+
+{
+  int numTriangles = numIndices / 3;
+
+  splitClusters( indices, numIndices, numVertices, cacheSize, OVERDRAW_THRESHOLD, clusterStarts );
+
+  int numClusters = clusterStarts.size();
+
+  if (numClusters < 2)
+    return;
+
+  // Mesh centroid (area weighted)
+
+  vec3  meshCentroid(0,0,0);
+  float meshArea = 0;
+
+  Cluster *clusters = new Cluster[ numClusters ];
+  vec3    *clusterCentroids = new vec3[ numClusters ];
+  vec3    *clusterNormals = new vec3[ numClusters ];
+
+  for (int c=0; c<numClusters; c++) {
+
+    clusters[c].start = clusterStarts[c];
+    clusters[c].end = (c < numClusters-1 ? clusterStarts[c+1] : numTriangles);
+
+    vec3  centroid(0,0,0);
+    vec3  normal(0,0,0);
+    float area = 0;
+
+    for (int t=clusters[c].start; t<clusters[c].end; t++) {
+
+      vec3 &v0 = * (vec3 *) &vertices[ indices[3*t  ] * vertexSize ];
+      vec3 &v1 = * (vec3 *) &vertices[ indices[3*t+1] * vertexSize ];
+      vec3 &v2 = * (vec3 *) &vertices[ indices[3*t+2] * vertexSize ];
+
+      vec3  n = (v1 - v0) ^ (v2 - v0); // length is twice the area
+      float a = n.length();
+
+      centroid = centroid + (a / 3.0f) * (v0 + v1 + v2);
+      normal = normal + n;
+      area += a;
+    }
+
+    meshCentroid = meshCentroid + centroid;
+    meshArea += area;
+
+    clusterCentroids[c] = (area > 0 ? (1 / area) * centroid : vec3(0,0,0));
+    clusterNormals[c] = (normal.length() > 0 ? normal.normalize() : vec3(0,0,0));
+  }
+
+  if (meshArea > 0)
+    meshCentroid = (1 / meshArea) * meshCentroid;
+
+  for (int c=0; c<numClusters; c++)
+    clusters[c].key = (clusterCentroids[c] - meshCentroid) * clusterNormals[c];
+
+  qsort( clusters, numClusters, sizeof(Cluster), compareClusters );
+
+  // Copy the clusters in their new order
+
+  GLuint *output = new GLuint[ numIndices ];
+  int numOutput = 0;
+
+  for (int c=0; c<numClusters; c++) {
+    int n = 3 * (clusters[c].end - clusters[c].start);
+    memcpy( &output[numOutput], &indices[ 3 * clusters[c].start ], n * sizeof(GLuint) );
+    clusterStarts[c] = numOutput / 3;
+    numOutput += n;
+  }
+
+  memcpy( indices, output, numIndices * sizeof(GLuint) );
+
+  delete [] output;
+  delete [] clusterNormals;
+  delete [] clusterCentroids;
+  delete [] clusters;
+}
+
+
+// Renumber the vertices in the order in which they are first used
+// by the triangles, and move them in the vertex buffer to match.
+// Unused vertices go at the end.
+
+void reorderVertices( GLfloat *vertices, int numVertices, int vertexSize, GLuint *indices, int numIndices )
+
+{
+  const GLuint UNUSED = 0xffffffff;
+
+  GLuint *newIndex = new GLuint[ numVertices ];
+
+  for (int v=0; v<numVertices; v++)
+    newIndex[v] = UNUSED;
+
+  GLuint next = 0;
+
+  for (int i=0; i<numIndices; i++) {
+    if (newIndex[ indices[i] ] == UNUSED)
+      newIndex[ indices[i] ] = next++;
+    indices[i] = newIndex[ indices[i] ];
+  }
+
+  for (int v=0; v<numVertices; v++)
+    if (newIndex[v] == UNUSED)
+      newIndex[v] = next++;
+
+  GLfloat *newVertices = new GLfloat[ numVertices * vertexSize ];
+
+  for (int v=0; v<numVertices; v++)
+    memcpy( &newVertices[ newIndex[v] * vertexSize ], &vertices[ v * vertexSize ], vertexSize * sizeof(GLfloat) );
+
+  memcpy( vertices, newVertices, numVertices * vertexSize * sizeof(GLfloat) );
+
+  delete [] newVertices;
+  delete [] newIndex;
+}
+
+
+// Count the vertex transforms with a FIFO cache of 'cacheSize'
+// vertices
+
+int countCacheMisses( const GLuint *indices, int numIndices, int numVertices, int cacheSize )
+
+{
+  int *cacheTime = new int[ numVertices ]; // time at which vertex entered the cache
+
+  for (int v=0; v<numVertices; v++)
+    cacheTime[v] = -cacheSize-1;
+
+  int misses = 0;
+
+  for (int i=0; i<numIndices; i++)
+    if (misses - cacheTime[ indices[i] ] > cacheSize) {
+      cacheTime[ indices[i] ] = misses;
+      misses++;
+    }
+
+  delete [] cacheTime;
+
+  return misses;
+}
@@ -0,0 +1,50 @@
+// meshOptimize.h
+//
+// Reorder the triangles and vertices of an indexed triangle mesh so
+// that it renders faster, without changing what is drawn.
+//
+//   reorderForVertexCache()  Reorder triangles so that vertices are
+//                            reused while still in the GPU's
+//                            post-transform vertex cache ("Tipsify":
+//                            Sander, Nehab, and Barczak, "Fast
+//                            Triangle Reordering for Vertex Locality
+//                            and Reduced Overdraw", SIGGRAPH 2007).
+//                            Also returns where the new order has
+//                            clusters of triangles that can be
+//                            rearranged without many more cache misses.
+//
+//   reorderForOverdraw()     Sort those clusters so that ones facing
+//                            outward from the mesh centre are drawn
+//                            first, so that they hide (and cause
+//                            early-z rejection of) the rest.
+//
+//   reorderVertices()        Renumber vertices in order of first use,
+//                            so that vertex fetches are sequential.
+//
+//   countCacheMisses()       Simulate a FIFO vertex cache and return
+//                            the number of vertices transformed.
+//                            Divided by the number of triangles, this
+//                            is the ACMR (average cache miss ratio);
+//                            divided by the number of vertices, it is
+//                            the ATVR (average transform to vertex
+//                            ratio), which is 1.0 at best.
+
+
+#ifndef MESH_OPTIMIZE_H
+#define MESH_OPTIMIZE_H
+
+#include "headers.h"
+#include "seq.h"
+
+
+#define VERTEX_CACHE_SIZE  16	/* assumed size of the GPU vertex cache */
+#define OVERDRAW_THRESHOLD 1.05	/* max ACMR increase allowed by reorderForOverdraw() */
+
+
+void reorderForVertexCache( GLuint *indices, int numIndices, int numVertices, int cacheSize, seq<int> &clusterStarts );
+void reorderForOverdraw( GLuint *indices, int numIndices, const GLfloat *vertices, int numVertices, int vertexSize,
+			 int cacheSize, seq<int> &clusterStarts );
+void reorderVertices( GLfloat *vertices, int numVertices, int vertexSize, GLuint *indices, int numIndices );
+int  countCacheMisses( const GLuint *indices, int numIndices, int numVertices, int cacheSize );
+
+#endif
@@ -0,0 +1,422 @@
+// meshSimplify.cpp
+//
+// See meshSimplify.h
+
+
+#include "meshSimplify.h"
+
+#include <cstring>
+
+
+// The quadric of a vertex is a symmetric 4x4 matrix Q such that
+// [p 1] Q [p 1]^T is the sum of squared distances from p to the
+// planes of the vertex's triangles, each weighted by the triangle's
+// area.  Only the 10 coefficients of the upper triangle are stored:
+//
+//   0 1 2 3
+//     4 5 6
+//       7 8
+//         9
+
+static void addPlane( double *q, vec3 n, float d, float weight )
+
+{
+  q[0] += weight * n.x * n.x;
+  q[1] += weight * n.x * n.y;
+  q[2] += weight * n.x * n.z;
+  q[3] += weight * n.x * d;
+  q[4] += weight * n.y * n.y;
+  q[5] += weight * n.y * n.z;
+  q[6] += weight * n.y * d;
+  q[7] += weight * n.z * n.z;
+  q[8] += weight * n.z * d;
+  q[9] += weight * d * d;
+}
+
+
+// Error of moving a vertex to p, given the sum of the quadrics at the
+// two ends of the collapsed edge
+
+static double quadricError( const double *q1, const double *q2, vec3 p )
+
+{
+  double q[10];
+
+  for (int i=0; i<10; i++)
+    q[i] = q1[i] + q2[i];
+
+  return q[0]*p.x*p.x + 2*q[1]*p.x*p.y + 2*q[2]*p.x*p.z + 2*q[3]*p.x
+    + q[4]*p.y*p.y + 2*q[5]*p.y*p.z + 2*q[6]*p.y
+    + q[7]*p.z*p.z + 2*q[8]*p.z
+    + q[9];
+}
+
+
+static unsigned int hashPosition( vec3 p )
+
+{
+  unsigned int bits[3];
+  memcpy( bits, &p.x, sizeof(bits) );
+
+  return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+}
+
+
+MeshSimplifier::MeshSimplifier( const GLuint *indices, int nIndices, const GLfloat *vertices, int nVertices, int vertexSize )
+
+{
+  numVertices = nVertices;
+  numIndices  = nIndices;
+
+  currentIndices = new GLuint[ numIndices ];
+  memcpy( currentIndices, indices, numIndices * sizeof(GLuint) );
+
+  positions = new vec3[ numVertices ];
+  for (int v=0; v<numVertices; v++)
+    positions[v] = vec3( (float *) &vertices[ v * vertexSize ] );
+
+  // Find vertices with the same position, using the first such vertex
+  // as the ID of the position
+
+  positionID = new int[ numVertices ];
+
+  int tableSize = 1;
+  while (tableSize < 2 * numVertices)
+    tableSize *= 2;
+
+  int *table = new int[ tableSize ];
+  for (int i=0; i<tableSize; i++)
+    table[i] = -1;
+
+  for (int v=0; v<numVertices; v++) {
+
+    unsigned int h = hashPosition( positions[v] ) & (tableSize-1);
+
+    while (table[h] >= 0 && positions[ table[h] ] != positions[v])
+      h = (h+1) & (tableSize-1);
+
+    if (table[h] < 0)
+      table[h] = v;
+
+    positionID[v] = table[h];
+  }
+
+  delete [] table;
+
+  // Lock vertices that share a position
+
+  int *count = new int[ numVertices ];
+  for (int v=0; v<numVertices; v++)
+    count[v] = 0;
+
+  for (int v=0; v<numVertices; v++)
+    count[ positionID[v] ]++;
+
+  locked = new bool[ numVertices ];
+  for (int v=0; v<numVertices; v++)
+    locked[v] = (count[ positionID[v] ] > 1);
+
+  // Lock vertices on border and non-manifold edges.  Between position
+  // IDs, an interior edge a->b of a consistently oriented manifold
+  // appears once, as does its opposite b->a.  The edges from each
+  // position ID are edges[ edgeStart[a] .. edgeStart[a+1]-1 ].
+
+  for (int v=0; v<numVertices; v++)
+    count[v] = 0;
+
+  for (int i=0; i<numIndices; i++)
+    count[ positionID[ currentIndices[i] ] ]++;
+
+  int *edgeStart = new int[ numVertices+1 ];
+  edgeStart[0] = 0;
+  for (int v=0; v<numVertices; v++)
+    edgeStart[v+1] = edgeStart[v] + count[v];
+
+  int *edges = new int[ numIndices ];
+  for (int v=0; v<numVertices; v++)
+    count[v] = edgeStart[v];
+
+  for (int i=0; i<numIndices; i++) {
+    int a = positionID[ currentIndices[i] ];
+    int b = positionID[ currentIndices[ (i%3 == 2 ? i-2 : i+1) ] ];
+    edges[ count[a]++ ] = b;
+  }
+
+  bool *lockedID = new bool[ numVertices ];
+  for (int v=0; v<numVertices; v++)
+    lockedID[v] = false;
+
+  for (int a=0; a<numVertices; a++)
+    for (int i=edgeStart[a]; i<edgeStart[a+1]; i++) {
+
+      int b = edges[i];
+      int forward = 0, backward = 0;
+
+      for (int j=edgeStart[a]; j<edgeStart[a+1]; j++)
+	if (edges[j] == b)
+	  forward++;
+
+      for (int j=edgeStart[b]; j<edgeStart[b+1]; j++)
+	if (edges[j] == a)
+	  backward++;
+
+      if (forward != 1 || backward != 1)
+	lockedID[a] = lockedID[b] = true;
+    }
+
+  for (int v=0; v<numVertices; v++)
+    if (lockedID[ positionID[v] ])
+      locked[v] = true;
+
+  delete [] lockedID;
+  delete [] edges;
+  delete [] edgeStart;
+  delete [] count;
+
+  // Quadrics
+
+  quadrics = new double[ 10 * numVertices ];
+  for (int i=0; i<10*numVertices; i++)
+    quadrics[i] = 0;
+
+  for (int i=0; i<numIndices; i+=3) {
+
+    vec3 p0 = positions[ currentIndices[i] ];
+    vec3 p1 = positions[ currentIndices[i+1] ];
+    vec3 p2 = positions[ currentIndices[i+2] ];
+
+    vec3 n = (p1-p0) ^ (p2-p0);
+    float len = n.length();
+
+    if (len == 0)
+      continue;
+
+    n = (1/len) * n;
+
+    for (int k=0; k<3; k++)
+      addPlane( &quadrics[ 10 * positionID[ currentIndices[i+k] ] ], n, -(n * p0), 0.5 * len );
+  }
+}
+
+
+MeshSimplifier::~MeshSimplifier()
+
+{
+  delete [] quadrics;
+  delete [] locked;
+  delete [] positionID;
+  delete [] positions;
+  delete [] currentIndices;
+}
+
+
+int MeshSimplifier::simplify( int targetIndices )
+
+{
+  while (numIndices > targetIndices)
+    if (!collapsePass( targetIndices ))
+      break;
+
+  return numIndices;
+}
+
+
+// A possible collapse of vertex 'from' onto vertex 'to'
+
+typedef struct {
+  double cost;
+  int    from, to;
+} Collapse;
+
+
+static int compareCollapses( const void *a, const void *b )
+
+{
+  double ca = ((Collapse *) a)->cost;
+  double cb = ((Collapse *) b)->cost;
+
+  return (ca < cb ? -1 : (ca > cb ? 1 : 0));
+}
+
+
+// Do one pass of collapses.  Each unlocked vertex finds its cheapest
+// collapse onto a neighbour, then the cheapest of those are done,
+// skipping any that would flip a triangle.  Once a vertex is moved,
+// no other vertex of its triangles is moved in the same pass, so the
+// flip tests stay valid.  Returns false if nothing could be
+// collapsed.
+
+bool MeshSimplifier::collapsePass( int targetIndices )
+
+{
+  int numTriangles = numIndices / 3;
+
+  // Triangles adjacent to each vertex: vertex v's triangles are
+  // adjTriangles[ adjStart[v] .. adjStart[v+1]-1 ]
+
+  int *adjStart = new int[ numVertices+1 ];
+  int *adjTriangles = new int[ numIndices ];
+  int *fill = new int[ numVertices ];
+
+  for (int v=0; v<numVertices; v++)
+    fill[v] = 0;
+
+  for (int i=0; i<numIndices; i++)
+    fill[ currentIndices[i] ]++;
+
+  adjStart[0] = 0;
+  for (int v=0; v<numVertices; v++)
+    adjStart[v+1] = adjStart[v] + fill[v];
+
+  for (int v=0; v<numVertices; v++)
+    fill[v] = adjStart[v];
+
+  for (int i=0; i<numIndices; i++)
+    adjTriangles[ fill[ currentIndices[i] ]++ ] = i/3;
+
+  delete [] fill;
+
+  // Find the cheapest collapse of each unlocked vertex
+
+  Collapse *collapses = new Collapse[ numVertices ];
+  int *collapseOf = new int[ numVertices ];
+  int numCollapses = 0;
+
+  for (int v=0; v<numVertices; v++)
+    collapseOf[v] = -1;
+
+  for (int i=0; i<numIndices; i++) {
+
+    int from = currentIndices[i];
+
+    if (locked[from])
+      continue;
+
+    int t = i/3;
+
+    for (int k=1; k<3; k++) {
+
+      int to = currentIndices[ 3*t + (i%3 + k) % 3 ];
+
+      if (positionID[to] == positionID[from])
+	continue;
+
+      double cost = quadricError( &quadrics[ 10 * positionID[from] ], &quadrics[ 10 * positionID[to] ], positions[to] );
+
+      if (collapseOf[from] < 0) {
+	collapseOf[from] = numCollapses++;
+	collapses[ collapseOf[from] ].cost = cost;
+	collapses[ collapseOf[from] ].from = from;
+	collapses[ collapseOf[from] ].to   = to;
+      }
+      else if (cost < collapses[ collapseOf[from] ].cost) {
+	collapses[ collapseOf[from] ].cost = cost;
+	collapses[ collapseOf[from] ].to   = to;
+      }
+    }
+  }
+
+  delete [] collapseOf;
+
+  qsort( collapses, numCollapses, sizeof(Collapse), compareCollapses );
+
+  // Do the cheapest collapses until enough triangles are removed
+
+  int trianglesToRemove = (numIndices - targetIndices + 2) / 3;
+  int trianglesRemoved = 0;
+  int numDone = 0;
+
+  bool *touched = new bool[ numVertices ];
+  int  *remap = new int[ numVertices ];
+
+  for (int v=0; v<numVertices; v++) {
+    touched[v] = false;
+    remap[v] = v;
+  }
+
+  for (int c=0; c<numCollapses && trianglesRemoved < trianglesToRemove; c++) {
+
+    int from = collapses[c].from;
+    int to   = collapses[c].to;
+
+    if (touched[from] || touched[to])
+      continue;
+
+    // Check that no remaining triangle flips, and count those that
+    // become degenerate
+
+    bool flips = false;
+    int  degenerate = 0;
+
+    for (int j=adjStart[from]; j<adjStart[from+1] && !flips; j++) {
+
+      GLuint *tri = &currentIndices[ 3 * adjTriangles[j] ];
+
+      if (positionID[tri[0]] == positionID[to] || positionID[tri[1]] == positionID[to] || positionID[tri[2]] == positionID[to]) {
+	degenerate++;
+	continue;
+      }
+
+      vec3 p[3], q[3];
+      for (int k=0; k<3; k++) {
+	p[k] = positions[ tri[k] ];
+	q[k] = (tri[k] == (GLuint) from ? positions[to] : p[k]);
+      }
+
+      vec3 before = (p[1]-p[0]) ^ (p[2]-p[0]);
+      vec3 after  = (q[1]-q[0]) ^ (q[2]-q[0]);
+
+      if (before * after <= 0)
+	flips = true;
+    }
+
+    if (flips)
+      continue;
+
+    // Collapse
+
+    remap[from] = to;
+
+    for (int j=adjStart[from]; j<adjStart[from+1]; j++) {
+      GLuint *tri = &currentIndices[ 3 * adjTriangles[j] ];
+      for (int k=0; k<3; k++)
+	touched[ tri[k] ] = true;
+    }
+
+    for (int i=0; i<10; i++)
+      quadrics[ 10 * positionID[to] + i ] += quadrics[ 10 * positionID[from] + i ];
+
+    trianglesRemoved += degenerate;
+    numDone++;
+  }
+
+  // Update the triangles, removing degenerate ones
+
+  if (numDone > 0) {
+
+    int n = 0;
+
+    for (int t=0; t<numTriangles; t++) {
+
+      GLuint v0 = remap[ currentIndices[3*t] ];
+      GLuint v1 = remap[ currentIndices[3*t+1] ];
+      GLuint v2 = remap[ currentIndices[3*t+2] ];
+
+      if (positionID[v0] != positionID[v1] && positionID[v1] != positionID[v2] && positionID[v2] != positionID[v0]) {
+	currentIndices[n++] = v0;
+	currentIndices[n++] = v1;
+	currentIndices[n++] = v2;
+      }
+    }
+
+    numIndices = n;
+  }
+
+  delete [] remap;
+  delete [] touched;
+  delete [] collapses;
+  delete [] adjTriangles;
+  delete [] adjStart;
+
+  return numDone > 0;
+}
@@ -0,0 +1,58 @@
+// meshSimplify.h
+//
+// Simplify an indexed triangle mesh by edge collapses, choosing the
+// collapses that least change its shape as measured by quadric error
+// metrics (Garland and Heckbert, "Surface Simplification Using
+// Quadric Error Metrics", SIGGRAPH 1997).
+//
+// Each collapse moves one vertex onto a neighbouring vertex (a
+// "half-edge collapse"), so the simplified triangles use a subset of
+// the original vertices and can share the original vertex buffer.
+// Vertices on a border or a non-manifold edge, and vertices that
+// share their position with another vertex (e.g. at a texture seam
+// or a crease), are never moved, so borders and seams stay intact.
+//
+// Usage:
+//
+//   MeshSimplifier s( indices, numIndices, vertices, numVertices, vertexSize );
+//
+//   int n = s.simplify( target );   // collapse until at most 'target' indices remain
+//   ... use s.indices()[0..n-1] ...
+//
+// simplify() can be called again with a smaller target to continue
+// from the last result, which gives a chain of levels of detail.  It
+// stops early if no more vertices can be moved.
+
+
+#ifndef MESH_SIMPLIFY_H
+#define MESH_SIMPLIFY_H
+
+#include "headers.h"
+#include "linalg.h"
+
+
+class MeshSimplifier {
+
+  int     numVertices;
+  int     numIndices;
+  GLuint *currentIndices;	/* triangles remaining */
+  vec3   *positions;		/* of each vertex */
+  int    *positionID;		/* vertices with the same position have the same ID */
+  bool   *locked;		/* vertex can't be moved */
+  double *quadrics;		/* 10 coefficients per position ID */
+
+  bool collapsePass( int targetIndices );
+
+ public:
+
+  MeshSimplifier( const GLuint *indices, int numIndices, const GLfloat *vertices, int numVertices, int vertexSize );
+  ~MeshSimplifier();
+
+  int simplify( int targetIndices );
+
+  const GLuint *indices() {
+    return currentIndices;
+  }
+};
+
+#endif
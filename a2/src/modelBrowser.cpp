@@ -0,0 +1,311 @@
+/* modelBrowser.cpp
+ */
+
+
+#include "headers.h"
+#include "modelBrowser.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <dirent.h>
+#endif
+
+
+static bool hasSuffix( char *s, const char *suffix )
+
+{
+  int n = strlen(s), m = strlen(suffix);
+
+  return n >= m && strcmp( &s[n-m], suffix ) == 0;
+}
+
+
+// Find the models in a directory
+
+ModelBrowser::ModelBrowser( char *dirname, long long gpuBudget )
+
+{
+  seq<char*> names;
+
+#ifdef _WIN32
+  char *pattern = new char[ strlen(dirname) + 3 ];
+  sprintf( pattern, "%s\\*", dirname );
+
+  WIN32_FIND_DATAA found;
+  HANDLE h = FindFirstFileA( pattern, &found );
+
+  if (h != INVALID_HANDLE_VALUE) {
+    do
+      names.add( strdup( found.cFileName ) );
+    while (FindNextFileA( h, &found ));
+    FindClose( h );
+  }
+
+  delete [] pattern;
+#else
+  DIR *dir = opendir( dirname );
+
+  if (dir != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir( dir )) != NULL)
+      names.add( strdup( entry->d_name ) );
+    closedir( dir );
+  }
+#endif
+
+  for (int i=0; i<names.size(); i++) {
+    if (hasSuffix( names[i], ".obj" ) || hasSuffix( names[i], ".scene" )) {
+      char *path = (char *) malloc( strlen(dirname) + strlen(names[i]) + 2 );
+      sprintf( path, "%s/%s", dirname, names[i] );
+      filenames.add( path );
+    }
+    free( names[i] );
+  }
+
+  if (filenames.size() == 0) {
+    cerr << "ModelBrowser: no .obj or .scene files in '" << dirname << "'" << endl;
+    exit(-1);
+  }
+
+  std::sort( &filenames[0], &filenames[0] + filenames.size(),
+	     []( char *a, char *b ) { return strcmp( a, b ) < 0; } );
+
+  int n = filenames.size();
+
+  scenes     = new Scene*[n];
+  loaded     = new bool[n];
+  gpuBytes   = new long long[n];
+  lastViewed = new int[n];
+
+  for (int i=0; i<n; i++) {
+    scenes[i] = NULL;
+    loaded[i] = false;
+    gpuBytes[i] = 0;
+    lastViewed[i] = 0;
+  }
+
+  clock = 0;
+  direction = 1;
+  budget = gpuBudget;
+  textureMode = MIPMAP_LINEAR;
+  releaseCPUData = false;
+
+  select( 0 );
+}
+
+
+ModelBrowser::~ModelBrowser()
+
+{
+  for (int i=0; i<filenames.size(); i++) {
+    delete scenes[i];
+    free( filenames[i] );
+  }
+
+  delete [] scenes;
+  delete [] loaded;
+  delete [] gpuBytes;
+  delete [] lastViewed;
+}
+
+
+// A scene for file i, which starts loading in continueLoading()
+
+Scene *ModelBrowser::newScene( int i )
+
+{
+  Scene *scene = new Scene( textureMode );
+
+  if (hasSuffix( filenames[i], ".scene" ))
+    scene->read( filenames[i] );
+  else
+    scene->addModel( filenames[i] );
+
+  return scene;
+}
+
+
+// Make model i current, starting to load it if it isn't resident
+
+void ModelBrowser::select( int i )
+
+{
+  current = i;
+  lastViewed[i] = ++clock;
+
+  if (scenes[i] == NULL)
+    scenes[i] = newScene( i );
+}
+
+
+Scene *ModelBrowser::currentScene()
+
+{
+  return scenes[current];
+}
+
+
+void ModelBrowser::next()
+
+{
+  direction = 1;
+  select( (current + 1) % filenames.size() );
+}
+
+
+void ModelBrowser::previous()
+
+{
+  direction = -1;
+  select( (current + filenames.size() - 1) % filenames.size() );
+}
+
+
+// Continue loading scene i.  Once it's loaded, scenes are freed if
+// the budget is exceeded, which may include scene i if the viewer has
+// moved away from it while it was loading.
+
+bool ModelBrowser::load( int i )
+
+{
+  if (loaded[i])
+    return true;
+
+  if (!scenes[i]->continueLoading())
+    return false;
+
+  loaded[i] = true;
+
+  if (releaseCPUData)
+    scenes[i]->releaseCPUData();
+
+  gpuBytes[i] = scenes[i]->gpuBytes();
+
+  long long bytes = gpuBytes[i];
+
+  evict();
+
+  char buffer[1000];
+  sprintf( buffer, "Loaded %s: %.2f MB in OpenGL%s; %d models resident in %.2f of %.0f MB",
+	   filenames[i], bytes / (1024.0 * 1024.0), (scenes[i] == NULL ? ", freed as it's no longer viewed" : ""),
+	   numResident(), residentBytes() / (1024.0 * 1024.0), budget / (1024.0 * 1024.0) );
+  cout << buffer << endl;
+
+  return true;
+}
+
+
+// Free the least recently viewed scenes until the resident scenes fit
+// in the budget.  The current scene and the scenes next to it are
+// kept.  Scenes that are still loading are kept, too, since freeing
+// one would wait for its loader thread, but each is a candidate once
+// it's loaded (see load()), so scenes that were passed over while
+// loading don't stay over the budget.
+
+void ModelBrowser::evict()
+
+{
+  int n = filenames.size();
+
+  int after  = (current + 1) % n;
+  int before = (current + n - 1) % n;
+
+  while (residentBytes() > budget) {
+
+    int lru = -1;
+
+    for (int i=0; i<n; i++)
+      if (scenes[i] != NULL && loaded[i] &&
+	  i != current && i != after && i != before &&
+	  (lru == -1 || lastViewed[i] < lastViewed[lru]))
+	lru = i;
+
+    if (lru == -1)
+      break;
+
+    delete scenes[lru];
+
+    scenes[lru] = NULL;
+    loaded[lru] = false;
+    gpuBytes[lru] = 0;
+  }
+}
+
+
+// Load the current scene.  Once it's loaded, load the scenes next to
+// it, the one in the direction of travel first, then finish any
+// others that were left partly loaded.  Only one scene is loaded at a
+// time, and a scene is started only if there's room in the budget.
+
+bool ModelBrowser::continueLoading()
+
+{
+  if (!load( current ))
+    return false;
+
+  int n = filenames.size();
+
+  int first  = (current + n + direction) % n;
+  int second = (current + n - direction) % n;
+
+  int toLoad[2] = { first, second };
+
+  for (int k=0; k<2; k++) {
+
+    int i = toLoad[k];
+
+    if (loaded[i])
+      continue;
+
+    if (scenes[i] == NULL) {
+
+      if (residentBytes() >= budget)
+	break;
+
+      scenes[i] = newScene( i );
+    }
+
+    load( i );
+    return true;
+  }
+
+  for (int i=0; i<n; i++)
+    if (scenes[i] != NULL && !loaded[i]) {
+      load( i );
+      break;
+    }
+
+  return true;
+}
+
+
+// Memory used in OpenGL by the resident scenes, including those still
+// being loaded
+
+long long ModelBrowser::residentBytes()
+
+{
+  long long bytes = 0;
+
+  for (int i=0; i<filenames.size(); i++)
+    if (scenes[i] != NULL)
+      bytes += (loaded[i] ? gpuBytes[i] : scenes[i]->gpuBytes());
+
+  return bytes;
+}
+
+
+int ModelBrowser::numResident()
+
+{
+  int count = 0;
+
+  for (int i=0; i<filenames.size(); i++)
+    if (scenes[i] != NULL)
+      count++;
+
+  return count;
+}
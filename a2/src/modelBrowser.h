@@ -0,0 +1,70 @@
+/* modelBrowser.h
+ *
+ * Browse the models in a directory, one at a time.
+ *
+ * Each .obj or .scene file in the directory is a Scene.  Models that
+ * have been viewed stay in OpenGL, so returning to one is immediate,
+ * until the memory that they use in OpenGL exceeds the budget.  Then
+ * the least recently viewed models are freed.
+ *
+ * While the current model is shown, the models before and after it
+ * are loaded in the background, so that the next one is usually ready
+ * when the viewer moves to it.
+ *
+ * Usage:
+ *
+ *   ModelBrowser *browser = new ModelBrowser( "models", 1024 * 1024 * 1024LL );
+ *   ...
+ *   browser->next();                      // on a key press
+ *   ...
+ *   bool loaded = browser->continueLoading(); // each frame, on the OpenGL thread
+ *   Scene *scene = browser->currentScene();
+ */
+
+
+#ifndef MODEL_BROWSER_H
+#define MODEL_BROWSER_H
+
+#include "headers.h"
+#include "seq.h"
+#include "scene.h"
+
+
+class ModelBrowser {
+
+  seq<char*>  filenames;	/* sorted */
+  Scene     **scenes;		/* scene of each file, or NULL if not resident */
+  bool       *loaded;		/* scene is fully in OpenGL */
+  long long  *gpuBytes;		/* memory used by each loaded scene in OpenGL */
+  int        *lastViewed;	/* time at which each scene was last current */
+  int         clock;		/* advanced on each change of model */
+  int         direction;	/* +1 or -1: the way the viewer last moved */
+
+  Scene *newScene( int i );
+  void  select( int i );
+  void  evict();		/* free least recently viewed scenes until within budget */
+  bool  load( int i );		/* continue loading; returns true when loaded */
+
+ public:
+
+  int        current;		/* index of the model being viewed */
+  long long  budget;		/* bytes that resident models may use in OpenGL */
+  TextureMode textureMode;
+  bool       releaseCPUData;	/* free each model's CPU data once it's loaded */
+
+  ModelBrowser( char *dirname, long long gpuBudget );
+  ~ModelBrowser();
+
+  int    numModels() { return filenames.size(); }
+  char  *currentFilename() { return filenames[current]; }
+  Scene *currentScene();
+
+  void   next();		/* move to the following model, wrapping around */
+  void   previous();		/* move to the preceding model, wrapping around */
+
+  bool   continueLoading();	/* on the OpenGL thread; returns true when the current model is loaded */
+  long long residentBytes();	/* memory used in OpenGL by all loaded scenes */
+  int    numResident();
+};
+
+#endif
@@ -0,0 +1,111 @@
+// parallel.h
+//
+// Simple fork/join parallel loops.
+//
+//   numThreads()                 Number of hardware threads (at least 1)
+//
+//   parallelForBlocks( n, fn )   Call fn(b) for each block b in [0,n).
+//                                Blocks are handed out dynamically to
+//                                one thread per core, so blocks of
+//                                uneven cost are balanced.
+//
+//   parallelFor( n, fn )         Call fn(i) for each i in [0,n), with
+//                                the range split into contiguous blocks
+//                                of at least 4096 iterations (or of the
+//                                optional third argument).
+//
+// Both return when all calls have finished.  The calling thread does
+// its share of the work, and small loops run entirely on the calling
+// thread.  A loop inside another (e.g. in fn) runs entirely on the
+// thread that calls it, since the outer loop already has a thread per
+// core.
+
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <atomic>
+
+
+inline int numThreads()
+
+{
+  static const int n = (std::thread::hardware_concurrency() < 1 ? 1 : std::thread::hardware_concurrency());
+
+  return n;
+}
+
+
+// True on a thread that's running the blocks of a parallel loop
+
+inline bool &inParallelLoop()
+
+{
+  static thread_local bool inside = false;
+
+  return inside;
+}
+
+
+template<class F>
+void parallelForBlocks( int numBlocks, F fn )
+
+{
+  int nThreads = numThreads();
+  if (nThreads > numBlocks)
+    nThreads = numBlocks;
+
+  if (nThreads <= 1 || inParallelLoop()) {
+    for (int b=0; b<numBlocks; b++)
+      fn( b );
+    return;
+  }
+
+  std::atomic<int> nextBlock( 0 );
+
+  auto worker = [&]() {
+    inParallelLoop() = true;
+    int b;
+    while ((b = nextBlock++) < numBlocks)
+      fn( b );
+  };
+
+  std::thread *threads = new std::thread[ nThreads-1 ];
+
+  for (int i=0; i<nThreads-1; i++)
+    threads[i] = std::thread( worker );
+
+  worker();
+  inParallelLoop() = false;
+
+  for (int i=0; i<nThreads-1; i++)
+    threads[i].join();
+
+  delete [] threads;
+}
+
+
+template<class F>
+void parallelFor( int n, F fn, int minBlockSize = 4096 )
+
+{
+  int numBlocks = (n + minBlockSize - 1) / minBlockSize;
+  if (numBlocks > 4 * numThreads())
+    numBlocks = 4 * numThreads();
+
+  if (numBlocks <= 1) {
+    for (int i=0; i<n; i++)
+      fn( i );
+    return;
+  }
+
+  parallelForBlocks( numBlocks, [&]( int b ) {
+    int start = (int) ((long long) n * b / numBlocks);
+    int stop  = (int) ((long long) n * (b+1) / numBlocks);
+    for (int i=start; i<stop; i++)
+      fn( i );
+  } );
+}
+
+#endif
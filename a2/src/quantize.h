@@ -0,0 +1,147 @@
+// quantize.h
+//
+// Compact encodings of vertex attributes, used by wfModel when
+// wfModel::quantizeVertices is set.  A quantized vertex is
+//
+//   offset 0   position   3 x GLushort, normalized, over the model's
+//                         bounding cube (dequantized by the model's
+//                         objToWorldTransform)
+//   offset 6   normal     2 x GLbyte, normalized, octahedral encoding
+//   offset 8   texcoords  2 x half float (only if the model has them)
+//
+// so 12 bytes with texture coordinates and 8 bytes without, instead
+// of 32 and 24 bytes as floats.
+//
+// The octahedral encoding (Meyer et al., "On Floating-Point Normal
+// Vectors", EGSR 2010) projects the unit sphere onto the octahedron
+// |x|+|y|+|z| = 1 and unfolds the octahedron into the square
+// [-1,1]^2.  A shader decodes it with decodeOctahedral() in
+// pass1.vert.
+
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include "headers.h"
+#include "linalg.h"
+
+#include <cmath>
+#include <cstring>
+
+
+#define QUANTIZED_POSITION_OFFSET 0
+#define QUANTIZED_NORMAL_OFFSET   6
+#define QUANTIZED_TEXCOORD_OFFSET 8
+
+#define QUANTIZED_POSITION_MAX 65535 /* largest GLushort */
+#define QUANTIZED_NORMAL_MAX   127   /* largest GLbyte */
+
+
+// Convert to an IEEE half float, rounding to nearest even
+
+inline GLushort floatToHalf( float f )
+
+{
+  unsigned int x;
+  memcpy( &x, &f, sizeof(x) );
+
+  unsigned int sign = (x >> 16) & 0x8000;
+  unsigned int mant = x & 0x7fffff;
+  int          exp  = (int) ((x >> 23) & 0xff) - 127 + 15;
+
+  if (((x >> 23) & 0xff) == 0xff)	// infinity or NaN
+    return sign | 0x7c00 | (mant != 0 ? 0x200 : 0);
+
+  if (exp >= 31)			// too large
+    return sign | 0x7c00;
+
+  if (exp <= 0) {			// denormal or zero
+
+    if (exp < -10)
+      return sign;
+
+    mant |= 0x800000;
+
+    int shift = 14 - exp;
+    unsigned int h    = mant >> shift;
+    unsigned int rem  = mant & ((1u << shift) - 1);
+    unsigned int half = 1u << (shift - 1);
+
+    if (rem > half || (rem == half && (h & 1)))
+      h++;
+
+    return sign | h;
+  }
+
+  // Rounding up may carry into the exponent, which is still correct
+
+  unsigned int h   = (exp << 10) | (mant >> 13);
+  unsigned int rem = mant & 0x1fff;
+
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+    h++;
+
+  return sign | h;
+}
+
+
+// Decode an octahedral normal exactly as pass1.vert does (GLSL's
+// sign(0) is 0)
+
+inline vec3 decodeOctahedral( GLbyte u, GLbyte v )
+
+{
+  float x = u / (float) QUANTIZED_NORMAL_MAX;
+  float y = v / (float) QUANTIZED_NORMAL_MAX;
+  float z = 1 - fabs(x) - fabs(y);
+
+  if (z < 0) {
+    float oldX = x;
+    x = (1 - fabs(y))    * (oldX > 0 ? 1 : (oldX < 0 ? -1 : 0));
+    y = (1 - fabs(oldX)) * (y    > 0 ? 1 : (y    < 0 ? -1 : 0));
+  }
+
+  return vec3( x, y, z ).normalize();
+}
+
+
+// Encode a unit normal.  Of the four codes around the exact
+// encoding, the one that decodes closest to the normal is chosen.
+
+inline void encodeOctahedral( vec3 n, GLbyte &u, GLbyte &v )
+
+{
+  float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+
+  float x = (l1 > 0 ? n.x / l1 : 0);
+  float y = (l1 > 0 ? n.y / l1 : 0);
+
+  if (n.z < 0) {
+    float oldX = x;
+    x = (1 - fabs(y))    * (oldX >= 0 ? 1 : -1);
+    y = (1 - fabs(oldX)) * (y    >= 0 ? 1 : -1);
+  }
+
+  float bestDot = -2;
+
+  for (int i=0; i<2; i++)
+    for (int j=0; j<2; j++) {
+
+      int qu = (int) floor( x * QUANTIZED_NORMAL_MAX ) + i;
+      int qv = (int) floor( y * QUANTIZED_NORMAL_MAX ) + j;
+
+      if (qu > QUANTIZED_NORMAL_MAX || qv > QUANTIZED_NORMAL_MAX || qu < -QUANTIZED_NORMAL_MAX || qv < -QUANTIZED_NORMAL_MAX)
+	continue;
+
+      float d = decodeOctahedral( qu, qv ) * n;
+
+      if (d > bestDot) {
+	bestDot = d;
+	u = qu;
+	v = qv;
+      }
+    }
+}
+
+
+#endif
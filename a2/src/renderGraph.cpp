@@ -0,0 +1,359 @@
+// renderGraph.cpp
+
+
+#include "headers.h"
+#include "renderGraph.h"
+
+#include <chrono>
+
+
+void RenderPass::read( int attachment, char *sampler )
+
+{
+  if (numReads == MAX_PASS_ATTACHMENTS) {
+    cerr << "RenderPass: pass '" << name << "' reads more than " << MAX_PASS_ATTACHMENTS << " attachments" << endl;
+    exit(1);
+  }
+
+  if (attachment < 0 || attachment >= MAX_ATTACHMENTS) {
+    cerr << "RenderPass: pass '" << name << "' reads attachment " << attachment << ", but there are only " << MAX_ATTACHMENTS << endl;
+    exit(1);
+  }
+
+  reads[numReads] = attachment;
+  samplers[numReads] = sampler;
+  numReads++;
+}
+
+
+void RenderPass::write( int attachment )
+
+{
+  if (numWrites == MAX_PASS_ATTACHMENTS) {
+    cerr << "RenderPass: pass '" << name << "' writes more than " << MAX_PASS_ATTACHMENTS << " attachments" << endl;
+    exit(1);
+  }
+
+  writes[numWrites++] = attachment;
+}
+
+
+// Set up the fullscreen triangle.  It covers [-1,1]x[-1,1] with one
+// triangle, rather than a quad of two, so that no fragments are
+// shaded twice along a diagonal.
+
+RenderGraph::RenderGraph()
+
+{
+  for (int i=0; i<MAX_GBUFFERS; i++)
+    gbuffers[i] = NULL;
+
+  vec2 verts[3] = { vec2( -1, -1 ), vec2( 3, -1 ), vec2( -1, 3 ) };
+
+  glGenVertexArrays( 1, &fullscreenVAO );
+  glBindVertexArray( fullscreenVAO );
+
+  glGenBuffers( 1, &fullscreenVBO );
+  glBindBuffer( GL_ARRAY_BUFFER, fullscreenVBO );
+
+  glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW );
+
+  glEnableVertexAttribArray( 0 );
+  glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, 0, 0 );
+
+  glBindVertexArray( 0 );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+  // Timer queries are in OpenGL 3.3, but not in OpenGL ES 3.0
+
+  timerQueries = GLAD_GL_VERSION_3_3;
+  frame = 0;
+
+  forgetState();
+}
+
+
+RenderGraph::~RenderGraph()
+
+{
+  for (int i=0; i<passes.size(); i++) {
+    if (timerQueries)
+      glDeleteQueries( NUM_TIMER_FRAMES, passes[i]->queries );
+    delete passes[i];
+  }
+
+  glDeleteBuffers( 1, &fullscreenVBO );
+  glDeleteVertexArrays( 1, &fullscreenVAO );
+}
+
+
+void RenderGraph::setGBuffer( int i, GBuffer *gb, int firstAttachment )
+
+{
+  gbuffers[i] = gb;
+  firstAttachments[i] = firstAttachment;
+}
+
+
+// The G-buffer that has 'attachment'
+
+int RenderGraph::gbufferOf( int attachment )
+
+{
+  int found = -1;
+
+  for (int i=0; i<MAX_GBUFFERS; i++)
+    if (gbuffers[i] != NULL && firstAttachments[i] <= attachment &&
+	(found == -1 || firstAttachments[i] > firstAttachments[found]))
+      found = i;
+
+  if (found == -1) {
+    cerr << "RenderGraph: no G-buffer has attachment " << attachment << endl;
+    exit(1);
+  }
+
+  return found;
+}
+
+
+RenderPass *RenderGraph::addPass( char *name, GPUProgram *prog, std::function<void()> draw )
+
+{
+  RenderPass *pass = new RenderPass( name, prog, draw );
+
+  if (timerQueries)
+    glGenQueries( NUM_TIMER_FRAMES, pass->queries );
+
+  passes.add( pass );
+
+  return pass;
+}
+
+
+void RenderGraph::forgetState()
+
+{
+  boundFramebuffer = -1;
+  numDrawBuffers = -1;
+  activeProg = NULL;
+  depthTestState = -1;
+
+  for (int i=0; i<MAX_ATTACHMENTS; i++)
+    textureBound[i] = false;
+}
+
+
+// Bind what 'pass' needs that the previous pass didn't
+
+void RenderGraph::bindFor( RenderPass *pass )
+
+{
+  // Framebuffer, viewport, and draw buffers
+
+  int target = (pass->numWrites == 0 ? -1 : gbufferOf( pass->writes[0] ));
+  int framebuffer = (target == -1 ? 0 : 1 + 2*target + (pass->depthTest ? 0 : 1));
+
+  if (framebuffer != boundFramebuffer) {
+
+    if (target == -1) {
+      glBindFramebuffer( GL_DRAW_FRAMEBUFFER, 0 );
+      if (viewportChanged) {
+	glViewport( windowViewport[0], windowViewport[1], windowViewport[2], windowViewport[3] );
+	viewportChanged = false;
+      }
+    } else {
+      gbuffers[target]->BindForWriting( pass->depthTest );
+      glViewport( 0, 0, gbuffers[target]->width(), gbuffers[target]->height() );
+      viewportChanged = true;
+    }
+
+    boundFramebuffer = framebuffer;
+    numDrawBuffers = -1;
+  }
+
+  if (target != -1) {
+
+    bool same = (pass->numWrites == numDrawBuffers);
+    for (int i=0; same && i<pass->numWrites; i++)
+      if (pass->writes[i] != drawBuffers[i])
+	same = false;
+
+    if (!same) {
+      int local[ MAX_PASS_ATTACHMENTS ];
+      for (int i=0; i<pass->numWrites; i++)
+	local[i] = pass->writes[i] - firstAttachments[target];
+      gbuffers[target]->setDrawBuffers( pass->numWrites, local );
+      numDrawBuffers = pass->numWrites;
+      for (int i=0; i<pass->numWrites; i++)
+	drawBuffers[i] = pass->writes[i];
+    }
+  }
+
+  // Program, and its samplers the first time
+
+  if (pass->prog != activeProg) {
+    pass->prog->activate();
+    activeProg = pass->prog;
+  }
+
+  if (!pass->samplersSet) {
+    for (int i=0; i<pass->numReads; i++)
+      pass->prog->setInt( pass->samplers[i], pass->reads[i] );
+    pass->samplersSet = true;
+  }
+
+  // Textures read
+
+  for (int i=0; i<pass->numReads; i++) {
+    int a = pass->reads[i];
+    if (!textureBound[a]) {
+      int g = gbufferOf( a );
+      gbuffers[g]->BindTexture( a - firstAttachments[g], a );
+      textureBound[a] = true;
+    }
+  }
+
+  // Depth test
+
+  if ((int) pass->depthTest != depthTestState) {
+    if (pass->depthTest)
+      glEnable( GL_DEPTH_TEST );
+    else
+      glDisable( GL_DEPTH_TEST );
+    depthTestState = pass->depthTest;
+  }
+}
+
+
+// Start the GPU timer for 'pass' in this frame's query, first
+// collecting the time from the last use of that query if the GPU has
+// finished with it.  Returns false if the query is still busy, in
+// which case the pass isn't timed in this frame, rather than waiting
+// for the GPU.
+
+bool RenderGraph::startTimer( RenderPass *pass )
+
+{
+  int k = frame % NUM_TIMER_FRAMES;
+  GLuint query = pass->queries[k];
+
+  if (pass->queryPending[k]) {
+
+    GLuint available;
+    glGetQueryObjectuiv( query, GL_QUERY_RESULT_AVAILABLE, &available );
+    if (!available)
+      return false;
+
+    GLuint64 ns;
+    glGetQueryObjectui64v( query, GL_QUERY_RESULT, &ns );
+
+    float ms = ns / 1.0e6;
+    pass->gpuMs = (pass->gpuMs == 0 ? ms : 0.9 * pass->gpuMs + 0.1 * ms);
+    pass->queryPending[k] = false;
+  }
+
+  glBeginQuery( GL_TIME_ELAPSED, query );
+
+  return true;
+}
+
+
+// Execute n passes, in the order given
+
+void RenderGraph::execute( int n, const int *order )
+
+{
+  forgetState();
+
+  glGetIntegerv( GL_VIEWPORT, windowViewport );
+  viewportChanged = false;
+
+  for (int i=0; i<n; i++) {
+
+    RenderPass *pass = passes[ order[i] ];
+
+    auto start = std::chrono::steady_clock::now();
+
+    bool timed = (timerQueries && startTimer( pass ));
+
+    bindFor( pass );
+
+    if (pass->clear != 0)
+      glClear( pass->clear );
+
+    pass->draw();
+
+    if (timed) {
+      glEndQuery( GL_TIME_ELAPSED );
+      pass->queryPending[ frame % NUM_TIMER_FRAMES ] = true;
+    }
+
+    float ms = std::chrono::duration<float, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    pass->cpuMs = (pass->cpuMs == 0 ? ms : 0.9 * pass->cpuMs + 0.1 * ms);
+    pass->lastFrame = frame;
+  }
+
+  if (activeProg != NULL)
+    activeProg->deactivate();
+
+  if (viewportChanged)
+    glViewport( windowViewport[0], windowViewport[1], windowViewport[2], windowViewport[3] );
+
+  frame++;
+}
+
+
+// Draw the fullscreen triangle.  Its vertices are (x,y) positions in
+// attribute 0.
+
+void RenderGraph::drawFullscreen()
+
+{
+  glBindVertexArray( fullscreenVAO );
+  glDrawArrays( GL_TRIANGLES, 0, 3 );
+  glBindVertexArray( 0 );
+}
+
+
+void RenderGraph::lastFrameTimes( float &cpuMs, float &gpuMs )
+
+{
+  cpuMs = gpuMs = 0;
+
+  for (int i=0; i<passes.size(); i++)
+    if (passes[i]->lastFrame == frame-1) {
+      cpuMs += passes[i]->cpuMs;
+      gpuMs += passes[i]->gpuMs;
+    }
+}
+
+
+// Print the times of the passes executed in the last frame, and their
+// total
+
+void RenderGraph::timingReport()
+
+{
+  char buffer[1000];
+
+  for (int i=0; i<passes.size(); i++)
+    if (passes[i]->lastFrame == frame-1) {
+      if (timerQueries)
+	sprintf( buffer, "  %-16s %6.3f ms CPU, %6.3f ms GPU", passes[i]->name, passes[i]->cpuMs, passes[i]->gpuMs );
+      else
+	sprintf( buffer, "  %-16s %6.3f ms CPU", passes[i]->name, passes[i]->cpuMs );
+      cout << buffer << endl;
+    }
+
+  float cpuTotal, gpuTotal;
+  lastFrameTimes( cpuTotal, gpuTotal );
+
+  if (timerQueries)
+    sprintf( buffer, "  %-16s %6.3f ms CPU, %6.3f ms GPU", "total", cpuTotal, gpuTotal );
+  else
+    sprintf( buffer, "  %-16s %6.3f ms CPU", "total", cpuTotal );
+  cout << buffer << endl;
+
+  if (!timerQueries)
+    cout << "  (no GPU times: OpenGL timer queries are not available)" << endl;
+}
@@ -0,0 +1,159 @@
+// renderGraph.h
+//
+// A sequence of rendering passes over one or more G-buffers.
+//
+// Each pass declares the G-buffer attachments that it reads (as
+// textures) and writes (as draw buffers), the buffers it clears, and
+// whether it uses depth testing.  The graph binds the framebuffer,
+// viewport, draw buffers, textures, and program for each pass,
+// skipping those that are already bound by the previous pass, and
+// keeps one fullscreen triangle in OpenGL for passes that cover the
+// screen.
+//
+// Attachments are numbered across all of the G-buffers: G-buffer i
+// has attachments firstAttachment, firstAttachment+1, ... (its depth
+// texture last) as given to setGBuffer().  All of the attachments
+// that a pass writes must be in the same G-buffer.
+//
+// The CPU time to submit each pass is recorded, as is its GPU time if
+// OpenGL has timer queries (not in OpenGL ES 3.0).
+//
+// Usage:
+//
+//   RenderGraph *graph = new RenderGraph();
+//   graph->setGBuffer( 0, gbuffer, 0 );
+//
+//   RenderPass *pass = graph->addPass( "edges", prog, [&]() {
+//     prog->setVec2( "texCoordInc", ... );
+//     graph->drawFullscreen();
+//   } );
+//   pass->read( DEPTH_GBUFFER, "depthSampler" );
+//   pass->write( EDGE_GBUFFER );
+//
+//   int order[] = { 0, 1 };
+//   graph->execute( 2, order ); // each frame
+//
+// A pass with no attachments to write draws into the window.  A pass
+// that writes attachments has the G-buffer's depth attached only if
+// it uses depth testing, so other passes can read the depth texture
+// while writing.  Sampler uniforms are set once, the first time the
+// pass is executed, with attachment i on texture unit i.  Passes
+// that draw into the window use the viewport that was set when
+// execute() was called.
+
+
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+
+#include "headers.h"
+#include "seq.h"
+#include "gpuProgram.h"
+#include "gbuffer.h"
+
+#include <functional>
+
+
+#define MAX_PASS_ATTACHMENTS 8	/* G-buffer attachments that a pass can read or write */
+#define MAX_ATTACHMENTS      16	/* attachment numbers, over all G-buffers */
+#define MAX_GBUFFERS         4
+#define NUM_TIMER_FRAMES     3	/* frames of GPU timer queries in flight */
+
+
+class RenderPass {
+ public:
+
+  char       *name;
+  GPUProgram *prog;
+  std::function<void()> draw;	/* sets per-frame uniforms and draws */
+
+  int        reads[ MAX_PASS_ATTACHMENTS ];
+  char      *samplers[ MAX_PASS_ATTACHMENTS ]; /* sampler uniform of each attachment read */
+  int        numReads;
+
+  int        writes[ MAX_PASS_ATTACHMENTS ];
+  int        numWrites;		/* 0 = draw into the window */
+
+  GLbitfield clear;		/* buffers cleared before drawing */
+  bool       depthTest;
+
+  float      cpuMs, gpuMs;	/* smoothed times per frame (gpuMs is 0 without timer queries) */
+  int        lastFrame;		/* in which the pass was last executed */
+
+  RenderPass( char *passName, GPUProgram *passProg, std::function<void()> passDraw ) {
+    name = passName;
+    prog = passProg;
+    draw = passDraw;
+    numReads = numWrites = 0;
+    clear = 0;
+    depthTest = false;
+    cpuMs = gpuMs = 0;
+    lastFrame = -1;
+    samplersSet = false;
+    for (int i=0; i<NUM_TIMER_FRAMES; i++)
+      queryPending[i] = false;
+  }
+
+  void read( int attachment, char *sampler );
+  void write( int attachment );
+
+ private:
+
+  friend class RenderGraph;
+
+  bool   samplersSet;
+  GLuint queries[ NUM_TIMER_FRAMES ];
+  bool   queryPending[ NUM_TIMER_FRAMES ];
+};
+
+
+class RenderGraph {
+
+  seq<RenderPass*> passes;
+
+  GBuffer *gbuffers[ MAX_GBUFFERS ]; /* NULL if not in use */
+  int      firstAttachments[ MAX_GBUFFERS ];
+
+  GLuint fullscreenVAO, fullscreenVBO;
+
+  bool timerQueries;		/* GL_TIME_ELAPSED is available */
+  int  frame;
+
+  // OpenGL state left by the last pass.  It's forgotten at the start
+  // of each execute(), since code outside the graph changes it.
+
+  int         boundFramebuffer;	/* 0 = window, 1+2i = G-buffer i, 2+2i = G-buffer i without depth, -1 = unknown */
+  int         drawBuffers[ MAX_PASS_ATTACHMENTS ];
+  int         numDrawBuffers;	/* -1 = unknown */
+  bool        textureBound[ MAX_ATTACHMENTS ]; /* attachment i is on texture unit i */
+  GLint       windowViewport[4];
+  bool        viewportChanged;	/* from windowViewport */
+  GPUProgram *activeProg;
+  int         depthTestState;	/* 0, 1, or -1 = unknown */
+
+  void forgetState();
+  int  gbufferOf( int attachment );
+  void bindFor( RenderPass *pass );
+  bool startTimer( RenderPass *pass );
+
+ public:
+
+  RenderGraph();
+  ~RenderGraph();
+
+  RenderPass *addPass( char *name, GPUProgram *prog, std::function<void()> draw );
+
+  int  numPasses() { return passes.size(); }
+  RenderPass *pass( int i ) { return passes[i]; }
+
+  void setGBuffer( int i, GBuffer *gb, int firstAttachment ); /* also after the window is resized */
+
+  void execute( int n, const int *order ); /* passes order[0..n-1], in that order */
+  void drawFullscreen();	/* for use in a pass's draw() */
+
+  bool hasTimerQueries() { return timerQueries; }
+  void lastFrameTimes( float &cpuMs, float &gpuMs ); /* totals of the passes in the last frame */
+
+  void timingReport();
+};
+
+#endif
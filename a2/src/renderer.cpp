@@ -5,131 +5,247 @@
 #include "renderer.h"
 #include "toon.h"
 
-// Draw a quad over the full screen.  This generates a fragment for
-// each pixel on the screen, allowing the fragment shader to run on
-// each fragment.
 
+// Make the G-buffers for the window's size and the current mode
 
-void drawFullscreenQuad()
+void Renderer::newGBuffers()
 
 {
-  vec2 verts[4] = { vec2( -1, -1 ), vec2( -1, 1 ), vec2( 1, -1 ), vec2( 1, 1 ) };
-    
-  GLuint VAO, VBO;
+  delete gbuffer;
+  delete outlineBuffer;
 
-  glGenVertexArrays( 1, &VAO );
-  glBindVertexArray( VAO );
+  gbuffer = new GBuffer( windowWidth, windowHeight, fused ? LAPLACIAN_GBUFFER : NUM_GBUFFERS, gbufferFormats, window,
+			 resolutionScale );
 
-  glGenBuffers( 1, &VBO );
-  glBindBuffer( GL_ARRAY_BUFFER, VBO );
+  if (outlineWidth > 0)
+    outlineBuffer = new GBuffer( windowWidth, windowHeight, NUM_OUTLINE_BUFFERS, outlineFormats, window,
+				 resolutionScale / outlineScale(), false );
+  else
+    outlineBuffer = NULL;
 
-  glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW );
-
-  glEnableVertexAttribArray( 0 );
-  glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, 0, 0 );
-
-  glDrawArrays( GL_TRIANGLE_STRIP, 0, 4 );
-
-  glDeleteBuffers( 1, &VBO );
-  glDeleteVertexArrays( 1, &VAO );
+  graph->setGBuffer( 0, gbuffer, COLOUR_GBUFFER );
+  graph->setGBuffer( 1, outlineBuffer, HORIZONTAL_OUTLINE );
 }
 
 
-// Render the scene in three passes.
+// Set up the passes: the pass-through rendering, passes 1, 2, and 3
+// of the toon shading, the fused pass that replaces passes 2 and 3,
+// and the outline passes that replace pass 3.  The attachment numbers
+// are also the texture units on which they're read.
+//
+// The window is cleared by display() before render() is called, so
+// passes that draw into the window don't clear it.  Pass 2 writes
+// every pixel of the Laplacian, so it doesn't clear that, either.
 
-
-void Renderer::render( wfModel *obj, mat4 &M, mat4 &MV, mat4 &MVP, vec3 &lightDir )
+void Renderer::addPasses()
 
 {
+  RenderPass *pass;
+
   // Pass-through rendering
-  
-  if (debug == 0) {
 
-    dummyProg->activate();
-    dummyProg->setMat4(  "MVP", MVP );
-    glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
-    glEnable( GL_DEPTH_TEST );
-    obj->draw( dummyProg );
-    dummyProg->deactivate();
-    return;
-  }
+  pass = graph->addPass( "pass-through", dummyProg, [this]() {
+    scene->draw( dummyProg, *M, *MV, *MVP );
+  } );
+  pass->depthTest = true;
 
-  // Pass 1: Store colour, normal, depth in G-Buffers
+  // Pass 1: Store colour and normal in G-Buffers, and depth in the
+  // G-buffer's depth texture
 
-  gbuffer->BindForWriting();
+  pass = graph->addPass( "pass 1", pass1Prog, [this]() {
+    scene->draw( pass1Prog, *M, *MV, *MVP ); // sets M, MV, and MVP for each model
+  } );
+  pass->write( COLOUR_GBUFFER );
+  pass->write( NORMAL_GBUFFER );
+  pass->clear = GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT;
+  pass->depthTest = true;
 
-  pass1Prog->activate();
+  // Pass 2: Store Laplacian (computed from depths) in G-Buffer
 
-  pass1Prog->setMat4(  "M",        M );
-  pass1Prog->setMat4(  "MV",       MV );
-  pass1Prog->setMat4(  "MVP",      MVP );
+  pass = graph->addPass( "pass 2", pass2Prog, [this]() {
+    pass2Prog->setVec2( "texCoordInc", vec2( 1 / (float) gbuffer->width(), 1 / (float) gbuffer->height() ) );
+    graph->drawFullscreen();
+  } );
+  pass->read( DEPTH_GBUFFER, "depthSampler" );
+  pass->write( LAPLACIAN_GBUFFER );
 
-  gbuffer->BindTexture( COLOUR_GBUFFER );
-  gbuffer->BindTexture( NORMAL_GBUFFER );
-  gbuffer->BindTexture( DEPTH_GBUFFER  );
+  // Pass 3: Draw everything using data from G-Buffers
 
-  int activeDrawBuffers1[] = { COLOUR_GBUFFER, NORMAL_GBUFFER, DEPTH_GBUFFER };
-  gbuffer->setDrawBuffers( 3, activeDrawBuffers1 );
+  pass = graph->addPass( "pass 3", pass3Prog, [this]() {
+    pass3Prog->setVec2( "texCoordInc", vec2( 1 / (float) gbuffer->width(), 1 / (float) gbuffer->height() ) );
+    pass3Prog->setVec3( "lightDir", lightDir );
+    pass3Prog->setInt( "upsampling", resolutionScale < 1 );
+    pass3Prog->setVec2( "gbufferSize", vec2( gbuffer->width(), gbuffer->height() ) );
+    graph->drawFullscreen();
+  } );
+  pass->read( COLOUR_GBUFFER,    "colourSampler" );
+  pass->read( NORMAL_GBUFFER,    "normalSampler" );
+  pass->read( DEPTH_GBUFFER,     "depthSampler" );
+  pass->read( LAPLACIAN_GBUFFER, "laplacianSampler" );
+
+  // Passes 2 and 3 fused: the Laplacian is computed from the depths in
+  // the same pass as the shading
+
+  pass = graph->addPass( "fused pass 2+3", fusedProg, [this]() {
+    fusedProg->setVec2( "texCoordInc", vec2( 1 / (float) gbuffer->width(), 1 / (float) gbuffer->height() ) );
+    fusedProg->setVec3( "lightDir", lightDir );
+    fusedProg->setInt( "upsampling", resolutionScale < 1 );
+    fusedProg->setVec2( "gbufferSize", vec2( gbuffer->width(), gbuffer->height() ) );
+    graph->drawFullscreen();
+  } );
+  pass->read( COLOUR_GBUFFER,      "colourSampler" );
+  pass->read( NORMAL_GBUFFER,      "normalSampler" );
+  pass->read( FUSED_DEPTH_GBUFFER, "depthSampler" );
+
+  // Outlines of any width: the distance to the nearest edge texel is
+  // found in a horizontal pass and then a vertical pass over the edges
+  // found by pass 2, and is used in place of pass 3's search
+
+  pass = graph->addPass( "outline x", outlineXProg, [this]() {
+    int scale = outlineScale();
+    float width = gbufferOutlineWidth();
+    outlineXProg->setVec2( "texCoordInc", vec2( 1 / (float) gbuffer->width(), 1 / (float) gbuffer->height() ) );
+    outlineXProg->setInt( "radius", (int) ceil( width / scale ) );
+    outlineXProg->setInt( "scale", scale );
+    outlineXProg->setFloat( "maxDistance", width );
+    graph->drawFullscreen();
+  } );
+  pass->read( LAPLACIAN_GBUFFER, "laplacianSampler" );
+  pass->write( HORIZONTAL_OUTLINE );
+
+  pass = graph->addPass( "outline y", outlineYProg, [this]() {
+    int scale = outlineScale();
+    float width = gbufferOutlineWidth();
+    outlineYProg->setVec2( "texCoordInc", vec2( 1 / (float) outlineBuffer->width(), 1 / (float) outlineBuffer->height() ) );
+    outlineYProg->setInt( "radius", (int) ceil( width / scale ) );
+    outlineYProg->setInt( "scale", scale );
+    outlineYProg->setFloat( "maxDistance", width );
+    graph->drawFullscreen();
+  } );
+  pass->read( HORIZONTAL_OUTLINE, "horizontalSampler" );
+  pass->write( OUTLINE );
+
+  pass = graph->addPass( "outline", outlineProg, [this]() {
+    outlineProg->setVec3( "lightDir", lightDir );
+    outlineProg->setFloat( "outlineWidth", gbufferOutlineWidth() );
+    outlineProg->setInt( "upsampling", resolutionScale < 1 );
+    outlineProg->setVec2( "gbufferSize", vec2( gbuffer->width(), gbuffer->height() ) );
+    graph->drawFullscreen();
+  } );
+  pass->read( COLOUR_GBUFFER, "colourSampler" );
+  pass->read( NORMAL_GBUFFER, "normalSampler" );
+  pass->read( DEPTH_GBUFFER,  "depthSampler" );
+  pass->read( OUTLINE,        "outlineSampler" );
+}
 
-  glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
-  glEnable( GL_DEPTH_TEST );
 
-  obj->draw( pass1Prog );
+// Dynamic resolution: scale the G-buffer by one step down if frames
+// take longer than frameBudgetMs, and by one step up if there's room.
+//
+// Frames are timed on the GPU if timer queries are available.
+// Otherwise the time between calls is used, which can't go below the
+// display's refresh period with vsync, so a frame counts as having
+// room if it's near the budget, and the scale is raised less often
+// than it's lowered, as a probe.
 
-  pass1Prog->deactivate();
+void Renderer::updateResolutionScale()
 
-  if (debug == 1) { // stop after pass 1
-    gbuffer->DrawGBuffers();
+{
+  auto now = std::chrono::steady_clock::now();
+  float intervalMs = std::chrono::duration<float, std::milli>( now - lastFrameStart ).count();
+  lastFrameStart = now;
+
+  if (frameBudgetMs <= 0 || debug == 0)
     return;
+
+  float cpuMs, gpuMs;
+  graph->lastFrameTimes( cpuMs, gpuMs );
+
+  float frameMs = (graph->hasTimerQueries() ? gpuMs : intervalMs);
+
+  smoothedFrameMs = (smoothedFrameMs == 0 ? frameMs : 0.9 * smoothedFrameMs + 0.1 * frameMs);
+
+  framesSinceScaleChange++;
+
+  float scale = resolutionScale;
+
+  if (smoothedFrameMs > 1.1 * frameBudgetMs) {
+    if (framesSinceScaleChange >= RESOLUTION_SETTLE_FRAMES)
+      scale = fmax( MIN_RESOLUTION_SCALE, resolutionScale - RESOLUTION_STEP );
+  } else if (graph->hasTimerQueries()) {
+    if (smoothedFrameMs < 0.75 * frameBudgetMs && framesSinceScaleChange >= RESOLUTION_SETTLE_FRAMES)
+      scale = fmin( 1, resolutionScale + RESOLUTION_STEP );
+  } else {
+    if (smoothedFrameMs < 1.05 * frameBudgetMs && framesSinceScaleChange >= 4 * RESOLUTION_SETTLE_FRAMES)
+      scale = fmin( 1, resolutionScale + RESOLUTION_STEP );
   }
 
-  // Pass 2: Store Laplacian (computed from depths) in G-Buffer
+  if (scale != resolutionScale) {
+    resolutionScale = scale;
+    newGBuffers();
+    framesSinceScaleChange = 0;
+  }
+}
 
-  pass2Prog->activate();
 
-  pass2Prog->setVec2( "texCoordInc", vec2( 1 / (float) windowWidth, 1 / (float) windowHeight ) );
+// Render the scene in three passes (or two, if fused, or five, with
+// wide outlines), or stop after pass 'debug' and show the G-buffers.
 
-  pass2Prog->setInt( "depthSampler", DEPTH_GBUFFER );
+void Renderer::render( Scene *scene, mat4 &M, mat4 &MV, mat4 &MVP, vec3 &lightDir )
 
-  gbuffer->BindTexture( LAPLACIAN_GBUFFER );
+{
+  updateResolutionScale();
 
-  int activeDrawBuffers2[] = { LAPLACIAN_GBUFFER };
-  gbuffer->setDrawBuffers( 1, activeDrawBuffers2 );
+  this->scene = scene;
+  this->M = &M;
+  this->MV = &MV;
+  this->MVP = &MVP;
+  this->lightDir = lightDir;
 
-  glClear( GL_COLOR_BUFFER_BIT );
-  glDisable( GL_DEPTH_TEST );
+  static int dummyPasses[]   = { DUMMY_PASS };
+  static int toonPasses[]    = { PASS1, PASS2, PASS3 };
+  static int fusedPasses[]   = { PASS1, FUSED_PASS };
+  static int outlinePasses[] = { PASS1, PASS2, OUTLINE_X_PASS, OUTLINE_Y_PASS, OUTLINE_PASS };
 
-  drawFullscreenQuad();
+  if (debug == 0) {
+    graph->execute( 1, dummyPasses );
+    return;
+  }
 
-  pass2Prog->deactivate();
+  if (fused)
+    graph->execute( debug == 3 ? 2 : 1, fusedPasses );
+  else if (outlineWidth > 0 && debug == 3)
+    graph->execute( 5, outlinePasses );
+  else
+    graph->execute( debug, toonPasses );
 
-  if (debug == 2) { // stop after pass 2
+  if (debug < 3) {
     gbuffer->DrawGBuffers();
-    return;
+    drawDepthView();
   }
+}
 
-  // Pass 3: Draw everything using data from G-Buffers
 
-  glBindFramebuffer( GL_DRAW_FRAMEBUFFER, 0 );
-  glClear( GL_COLOR_BUFFER_BIT );
-  glDisable( GL_DEPTH_TEST );
+// Draw the depth texture in the lower-right quadrant of the window,
+// which DrawGBuffers() leaves empty because there are at most three
+// colour textures.
 
-  pass3Prog->activate();
+void Renderer::drawDepthView()
 
-  pass3Prog->setVec2( "texCoordInc", vec2( 1 / (float) windowWidth, 1 / (float) windowHeight ) );
-  pass3Prog->setVec3( "lightDir", lightDir );
+{
+  int depthTexture = (fused ? FUSED_DEPTH_GBUFFER : DEPTH_GBUFFER);
 
-  pass3Prog->setInt( "colourSampler",    COLOUR_GBUFFER );
-  pass3Prog->setInt( "normalSampler",    NORMAL_GBUFFER );
-  pass3Prog->setInt( "depthSampler",     DEPTH_GBUFFER );
-  pass3Prog->setInt( "laplacianSampler", LAPLACIAN_GBUFFER );
+  GLint viewport[4];
+  glGetIntegerv( GL_VIEWPORT, viewport );
 
-  gbuffer->BindTexture( COLOUR_GBUFFER );
-  gbuffer->BindTexture( NORMAL_GBUFFER );
-  gbuffer->BindTexture( DEPTH_GBUFFER );
-  gbuffer->BindTexture( LAPLACIAN_GBUFFER  );
+  glViewport( viewport[0] + viewport[2]/2, viewport[1], viewport[2] - viewport[2]/2, viewport[3]/2 );
+  glDisable( GL_DEPTH_TEST );
 
-  drawFullscreenQuad();
+  depthProg->activate();
+  gbuffer->BindTexture( depthTexture );
+  depthProg->setInt( "depthSampler", depthTexture );
+  graph->drawFullscreen();
+  depthProg->deactivate();
 
-  pass3Prog->deactivate();
+  glViewport( viewport[0], viewport[1], viewport[2], viewport[3] );
 }
@@ -4,42 +4,131 @@
 #define RENDER_H
 
 
-#include "wavefront.h"
+#include "scene.h"
 #include "gpuProgram.h"
 #include "gbuffer.h"
+#include "renderGraph.h"
+
+#include <chrono>
+
+
+// Dynamic resolution: the G-buffer is scaled by multiples of
+// RESOLUTION_STEP to keep frames within a time budget
+
+#define MIN_RESOLUTION_SCALE     0.5
+#define RESOLUTION_STEP          0.125
+#define RESOLUTION_SETTLE_FRAMES 30	/* frames between changes of scale */
 
 
 class Renderer {
 
+  // G-buffer textures.  Colour is RGBA8, the normal is octahedral
+  // encoded in RG16F, and the Laplacian is R16F.  The depth is read
+  // from the G-buffer's depth texture, which follows the others.
+  //
+  // When passes 2 and 3 are fused, there's no Laplacian texture, so
+  // the depth texture takes its place.
+
   enum { COLOUR_GBUFFER,
 	 NORMAL_GBUFFER,
-	 DEPTH_GBUFFER,
 	 LAPLACIAN_GBUFFER,
-	 NUM_GBUFFERS };
+	 NUM_GBUFFERS,
+	 DEPTH_GBUFFER = NUM_GBUFFERS,
+	 FUSED_DEPTH_GBUFFER = LAPLACIAN_GBUFFER };
+
+  // Outline textures, in a separate G-buffer that can be at a lower
+  // resolution.  Each holds a distance in G-buffer texels: the
+  // horizontal distance to the nearest edge texel, and the distance to
+  // the nearest edge texel.
+
+  enum { HORIZONTAL_OUTLINE = DEPTH_GBUFFER + 1,
+	 OUTLINE,
+	 NUM_OUTLINE_BUFFERS = 2 };
 
-  GPUProgram *pass1Prog, *pass2Prog, *pass3Prog, *dummyProg;
+  enum { DUMMY_PASS, PASS1, PASS2, PASS3, FUSED_PASS,
+	 OUTLINE_X_PASS, OUTLINE_Y_PASS, OUTLINE_PASS }; /* in the graph */
+
+  GLenum gbufferFormats[ NUM_GBUFFERS ] = { GL_RGBA8, GL_RG16F, GL_R16F };
+  GLenum outlineFormats[ NUM_OUTLINE_BUFFERS ] = { GL_R16F, GL_R16F };
+
+  GPUProgram *pass1Prog, *pass2Prog, *pass3Prog, *fusedProg, *dummyProg;
+  GPUProgram *outlineXProg, *outlineYProg, *outlineProg;
+  GPUProgram *depthProg;		/* shows the depth texture when debugging */
   GBuffer    *gbuffer;
+  GBuffer    *outlineBuffer;	/* NULL unless outlineWidth > 0 */
+  RenderGraph *graph;
 
   int windowWidth, windowHeight;
+  GLFWwindow *window;
+
+  // Arguments of the render() call in progress, for the passes' draw
+  // functions
+
+  Scene *scene;
+  mat4  *M, *MV, *MVP;
+  vec3   lightDir;
+
+  void addPasses();
+  void newGBuffers();
+  void drawDepthView();
+  int  outlineScale() { return halfResOutline ? 2 : 1; }
+  float gbufferOutlineWidth() { return outlineWidth * resolutionScale; } /* in G-buffer texels */
+
+  // Dynamic resolution state
+
+  std::chrono::steady_clock::time_point lastFrameStart;
+  float smoothedFrameMs;
+  int   framesSinceScaleChange;
+
+  void updateResolutionScale();
 
  public:
 
-  int debug;
+  int  debug;
+  bool fused;			/* passes 2 and 3 are done together, without a Laplacian texture */
+  int  outlineWidth;		/* in window pixels; 0 = pass 3's own outlines */
+  bool halfResOutline;		/* outline passes are at half resolution */
+  float frameBudgetMs;		/* 0 = G-buffer at full resolution */
+  float resolutionScale;	/* of the G-buffer, relative to the window */
 
   Renderer( int width, int height, GLFWwindow *window ) {
 
     windowWidth = width;
     windowHeight = height;
-    gbuffer = new GBuffer( width, height, NUM_GBUFFERS, window );
+    this->window = window;
+    fused = false;
+    outlineWidth = 0;
+    halfResOutline = false;
+    frameBudgetMs = 0;
+    resolutionScale = 1;
+    smoothedFrameMs = 0;
+    framesSinceScaleChange = 0;
+    lastFrameStart = std::chrono::steady_clock::now();
     pass1Prog = new GPUProgram( "../shaders/pass1.vert", "../shaders/pass1.frag" );
     pass2Prog = new GPUProgram( "../shaders/pass2.vert", "../shaders/pass2.frag" );
-    pass3Prog = new GPUProgram( "../shaders/pass3.vert", "../shaders/pass3.frag" );
+    pass3Prog = new GPUProgram( "../shaders/pass3.vert", "../shaders/pass3.frag", "../shaders/gbuffer.glsl" );
+    fusedProg = new GPUProgram( "../shaders/pass3.vert", "../shaders/fused.frag", "../shaders/gbuffer.glsl" );
     dummyProg = new GPUProgram( "../shaders/dummy.vert", "../shaders/dummy.frag" );
+    outlineXProg = new GPUProgram( "../shaders/pass3.vert", "../shaders/outlineX.frag" );
+    outlineYProg = new GPUProgram( "../shaders/pass3.vert", "../shaders/outlineY.frag" );
+    outlineProg  = new GPUProgram( "../shaders/pass3.vert", "../shaders/outline.frag", "../shaders/gbuffer.glsl" );
+    depthProg    = new GPUProgram( "../shaders/pass3.vert", "../shaders/depth.frag" );
+    gbuffer = outlineBuffer = NULL;
+    graph = new RenderGraph();
+    newGBuffers();
+    addPasses();
     debug = 3;  // initially show output of pass 3
   }
 
   ~Renderer() {
+    delete graph;
     delete gbuffer;
+    delete outlineBuffer;
+    delete depthProg;
+    delete outlineProg;
+    delete outlineYProg;
+    delete outlineXProg;
+    delete fusedProg;
     delete pass3Prog;
     delete pass2Prog;
     delete pass1Prog;
@@ -49,21 +138,56 @@ class Renderer {
   void reshape( int width, int height, GLFWwindow *window ) {
     windowWidth = width;
     windowHeight = height;
-    delete gbuffer;
-    gbuffer = new GBuffer( width, height, NUM_GBUFFERS, window );
+    this->window = window;
+    newGBuffers();
   }
 
-  void render( wfModel *obj, mat4 &M, mat4 &MV, mat4 &MVP, vec3 &lightDir );
+  void render( Scene *scene, mat4 &M, mat4 &MV, mat4 &MVP, vec3 &lightDir );
 
   void incDebug() {
     debug = (debug+1) % 4; // cycle in 0,1,2,3
+    if (fused && debug == 2) // no pass 2 when fused
+      debug = 3;
+  }
+
+  void toggleFused() {
+    fused = !fused;
+    if (fused && debug == 2)
+      debug = 3;
+    if (fused)
+      outlineWidth = 0;		// outlines need the Laplacian texture
+    newGBuffers();
+  }
+
+  void setOutlineWidth( int width ) {
+    outlineWidth = (width < 0 ? 0 : width);
+    if (outlineWidth > 0)
+      fused = false;
+    newGBuffers();
+  }
+
+  void toggleHalfResOutline() {
+    halfResOutline = !halfResOutline;
+    newGBuffers();
+  }
+
+  void timingReport() {
+    cout << "Time per frame of each pass (G-buffer of " << gbuffer->bytesPerPixel() << " bytes per pixel):" << endl;
+    graph->timingReport();
   }
 
   void makeStatusMessage( char *buffer ) {
     if (debug == 0)
       sprintf( buffer, "Program output" );
+    else if (fused && debug == 3)
+      sprintf( buffer, "After fused passes 2 and 3" );
+    else if (outlineWidth > 0 && debug == 3)
+      sprintf( buffer, "After pass 3 with outline width %d%s", outlineWidth, halfResOutline ? " at half resolution" : "" );
     else
       sprintf( buffer, "After pass %d", debug );
+
+    if (frameBudgetMs > 0)
+      sprintf( buffer + strlen(buffer), ", G-buffer at %d%% scale", (int) (100 * resolutionScale + 0.5) );
   }
 };
 
@@ -0,0 +1,274 @@
+// scan.h
+//
+// Functions to scan numbers and tokens directly out of an in-memory
+// text buffer.  Each function takes a reference to the current
+// position 'p', which it advances past whatever it consumed, and the
+// end of the buffer 'end'.  The buffer need not be NUL-terminated.
+//
+// Blanks are spaces, tabs, and carriage returns.  Newlines are never
+// skipped except by skipLine(), so a caller can tell where each line
+// ends.
+//
+// scanFloat() gives exactly the same result as fscanf("%f") or
+// strtof(), but uses a fast path for the short decimal numbers that
+// make up almost all model files.
+
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <cstdlib>
+#include <cstring>
+
+
+inline bool isBlank( char c )
+
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+
+inline bool isDigit( char c )
+
+{
+  return (unsigned char) (c - '0') < 10;
+}
+
+
+inline void skipBlanks( const char *&p, const char *end )
+
+{
+  while (p < end && isBlank(*p))
+    p++;
+}
+
+
+// Skip to just past the next newline (or to the end of the buffer)
+
+inline void skipLine( const char *&p, const char *end )
+
+{
+  const char *nl = (const char *) memchr( p, '\n', end - p );
+  p = (nl ? nl+1 : end);
+}
+
+
+// Return true if only blanks remain before the end of the line
+
+inline bool atEndOfLine( const char *&p, const char *end )
+
+{
+  skipBlanks( p, end );
+  return p == end || *p == '\n';
+}
+
+
+// Skip blanks, then return the start of the next token and its
+// length.  Returns a length of 0 if the line has no more tokens.
+
+inline const char *scanToken( const char *&p, const char *end, int &len )
+
+{
+  skipBlanks( p, end );
+
+  const char *start = p;
+  while (p < end && *p != '\n' && !isBlank(*p))
+    p++;
+
+  len = p - start;
+  return start;
+}
+
+
+// Copy the next token into 'buf' as a NUL-terminated string.  Returns
+// false if the line has no more tokens.  Long tokens are truncated.
+
+inline bool scanString( const char *&p, const char *end, char *buf, int bufSize )
+
+{
+  int len;
+  const char *start = scanToken( p, end, len );
+
+  if (len >= bufSize)
+    len = bufSize-1;
+
+  memcpy( buf, start, len );
+  buf[len] = '\0';
+
+  return len > 0;
+}
+
+
+// Scan an optionally signed decimal integer
+
+inline bool scanInt( const char *&p, const char *end, int &val )
+
+{
+  skipBlanks( p, end );
+
+  const char *s = p;
+  bool neg = false;
+
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = (*s == '-');
+    s++;
+  }
+
+  if (s == end || !isDigit(*s))
+    return false;
+
+  int v = 0;
+  while (s < end && isDigit(*s))
+    v = 10*v + (*s++ - '0');
+
+  val = (neg ? -v : v);
+  p = s;
+  return true;
+}
+
+
+// Scan a float by copying the token and calling strtof().  This
+// handles all of the cases that the fast path below does not.
+
+inline bool scanFloatSlow( const char *&p, const char *end, float &val )
+
+{
+  char buf[64];
+  int  len = 0;
+
+  while (p+len < end && len < (int) sizeof(buf)-1 && p[len] != '\n' && !isBlank(p[len])) {
+    buf[len] = p[len];
+    len++;
+  }
+  buf[len] = '\0';
+
+  char *after;
+  float v = strtof( buf, &after );
+
+  if (after == buf)
+    return false;
+
+  val = v;
+  p += (after - buf);
+  return true;
+}
+
+
+// Scan a float.
+//
+// The fast path collects up to 19 significant digits into an integer
+// and applies the decimal exponent with a single double-precision
+// multiply or divide by an exactly representable power of ten.  That
+// gives the correctly rounded double, which rounds to the correctly
+// rounded float unless it lies exactly halfway between two floats,
+// in which case (as for any unusual input) strtof() is used instead.
+
+inline bool scanFloat( const char *&p, const char *end, float &val )
+
+{
+  static const double pow10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+				  1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+				  1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+  skipBlanks( p, end );
+
+  const char *s = p;
+  bool neg = false;
+
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = (*s == '-');
+    s++;
+  }
+
+  unsigned long long mant = 0;
+  int  numDigits = 0;		// significant digits in 'mant'
+  int  exp10 = 0;
+  bool sawDigit = false;
+  bool truncated = false;
+
+  while (s < end && isDigit(*s)) {
+    if (numDigits < 19) {
+      mant = 10*mant + (*s - '0');
+      if (mant > 0)
+	numDigits++;
+    } else {
+      exp10++;
+      truncated = true;
+    }
+    sawDigit = true;
+    s++;
+  }
+
+  if (s < end && *s == '.') {
+    s++;
+    while (s < end && isDigit(*s)) {
+      if (numDigits < 19) {
+	mant = 10*mant + (*s - '0');
+	if (mant > 0)
+	  numDigits++;
+	exp10--;
+      } else
+	truncated = true;
+      sawDigit = true;
+      s++;
+    }
+  }
+
+  if (!sawDigit || truncated)
+    return scanFloatSlow( p, end, val );
+
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    const char *e = s+1;
+    bool eneg = false;
+    if (e < end && (*e == '-' || *e == '+')) {
+      eneg = (*e == '-');
+      e++;
+    }
+    if (e == end || !isDigit(*e))
+      return scanFloatSlow( p, end, val );
+    int ev = 0;
+    while (e < end && isDigit(*e)) {
+      if (ev < 10000)
+	ev = 10*ev + (*e - '0');
+      e++;
+    }
+    exp10 += (eneg ? -ev : ev);
+    s = e;
+  }
+
+  if (s < end && (*s == 'x' || *s == 'X' || *s == 'p' || *s == 'P'))
+    return scanFloatSlow( p, end, val ); // hex float
+
+  if (mant == 0) {
+    val = (neg ? -0.0f : 0.0f);
+    p = s;
+    return true;
+  }
+
+  if (mant > (1ULL << 53) || exp10 < -22 || exp10 > 22)
+    return scanFloatSlow( p, end, val );
+
+  double d = (double) mant;
+  if (exp10 < 0)
+    d /= pow10[-exp10];
+  else
+    d *= pow10[exp10];
+
+  // Outside the range of normal floats, or exactly halfway between
+  // two floats?  Then double rounding might differ from strtof().
+
+  unsigned long long bits;
+  memcpy( &bits, &d, sizeof(bits) );
+
+  int biasedExp = (int) ((bits >> 52) & 0x7ff);
+
+  if (biasedExp < 1023-126 || biasedExp > 1023+127 || (bits & 0x1fffffffULL) == 0x10000000ULL)
+    return scanFloatSlow( p, end, val );
+
+  float f = (float) d;
+  val = (neg ? -f : f);
+  p = s;
+  return true;
+}
+
+#endif
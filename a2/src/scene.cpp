@@ -0,0 +1,458 @@
+/* scene.cpp
+ */
+
+
+#include "headers.h"
+#include "gpuProgram.h"
+#include "scene.h"
+
+
+Scene::~Scene()
+
+{
+  for (int i=0; i<models.size(); i++)
+    delete models[i];
+}
+
+
+// Find the model read from 'filename', or add it if there's none
+
+SceneModel *Scene::findModel( char *filename )
+
+{
+  for (int i=0; i<models.size(); i++)
+    if (strcmp( models[i]->filename, filename ) == 0)
+      return models[i];
+
+  SceneModel *sm = new SceneModel( filename );
+  models.add( sm );
+
+  return sm;
+}
+
+
+// Add one instance of a model
+
+void Scene::addModel( char *filename )
+
+{
+  findModel( filename )->instances.add( identity4() );
+}
+
+
+// Read a scene file (see scene.h)
+
+void Scene::read( char *filename )
+
+{
+  FILE *file = fopen( filename, "r" );
+  if (!file) {
+    cerr << "Scene::read() couldn't open file '" << filename << "'" << endl;
+    exit(-1);
+  }
+
+  /* model paths are relative to the directory of the scene file */
+
+  char *dir = new char[ strlen( filename )+1 ];
+
+  strcpy( dir, filename );
+
+  char *s = strrchr(dir, '/');
+  if (s)
+    s[1] = '\0';
+  else
+    dir[0] = '\0';
+
+  SceneModel *current = NULL;
+
+  char line[1000];
+  int  lineNum = 0;
+
+  while (fgets( line, sizeof(line), file ) != NULL) {
+
+    lineNum++;
+
+    char cmd[100];
+    int  n;
+
+    if (sscanf( line, " %99s%n", cmd, &n ) != 1 || cmd[0] == '#')
+      continue;
+
+    char *p = line + n;
+
+    if (strcmp( cmd, "model" ) == 0) {
+
+      char name[1000];
+
+      if (sscanf( p, " %999[^\r\n]", name ) != 1) {
+	cerr << "Error: no filename for model on line " << lineNum << " of " << filename << endl;
+	exit(-1);
+      }
+
+      for (char *e = name + strlen(name) - 1; e > name && isspace(*e); e--) /* trailing spaces */
+	*e = '\0';
+
+      char *path = new char[ strlen(dir) + strlen(name) + 1 ];
+
+      strcpy( path, dir );
+      strcat( path, name );
+
+      current = findModel( path );
+
+      delete [] path;
+
+    } else if (strcmp( cmd, "instance" ) == 0) {
+
+      if (current == NULL) {
+	cerr << "Error: instance before any model on line " << lineNum << " of " << filename << endl;
+	exit(-1);
+      }
+
+      float v[16];
+      int   count = 0;
+
+      while (count < 16 && sscanf( p, "%f%n", &v[count], &n ) == 1) {
+	p += n;
+	count++;
+      }
+
+      mat4 T;
+
+      if (count == 16) {
+	for (int r=0; r<4; r++)
+	  for (int c=0; c<4; c++)
+	    T[r][c] = v[4*r+c];
+      } else if (count == 3)
+	T = translate( v[0], v[1], v[2] );
+      else {
+	cerr << "Error: instance needs 3 or 16 values on line " << lineNum << " of " << filename << endl;
+	exit(-1);
+      }
+
+      current->instances.add( T );
+
+    } else
+
+      cerr << "Warning: unrecognized scene command on line " << lineNum << ": " << cmd << endl;
+  }
+
+  fclose( file );
+  delete [] dir;
+
+  if (models.size() == 0) {
+    cerr << "Error: no models in " << filename << endl;
+    exit(-1);
+  }
+
+  for (int i=0; i<models.size(); i++)
+    if (models[i]->instances.size() == 0)
+      models[i]->instances.add( identity4() );
+}
+
+
+// Continue loading the models.  Each model is started once the
+// previous one has been read, so that reading one model overlaps with
+// sending the previous one to OpenGL.  Returns true when all models
+// are loaded.
+
+bool Scene::continueLoading()
+
+{
+  if (nextToLoad < models.size() &&
+      (nextToLoad == 0 || models[nextToLoad-1]->model->extentsKnown())) {
+
+    SceneModel *sm = models[nextToLoad];
+
+    sm->model->startLoading( sm->filename, textureMode );
+    sm->loading = true;
+    nextToLoad++;
+  }
+
+  bool done = (nextToLoad == models.size());
+
+  for (int i=0; i<nextToLoad; i++)
+    if (models[i]->loading) {
+      if (models[i]->model->continueLoading())
+	models[i]->loading = false;
+      else
+	done = false;
+    }
+
+  if (!extentsFound && nextToLoad == models.size() && models[nextToLoad-1]->model->extentsKnown())
+    findExtents();
+
+  return done;
+}
+
+
+// Find the centre and radius of the scene from the bounding box of
+// each instance
+
+void Scene::findExtents()
+
+{
+  vec3 min( MAXFLOAT, MAXFLOAT, MAXFLOAT );
+  vec3 max( -MAXFLOAT, -MAXFLOAT, -MAXFLOAT );
+
+  for (int i=0; i<models.size(); i++) {
+
+    wfModel *model = models[i]->model;
+
+    for (int j=0; j<models[i]->instances.size(); j++) {
+
+      mat4 T = models[i]->instances[j] * model->modelTransform;
+
+      for (int k=0; k<8; k++) {
+
+	vec4 corner = T * vec4( (k & 1) ? model->max.x : model->min.x,
+				(k & 2) ? model->max.y : model->min.y,
+				(k & 4) ? model->max.z : model->min.z, 1 );
+	vec3 p( corner.x / corner.w, corner.y / corner.w, corner.z / corner.w );
+
+	if (p.x < min.x) min.x = p.x;
+	if (p.y < min.y) min.y = p.y;
+	if (p.z < min.z) min.z = p.z;
+	if (p.x > max.x) max.x = p.x;
+	if (p.y > max.y) max.y = p.y;
+	if (p.z > max.z) max.z = p.z;
+      }
+    }
+  }
+
+  centre = 0.5 * (min + max);
+  radius = 0.5 * (max - min).length();
+
+  extentsFound = true;
+}
+
+
+float Scene::loadProgress()
+
+{
+  float sum = 0;
+
+  for (int i=0; i<nextToLoad; i++)
+    sum += models[i]->model->loadProgress();
+
+  return sum / models.size();
+}
+
+
+int Scene::numInstances()
+
+{
+  int n = 0;
+
+  for (int i=0; i<models.size(); i++)
+    n += models[i]->instances.size();
+
+  return n;
+}
+
+
+// Find the instances in the frustum of MVP, which transforms the
+// scene's world coordinates.  Each model's level of detail is chosen
+// for its largest visible instance.  pixelsPerUnit is the height in
+// pixels of an object of height 1 at distance 1 from the viewer.
+
+void Scene::cull( mat4 &MVP, float pixelsPerUnit )
+
+{
+  numInstancesDrawn = numInstancesCulled = 0;
+
+  for (int i=0; i<models.size(); i++) {
+
+    SceneModel *sm = models[i];
+    wfModel *model = sm->model;
+
+    sm->visible.resize( 0 );
+
+    if (!model->extentsKnown())
+      continue;
+
+    float maxRadius = 0;	/* largest projected radius, in pixels */
+    bool  tooClose = false;	/* some instance contains the viewer */
+
+    for (int j=0; j<sm->instances.size(); j++) {
+
+      mat4 &I = sm->instances[j];
+      mat4 T = MVP * I * model->objToWorldTransform;
+
+      if (model->outsideFrustum( T )) {
+	numInstancesCulled++;
+	continue;
+      }
+
+      sm->visible.add( I );
+
+      if (model->numLODs > 1) {
+
+	// The radius is scaled by the largest scaling in the instance's
+	// transformation, and divided by its distance, which is the w
+	// of its centre in clip coordinates
+
+	mat4 W = I * model->modelTransform;
+
+	float scaling = 0;
+	for (int c=0; c<3; c++) {
+	  float s = vec3( W[0][c], W[1][c], W[2][c] ).length();
+	  if (s > scaling)
+	    scaling = s;
+	}
+
+	float r = model->radius * scaling;
+	float distance = (MVP * W * vec4( model->centre, 1 )).w;
+
+	if (distance > r) {
+	  if (r / distance * pixelsPerUnit > maxRadius)
+	    maxRadius = r / distance * pixelsPerUnit;
+	} else
+	  tooClose = true;
+      }
+    }
+
+    numInstancesDrawn += sm->visible.size();
+
+    // Send the visible transformations for instanced drawing, column
+    // by column, as a mat4 attribute is read
+
+    if (sm->visible.size() > 1) {
+
+      sm->columns.resize( 16 * sm->visible.size() );
+
+      for (int j=0; j<sm->visible.size(); j++) {
+	mat4 T = sm->visible[j] * model->objToWorldTransform;
+	for (int c=0; c<4; c++)
+	  for (int r=0; r<4; r++)
+	    sm->columns[16*j + 4*c + r] = T[r][c];
+      }
+
+      model->setInstances( &sm->columns[0], sm->visible.size() );
+    }
+
+    if (model->numLODs > 1) {
+      if (tooClose)
+	model->lod = 0;
+      else
+	model->selectLOD( maxRadius );
+    }
+  }
+}
+
+
+// Draw the instances found by cull().  M, MV, and MVP transform the
+// scene's world coordinates.  These uniforms are set in gpuProg for
+// each model.
+
+void Scene::draw( GPUProgram *gpuProg, mat4 &M, mat4 &MV, mat4 &MVP )
+
+{
+  numGroupsDrawn = numGroupsCulled = 0;
+
+  for (int i=0; i<models.size(); i++) {
+
+    SceneModel *sm = models[i];
+    wfModel *model = sm->model;
+
+    if (sm->visible.size() == 0)
+      continue;
+
+    if (sm->visible.size() == 1) {
+
+      // One instance: draw it without instancing, so that its groups
+      // are culled
+
+      mat4 T = sm->visible[0] * model->objToWorldTransform;
+
+      mat4 MT   = M * T;
+      mat4 MVT  = MV * T;
+      mat4 MVPT = MVP * T;
+
+      gpuProg->setMat4( "M", MT );
+      gpuProg->setMat4( "MV", MVT );
+      gpuProg->setMat4( "MVP", MVPT );
+
+      model->draw( gpuProg, &MVPT );
+
+    } else {
+
+      gpuProg->setMat4( "M", M );
+      gpuProg->setMat4( "MV", MV );
+      gpuProg->setMat4( "MVP", MVP );
+
+      model->drawInstanced( gpuProg );
+    }
+
+    numGroupsDrawn  += model->numGroupsDrawn;
+    numGroupsCulled += model->numGroupsCulled;
+  }
+}
+
+
+// Find the nearest triangle hit by the ray origin + t dir, t >= 0, in
+// the scene's world coordinates.  The ray is moved into the model
+// coordinates of each instance, where the same t gives the same
+// point.
+
+bool Scene::raycast( vec3 origin, vec3 dir, SceneHit &hit )
+
+{
+  bool  found = false;
+  float nearest = MAXFLOAT;
+
+  for (int i=0; i<models.size(); i++) {
+
+    wfModel *model = models[i]->model;
+
+    for (int j=0; j<models[i]->instances.size(); j++) {
+
+      mat4 worldToModel = inverse( models[i]->instances[j] * model->modelTransform );
+
+      vec4 o = worldToModel * vec4( origin, 1 );
+      vec4 d = worldToModel * vec4( dir, 0 );
+
+      wfHit h;
+
+      if (model->raycast( vec3( o.x/o.w, o.y/o.w, o.z/o.w ), vec3( d.x, d.y, d.z ), h ) && h.t < nearest) {
+	nearest = h.t;
+	hit.model = models[i];
+	hit.instance = j;
+	hit.hit = h;
+	found = true;
+      }
+    }
+  }
+
+  return found;
+}
+
+
+void Scene::releaseCPUData()
+
+{
+  for (int i=0; i<models.size(); i++)
+    models[i]->model->releaseCPUData();
+}
+
+
+void Scene::memoryReport()
+
+{
+  for (int i=0; i<models.size(); i++)
+    models[i]->model->memoryReport();
+
+  if (models.size() > 1 || models[0]->instances.size() > 1)
+    cout << "Scene: " << models.size() << " models, " << numInstances() << " instances" << endl;
+}
+
+
+long long Scene::gpuBytes()
+
+{
+  long long bytes = 0;
+
+  for (int i=0; i<models.size(); i++)
+    bytes += models[i]->model->gpuBytes();
+
+  return bytes;
+}
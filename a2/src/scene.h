@@ -0,0 +1,125 @@
+/* scene.h
+ *
+ * A scene of Wavefront models, each placed any number of times.
+ *
+ * A scene file lists .obj files, each followed by the transformations
+ * of its instances:
+ *
+ *   # a comment
+ *   model chair.obj
+ *   instance 1 0 0 4  0 1 0 0  0 0 1 0  0 0 0 1    (16 values, row by row, as for 'transform' in a .obj file)
+ *   instance 8 0 0                                 (3 values: a translation)
+ *   model table.obj
+ *   instance 6 0 0
+ *
+ * Paths are relative to the scene file.  A model with no instances
+ * has one, with the identity transformation.  A model that is listed
+ * more than once is loaded once, and its instances are combined.
+ *
+ * Each model is drawn with one glDrawElementsInstanced() per material
+ * for all of its instances, with the instance transformations in a
+ * per-instance vertex attribute (see wfModel::drawInstanced()).
+ * Instances outside the view frustum are skipped by cull(), which is
+ * called once per frame before draw(), and which sends the visible
+ * instances' transformations to OpenGL, so that draw() can be called
+ * for several passes without sending them again.  A model with just
+ * one visible instance is drawn normally, so that its groups are
+ * culled individually.
+ *
+ * The models are loaded in the background, one after another, and
+ * each is drawn as it arrives (see wfModel::startLoading()).
+ */
+
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "headers.h"
+#include "seq.h"
+#include "linalg.h"
+#include "wavefront.h"
+
+
+class SceneModel {
+ public:
+  char     *filename;
+  wfModel  *model;
+  seq<mat4> instances;		/* transformation of each instance */
+  seq<mat4> visible;		/* transformations of instances in the frustum (rebuilt by cull()) */
+  seq<GLfloat> columns;		/* of the visible transformations, for wfModel::setInstances() */
+  bool      loading;		/* started loading, but not all groups are in OpenGL */
+
+  SceneModel( char *fn ) {
+    filename = strdup( fn );
+    model = new wfModel();
+    loading = false;
+  }
+
+  ~SceneModel() {
+    free( filename );
+    delete model;
+  }
+};
+
+
+/* A triangle found by Scene::raycast() */
+
+class SceneHit {
+ public:
+  SceneModel *model;
+  int         instance;		/* index in model->instances */
+  wfHit       hit;		/* in the model; hit.t is along the ray given to raycast() */
+};
+
+
+class Scene {
+
+  TextureMode textureMode;
+  int         nextToLoad;	/* index of the next model to start loading */
+  bool        extentsFound;
+
+  SceneModel *findModel( char *filename ); /* find or add a model */
+  void        findExtents();
+
+ public:
+
+  seq<SceneModel*> models;
+
+  vec3  centre;			/* centre of all instances */
+  float radius;			/* radius of all instances */
+
+  int numInstancesDrawn;	/* by the last cull() */
+  int numInstancesCulled;
+  int numGroupsDrawn;		/* over all models, by the last draw() */
+  int numGroupsCulled;
+
+  Scene( TextureMode tm ) {
+    textureMode = tm;
+    nextToLoad = 0;
+    extentsFound = false;
+    centre = vec3(0,0,0);
+    radius = 1;
+    numInstancesDrawn = numInstancesCulled = 0;
+    numGroupsDrawn = numGroupsCulled = 0;
+  }
+
+  ~Scene();
+
+  void  read( char *filename );     /* read a scene file */
+  void  addModel( char *filename ); /* add one instance of a model, untransformed */
+
+  bool  continueLoading();          /* on the OpenGL thread; returns true when all models are loaded */
+  bool  extentsKnown() { return extentsFound; } /* centre and radius are set */
+  float loadProgress();             /* fraction of loading done */
+
+  void  cull( mat4 &MVP, float pixelsPerUnit ); /* find the visible instances and each model's level of detail */
+  void  draw( GPUProgram *gpuProg, mat4 &M, mat4 &MV, mat4 &MVP ); /* draw the visible instances */
+  bool  raycast( vec3 origin, vec3 dir, SceneHit &hit ); /* nearest triangle hit, needs wfModel::buildRaycastBVHs */
+  int   numInstances();
+
+  void  releaseCPUData();
+  void  memoryReport();
+  long long gpuBytes();             /* memory used in OpenGL by all models */
+};
+
+#endif
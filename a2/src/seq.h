@@ -13,6 +13,7 @@
  *   PUBLIC FUNCTIONS
  *
  *     add( x )            Add x to the end of the sequence
+ *     append( x, n )      Add the n elements of array x to the end of the sequence
  *     remove()            Remove the last element of the sequence
  *     remove( i )         Remove the i^{th} element of the sequence (expensive)
  *     shift( i )          Shift right everything starting at position i
@@ -20,6 +21,9 @@
  *     exists( x )         Return true if x exists in sequence, false otherwise
  *     clear()             Deletes the whole sequence
  *     findIndex( x )      Find the index of element x, or -1 if it doesn't exist
+ *     reserve( n )        Make room for n elements so that add() doesn't reallocate
+ *     resize( n )         Set the number of elements to n (new elements are uninitialized)
+ *     capacity()          Number of elements for which storage is allocated
  */
 
 
@@ -79,11 +83,21 @@ public:
   void remove( int i );
   void shift( int i );
   void compress();
+  void reserve( int n );
+
+  void resize( int n ) {
+    reserve( n );
+    numElements = n;
+  }
 
   int size() const {
     return numElements;
   }
 
+  int capacity() const {
+    return storageSize;
+  }
+
   T & operator [] ( int i ) const {
     if (i >= numElements || i < 0) {
       cerr << "element: Tried to access an element beyond the range of the sequence: "
@@ -111,6 +125,7 @@ public:
   }
 
   void add( const T &x );
+  void append( const T *x, int n );
   int findIndex( const T &x );
   bool exists( const T &x );
 };
@@ -143,6 +158,23 @@ seq<T>::add( const T &x )
 }
 
 
+// Add n elements to the end of the sequence
+
+template<class T>
+void 
+seq<T>::append( const T *x, int n )
+
+{
+  if (numElements + n > storageSize)
+    reserve( numElements + n > 2 * storageSize ? numElements + n : 2 * storageSize );
+
+  for (int i=0; i<n; i++)
+    data[ numElements + i ] = x[i];
+
+  numElements += n;
+}
+
+
 // Compress the array
 
 template<class T>
@@ -164,6 +196,27 @@ seq<T>::compress()
 }
 
 
+// Make room for at least n elements
+
+template<class T>
+void 
+seq<T>::reserve( int n )
+
+{
+  T *newData;
+
+  if (n <= storageSize)
+    return;
+
+  newData = new T[ n ];
+  for (int i=0; i<numElements; i++)
+    newData[i] = data[i];
+  storageSize = n;
+  delete [] data;
+  data = newData;
+}
+
+
 // Find and return an element
 
 template<class T>
@@ -0,0 +1,674 @@
+// textureCache.cpp
+//
+// See textureCache.h
+
+
+#include "headers.h"
+#include "textureCache.h"
+#include "mappedFile.h"
+#include "scan.h"
+#include "parallel.h"
+#include "seq.h"
+
+#ifdef HAVE_PNG
+  #include <png.h>
+#endif
+
+#include <climits>
+#include <mutex>
+
+
+bool wfTexture::useTextureCache = false;
+
+
+// All textures that are in use.  Few models have more than a few
+// dozen textures, so a list is good enough.
+
+static seq<wfTexture*> textures;
+static std::mutex      texturesMutex;
+
+
+// Find the canonical path of a file, so that different paths to the
+// same file (e.g. "a/../b.ppm" and "b.ppm") give the same texture.
+// Returns a string allocated with malloc().
+
+static char *canonicalPath( char *filename )
+
+{
+#ifdef _WIN32
+  char *path = _fullpath( NULL, filename, 0 );
+#else
+  char *path = realpath( filename, NULL );
+#endif
+
+  if (path == NULL)		// no such file: use the name as is
+    path = strdup( filename );
+
+  return path;
+}
+
+
+// Return the texture for 'filename', adding it if it isn't already in
+// use.  The image isn't read until decode() is called.
+
+wfTexture *acquireTexture( char *filename )
+
+{
+  char *path = canonicalPath( filename );
+
+  std::lock_guard<std::mutex> lock( texturesMutex );
+
+  for (int i=0; i<textures.size(); i++)
+    if (strcmp( textures[i]->path, path ) == 0) {
+      free( path );
+      textures[i]->refCount++;
+      return textures[i];
+    }
+
+  wfTexture *texture = new wfTexture( path );
+  textures.add( texture );
+
+  return texture;
+}
+
+
+// Stop using a texture.  It is freed when no material uses it.
+
+void releaseTexture( wfTexture *texture )
+
+{
+  std::lock_guard<std::mutex> lock( texturesMutex );
+
+  if (--texture->refCount > 0)
+    return;
+
+  textures.remove( textures.findIndex( texture ) );
+
+  delete texture;
+}
+
+
+wfTexture::wfTexture( char *canonicalPath )
+
+{
+  path = canonicalPath;
+  refCount = 1;
+  textureID = 0;
+  hasMipmaps = false;
+  texmap = NULL;
+  width = height = 0;
+  hasAlpha = false;
+  numLevels = 1;
+  levels[0] = NULL;
+  rowAlignment = 1;
+  mipmaps = NULL;
+  ktxFile = NULL;
+  decoded = false;
+  readFailed = false;
+  decodeSeconds = uploadSeconds = 0;
+}
+
+
+// Read the image, or its copy in the texture cache.  Only the first
+// call reads it: a thread that calls decode() while another is reading
+// the same image waits for it to finish.
+
+void wfTexture::decode()
+
+{
+  std::lock_guard<std::mutex> lock( decodeMutex );
+
+  if (decoded)
+    return;
+
+  struct timeb startTime, endTime;
+  ftime( &startTime );
+
+  if (!useTextureCache || !readCache( path )) {
+
+    char *p = strrchr( path, '.' );
+
+    if (p == NULL || strcmp( p, ".ppm" ) == 0 || strcmp( p, ".pgm" ) == 0)
+      texmap = readPNM( path );
+    else if (strcmp( p, ".png" ) == 0)
+      texmap = readPNG( path );
+    else {
+      cerr << "Cannot read " << path << ".  Only ppm, pgm, and png files are handled." << endl;
+      texmap = NULL;
+    }
+
+    levels[0] = texmap;
+
+    if (useTextureCache && texmap != NULL) {
+      buildMipmaps();
+      writeCache( path );
+    }
+  }
+
+  ftime( &endTime );
+  decodeSeconds = (endTime.time + endTime.millitm / 1000.0) - (startTime.time + startTime.millitm / 1000.0);
+
+  readFailed = (texmap == NULL);
+  decoded = true;
+}
+
+
+wfTexture::~wfTexture()
+
+{
+  if (textureID != 0)
+    glDeleteTextures( 1, &textureID );
+
+  if (ktxFile != NULL)
+    delete ktxFile;		// texmap and the mipmaps are in the cache file
+  else {
+    delete [] texmap;
+    delete [] mipmaps;
+  }
+
+  free( path );
+}
+
+
+// Send the texture to OpenGL, if it hasn't already been sent, and set
+// its lookup mode.  Mipmaps from the texture cache are sent with the
+// texture.  Otherwise, mipmaps are built by OpenGL the first time a
+// mipmapped mode is used.  Returns true if the texture was sent now.
+
+bool wfTexture::store( TextureMode textureMode )
+
+{
+  decode();			// in case it wasn't decoded in advance
+
+  if (readFailed)
+    return false;
+
+  // Register it with OpenGL
+
+  bool isNew = (textureID == 0);
+
+  if (isNew)
+    glGenTextures( 1, &textureID );
+
+  glActiveTexture( GL_TEXTURE0 );
+  glBindTexture( GL_TEXTURE_2D, textureID );
+
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+
+  glPixelStorei( GL_UNPACK_ALIGNMENT, rowAlignment );
+
+  // set texture lookup mode
+
+  if (textureMode == NEAREST) {
+    
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+    
+  } else if (textureMode == LINEAR) {
+    
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+    
+  } else if (textureMode == MIPMAP_NEAREST) {
+    
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST );
+    
+  } else if (textureMode == MIPMAP_LINEAR) {
+    
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+
+  } else {
+
+    cerr << "Unknown texture mode: " << textureMode << endl; 
+    exit(1);
+  }
+
+  // Store the texture and any mipmaps
+
+  if (isNew) {
+
+    struct timeb startTime, endTime;
+    ftime( &startTime );
+
+    int w = width, h = height;
+
+    for (int l=0; l<numLevels; l++) {
+      uploadLevel( l, w, h, (hasAlpha ? GL_RGBA : GL_RGB) );
+      w = (w > 1 ? w/2 : 1);
+      h = (h > 1 ? h/2 : 1);
+    }
+
+    if (numLevels > 1) {
+      glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels-1 );
+      hasMipmaps = true;
+    }
+
+    ftime( &endTime );
+    uploadSeconds = (endTime.time + endTime.millitm / 1000.0) - (startTime.time + startTime.millitm / 1000.0);
+  }
+
+  // Build mipmaps
+
+  if ((textureMode == MIPMAP_NEAREST || textureMode == MIPMAP_LINEAR) && !hasMipmaps) {
+    glGenerateMipmap( GL_TEXTURE_2D );
+    hasMipmaps = true;
+  }
+
+  return isNew;
+}
+
+
+// Free the image once it is in OpenGL, which keeps its own copy.
+// The texture can still be stored with other modes, since OpenGL
+// builds any mipmaps that are missing from its own copy.
+
+void wfTexture::releaseImage()
+
+{
+  if (textureID == 0)		// not yet stored
+    return;
+
+  if (ktxFile != NULL) {
+    delete ktxFile;
+    ktxFile = NULL;
+  }
+  else {
+    delete [] texmap;
+    delete [] mipmaps;
+  }
+
+  texmap = NULL;
+  mipmaps = NULL;
+
+  for (int l=0; l<numLevels; l++)
+    levels[l] = NULL;
+}
+
+
+// Bytes in one mipmap level, including the padding of its rows
+
+long long wfTexture::levelBytes( int level )
+
+{
+  int w = width >> level;
+  int h = height >> level;
+
+  if (w < 1) w = 1;
+  if (h < 1) h = 1;
+
+  long long bytesPerRow = (w * (hasAlpha ? 4 : 3) + rowAlignment-1) / rowAlignment * rowAlignment;
+
+  return bytesPerRow * h;
+}
+
+
+long long wfTexture::cpuBytes()
+
+{
+  if (texmap == NULL)
+    return 0;
+
+  long long bytes = 0;
+
+  for (int l=0; l<numLevels; l++)
+    bytes += levelBytes( l );
+
+  return bytes;
+}
+
+
+// OpenGL's own storage for the texture, which includes all mipmap
+// levels once they've been built
+
+long long wfTexture::gpuBytes()
+
+{
+  if (textureID == 0)
+    return 0;
+
+  long long bytes = 0;
+
+  for (int l=0; l<(hasMipmaps ? MAX_TEXTURE_LEVELS : 1); l++) {
+    bytes += levelBytes( l );
+    if ((width >> l) <= 1 && (height >> l) <= 1)
+      break;
+  }
+
+  return bytes;
+}
+
+
+// Pixel unpack buffers through which textures are streamed to OpenGL.
+// Each band of rows is copied into the next buffer of the ring and
+// OpenGL is told to take the texels from there, so glTexSubImage2D()
+// returns without waiting for the transfer.  A buffer is reused only
+// after the other buffers have been used, by which time its earlier
+// transfer has usually finished.
+
+#define UPLOAD_BUFFERS     4
+#define UPLOAD_BUFFER_SIZE (4 * 1024 * 1024) /* bytes */
+
+static GLuint uploadBuffers[UPLOAD_BUFFERS] = { 0 };
+static int    nextUploadBuffer = 0;
+
+
+// Send one level of the texture, which is bound to GL_TEXTURE_2D
+
+void wfTexture::uploadLevel( int level, int w, int h, GLenum format )
+
+{
+  if (uploadBuffers[0] == 0) {
+    glGenBuffers( UPLOAD_BUFFERS, uploadBuffers );
+    for (int i=0; i<UPLOAD_BUFFERS; i++) {
+      glBindBuffer( GL_PIXEL_UNPACK_BUFFER, uploadBuffers[i] );
+      glBufferData( GL_PIXEL_UNPACK_BUFFER, UPLOAD_BUFFER_SIZE, NULL, GL_STREAM_DRAW );
+    }
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+  }
+
+  glTexImage2D( GL_TEXTURE_2D, level, format, w, h, 0, format, GL_UNSIGNED_BYTE, NULL );
+
+  int bytesPerRow = (w * (format == GL_RGBA ? 4 : 3) + rowAlignment-1) / rowAlignment * rowAlignment;
+  int rowsPerBand = UPLOAD_BUFFER_SIZE / bytesPerRow;
+
+  for (int y=0; y<h; y+=rowsPerBand) {
+
+    int numRows = (y+rowsPerBand <= h ? rowsPerBand : h-y);
+    int numBytes = numRows * bytesPerRow;
+    GLubyte *rows = levels[level] + (long long) y * bytesPerRow;
+
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, uploadBuffers[nextUploadBuffer] );
+    nextUploadBuffer = (nextUploadBuffer+1) % UPLOAD_BUFFERS;
+
+    // Invalidating the buffer lets the driver give us fresh memory if
+    // the buffer's previous transfer hasn't finished
+
+    void *dest = glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, numBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+
+    if (dest != NULL) {
+      memcpy( dest, rows, numBytes );
+      if (glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER )) {
+	glTexSubImage2D( GL_TEXTURE_2D, level, 0, y, w, numRows, format, GL_UNSIGNED_BYTE, (void*) 0 );
+	continue;
+      }
+    }
+
+    // The buffer couldn't be mapped or its contents were lost, so
+    // send this band directly
+
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+    glTexSubImage2D( GL_TEXTURE_2D, level, 0, y, w, numRows, format, GL_UNSIGNED_BYTE, rows );
+  }
+
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+}
+
+
+/* Read a texture from a P6 (colour) or P5 (grey) PPM file.  The file
+ * is memory-mapped and each row is copied, flipped vertically,
+ * straight into the texture map, so the image is never held twice.
+ * Maxvals other than 255, including 16-bit ones, are scaled to 8
+ * bits.  Grey images are expanded to RGB.
+ */
+
+
+// Skip whitespace and comments in a PPM header
+
+static void skipPNMSpace( const char *&p, const char *end )
+
+{
+  while (p < end)
+    if (*p == '#')
+      skipLine( p, end );
+    else if (isBlank(*p) || *p == '\n')
+      p++;
+    else
+      break;
+}
+
+
+unsigned char *wfTexture::readPNM( char *filename )
+
+{
+  MappedFile file;
+
+  if (!file.open( filename )) {
+    cerr << "Open of `" << filename << "' failed.\n";
+    exit(1);
+  }
+
+  const char *p   = file.data();
+  const char *end = p + file.size();
+
+  // header: magic number, width, height, maxval
+
+  if (end - p < 2 || p[0] != 'P' || (p[1] != '6' && p[1] != '5')) {
+    cerr << filename << " is not a P6 or P5 file.\n";
+    exit(1);
+  }
+
+  int numChannels = (p[1] == '6' ? 3 : 1);
+  p += 2;
+
+  int xdim, ydim, maxval;
+
+  skipPNMSpace( p, end );
+  bool ok = scanInt( p, end, xdim );
+  skipPNMSpace( p, end );
+  ok = ok && scanInt( p, end, ydim );
+  skipPNMSpace( p, end );
+  ok = ok && scanInt( p, end, maxval );
+
+  if (!ok || xdim <= 0 || ydim <= 0 || maxval <= 0 || maxval > 65535) {
+    cerr << filename << " has a bad PPM header.\n";
+    exit(1);
+  }
+
+  p++;				// exactly one whitespace character precedes the data
+
+  int    bytesPerSample = (maxval < 256 ? 1 : 2);
+  size_t srcRowBytes    = (size_t) xdim * numChannels * bytesPerSample;
+
+  if (p > end || (size_t) (end - p) < srcRowBytes * ydim) {
+    cerr << filename << " is too short for a " << xdim << "x" << ydim << " image.\n";
+    exit(1);
+  }
+
+  width = xdim;
+  height = ydim;
+  hasAlpha = false;
+
+  // Copy the rows, which are stored top-to-bottom, into the texture
+  // map bottom-to-top
+
+  const unsigned char *data = (const unsigned char *) p;
+  unsigned char *b = new unsigned char[ (size_t) xdim * ydim * 3 ];
+
+  parallelFor( ydim, [&]( int y ) {
+
+    const unsigned char *src = data + (size_t) (ydim-1-y) * srcRowBytes;
+    unsigned char       *dst = b + (size_t) y * xdim * 3;
+
+    if (numChannels == 3 && maxval == 255)
+      memcpy( dst, src, srcRowBytes );
+
+    else
+      for (int x=0; x<xdim; x++)
+	for (int k=0; k<3; k++) {
+
+	  int i = x * numChannels + (numChannels == 3 ? k : 0);
+	  int v;
+
+	  if (bytesPerSample == 1)
+	    v = src[i];
+	  else
+	    v = (src[2*i] << 8) | src[2*i+1]; // 16-bit samples are big-endian
+
+	  dst[3*x+k] = (maxval == 255 ? v : (v * 255 + maxval/2) / maxval);
+	}
+  }, 64 );
+
+  return b;
+}
+
+
+
+// Read a PNG file.  Most of this code is taken from example.c, which
+// is provided with the libpng distribution.
+
+
+#ifndef png_jmpbuf
+#  define png_jmpbuf(png_ptr) ((png_ptr)->jmpbuf)
+#endif
+
+
+#define PNG_BYTES_TO_CHECK 8
+
+unsigned char *wfTexture::readPNG( char *filename )
+
+{
+  unsigned char *b;
+
+#ifndef HAVE_PNG
+  cerr << "Trying to read PNG file \"" << filename << "\", but the program wasn't compiled with -DHAVE_PNG." << endl;
+  exit(-1);
+  return b;
+#else
+
+  png_structp png_ptr;
+  png_infop info_ptr;
+  unsigned int sig_read = 0;
+  int bit_depth, color_type, interlace_type;
+  char header[PNG_BYTES_TO_CHECK];
+  
+  // Open file
+
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    cerr << "Can't open PNG texture file '" << filename << "'." << endl;
+    exit(-1);
+  }
+
+  // Check header
+
+  fread( header, 1, PNG_BYTES_TO_CHECK, fp );
+  bool is_png = !png_sig_cmp( (png_byte*) &header[0], 0, PNG_BYTES_TO_CHECK);
+  if (!is_png) {
+    cerr << "Texture file '" << filename << "' is not in PNG format." << endl;
+    exit(-1);
+  }
+
+  /* Create and initialize the png_struct with the desired error handler
+   * functions.  If you want to use the default stderr and longjump method,
+   * you can supply NULL for the last three parameters.  We also supply the
+   * the compiler header file version, so that we know if the application
+   * was compiled with a compatible version of the library.  REQUIRED
+   */
+
+  png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+
+  if (png_ptr == NULL) {
+    cerr << "Can't initialize PNG file for reading: " << filename << endl;
+    fclose(fp);
+    exit(-1);
+  }
+
+  /* Allocate/initialize the memory for image information.  REQUIRED. */
+
+  info_ptr = png_create_info_struct(png_ptr);
+  if (info_ptr == NULL)
+    {
+      fclose(fp);
+      png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+      cerr << "Can't allocate memory to read PNG file: " << filename << endl;
+      exit(-1);
+    }
+
+  /* Set error handling if you are using the setjmp/longjmp method (this is
+   * the normal method of doing things with libpng).  REQUIRED unless you
+   * set up your own error handlers in the png_create_read_struct() earlier.
+   */
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    /* Free all of the memory associated with the png_ptr and info_ptr */
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+    fclose(fp);
+    /* If we get here, we had a problem reading the file */
+    cerr << "Exception occurred while reading PNG file: " << filename << endl;
+    exit(-1);
+  }
+
+  /* Set up the input control if you are using standard C streams */
+
+  png_init_io(png_ptr, fp);
+
+  /* If we have already read some of the signature */
+
+  png_set_sig_bytes(png_ptr, PNG_BYTES_TO_CHECK);
+
+  // Warning: the following does NOT convert grey to RGB:
+
+  png_read_png( png_ptr, info_ptr, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND, NULL );
+
+  
+  // Store in texmap
+  
+  int numChannels = png_get_channels(png_ptr, info_ptr);
+
+  if (png_get_bit_depth(png_ptr, info_ptr) != 8) {
+    cerr << "Can't handle PNG files with bit depth other than 8.  '" << filename
+	 << "' has " << png_get_bit_depth(png_ptr, info_ptr) << " bits per pixel." << endl;
+    exit(-1);
+  }
+
+
+  width = png_get_image_width(png_ptr,info_ptr);
+  height = png_get_image_height(png_ptr,info_ptr);
+
+  int imageSize;
+
+  if (numChannels == 4)
+    imageSize = 4 * width * height;
+  else
+    imageSize = 3 * width * height;
+
+  unsigned char *pb;
+  b = pb = new unsigned char[ imageSize ];
+
+  png_bytepp rows = png_get_rows(png_ptr, info_ptr);
+
+  for (int r=(int)height - 1; r >= 0; r--) {
+    png_bytep row = rows[r];
+    int rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    for (int c=0; c < rowbytes; c++)
+      switch (numChannels) {
+      case 1:
+	*(pb)++ = row[c];
+	*(pb)++ = row[c];
+	*(pb)++ = row[c];
+	break;
+      case 2:
+	cerr << "Can't handle a two-channel PNG file: " << filename << endl;
+	exit(-1);
+	break;
+      case 3:
+      case 4:
+	*(pb)++ = row[c];
+	break;
+      }
+  }
+
+  hasAlpha = (numChannels == 4);
+
+  // Clean up PNG stuff
+
+  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+  fclose(fp);
+
+  return b;
+#endif
+}
+
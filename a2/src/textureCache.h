@@ -0,0 +1,105 @@
+// textureCache.h
+//
+// Texture maps shared by all materials of all models.
+//
+// A texture is identified by the canonical path of its image file, so
+// an image that several materials refer to, perhaps through different
+// relative paths, is read only once and sent to OpenGL only once.
+// Each texture counts the materials that use it and is freed, along
+// with its OpenGL texture, when the last one releases it.
+//
+// Usage:
+//
+//   wfTexture *t = acquireTexture( filename );  // find, or add without reading
+//   t->decode();                                // read the image; only the first call does
+//   ...
+//   t->store( textureMode );                    // on the OpenGL thread; uploads only once
+//   glBindTexture( GL_TEXTURE_2D, t->textureID );
+//   t->releaseImage();                          // optional: OpenGL has its own copy
+//   ...
+//   releaseTexture( t );
+//
+// acquireTexture(), decode(), and releaseTexture() can be called from
+// any thread (e.g. the model loader thread, or the workers that decode
+// a model's images in parallel), but store() and the final
+// releaseTexture() of a stored texture must be on the OpenGL thread.
+//
+// store() streams the image to OpenGL through a small ring of pixel
+// unpack buffers, so the OpenGL thread only copies the bytes and the
+// driver transfers them to the GPU asynchronously.
+//
+// If wfTexture::useTextureCache is true, each image is stored with its
+// mipmaps in a KTX file next to it (see ktxCache.cpp), so later runs
+// neither decode the image nor build its mipmaps.
+
+
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "headers.h"
+
+#include <mutex>
+
+
+#define MAX_TEXTURE_LEVELS 16	/* mipmap levels, including the image, for images up to 32768x32768 */
+
+
+enum { NEAREST, LINEAR, MIPMAP_NEAREST, MIPMAP_LINEAR };
+typedef int TextureMode;
+
+
+class MappedFile;
+
+
+class wfTexture {
+
+  GLubyte    *mipmaps;		/* levels[1..] if built by buildMipmaps(), or NULL */
+  MappedFile *ktxFile;		/* texture cache that levels point into, or NULL */
+  std::mutex  decodeMutex;	/* held while decoding */
+  bool        decoded;
+
+  unsigned char *readPNM( char *filename ); /* read a P6 or P5 PPM file */
+  unsigned char *readPNG( char *filename ); /* read a PNG file */
+
+  void buildMipmaps();
+  bool readCache( char *filename );	/* returns false if no valid cache */
+  void writeCache( char *filename );
+  void uploadLevel( int level, int w, int h, GLenum format ); /* stream one level to OpenGL */
+  long long levelBytes( int level );
+
+ public:
+
+  char    *path;		/* canonical path of the image file */
+  GLubyte *texmap;		/* texture map, or NULL if not yet decoded or the file can't be read */
+  unsigned int width, height;	/* texmap dimensions */
+  bool     hasAlpha;		/* texmap has alpha component */
+  GLuint   textureID;		/* the OpenGL ID for this texture, or 0 if not yet stored */
+  bool     hasMipmaps;		/* mipmaps have been built */
+  bool     readFailed;		/* decoded, but the file couldn't be read */
+  int      refCount;		/* materials using this texture */
+
+  int      numLevels;		/* mipmap levels in levels[], or 1 if OpenGL is to build them */
+  GLubyte *levels[MAX_TEXTURE_LEVELS]; /* levels[0] is texmap */
+  int      rowAlignment;	/* bytes to which rows in levels[] are padded */
+
+  float    decodeSeconds;	/* time to read the image (or its cache) and build mipmaps */
+  float    uploadSeconds;	/* time to send it to OpenGL */
+
+  static bool useTextureCache;	/* read and write the texture cache (see ktxCache.cpp) */
+
+  wfTexture( char *canonicalPath );
+  ~wfTexture();
+
+  void decode();			/* read the image, if not yet read */
+  bool store( TextureMode textureMode ); /* record texture with OpenGL; returns true if sent now */
+  void releaseImage();			/* free texmap and levels once stored */
+
+  long long cpuBytes();			/* memory held by texmap and levels */
+  long long gpuBytes();			/* memory held by OpenGL */
+};
+
+
+wfTexture *acquireTexture( char *filename );
+void releaseTexture( wfTexture *texture );
+
+#endif
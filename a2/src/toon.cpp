@@ -3,15 +3,20 @@
 
 #include "headers.h"
 #include "linalg.h"
-#include "wavefront.h"
+#include "scene.h"
+#include "modelBrowser.h"
 #include "renderer.h"
 #include "gpuProgram.h"
 #include "font.h"
 #include "pixelZoom.h"
 
+#include <sys/stat.h>
+#include <chrono>
+
 
 GLFWwindow *window;
-wfModel    *obj;      // the object
+Scene      *scene;    // the models and their instances
+ModelBrowser *browser = NULL; // models in a directory, if browsing
 Renderer   *renderer; // class to do multipass rendering
 
 float theta = 0;
@@ -26,6 +31,13 @@ vec3 eyePosition;
 
 bool isTorso = false; // for torso.obj model, which uses a different projection matrix
 bool showZoom = false;
+mat4 sceneToClip;         // MVP of the last frame, for picking
+
+bool loading = true;      // model is still being loaded in the background
+bool cameraSet = false;   // camera has been pointed at the model (once its extents are known)
+bool releaseCPUData = false; // free the model's CPU copies of its mesh and textures once it's loaded
+int  browserBudgetMB = 1024;  // OpenGL memory for models kept when browsing a directory
+float frameBudgetMs = 0;      // frame time for dynamic resolution, or 0 for full resolution
 
 PixelZoom *pixelZoom = NULL; 
 
@@ -80,17 +92,28 @@ void display()
   glClearColor( 1, 1, 1, 1 );
   glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
-  // OCS-to-WCS
+  char buffer[1000];
+
+  // Nothing to draw until the model's extents are known
+
+  if (!cameraSet) {
+    sprintf( buffer, "Loading %d%%", (int) (100 * scene->loadProgress()) );
+    render_text( buffer, 10, 10, window );
+    return;
+  }
+
+  // WCS-to-WCS, to spin the scene about its centre.  Each model's
+  // own OCS-to-WCS is added by Scene::draw().
 
   mat4 M;
 
   if (isTorso)
     M = rotate( theta, vec3(0,1,0) )
       * rotate( -3.14159/2.0, vec3(1,0,0) )
-      * translate( -1 * obj->centre );
+      * translate( -1 * scene->centre );
   else
     M = rotate( theta, vec3(0.5,2,0) )
-      * translate( -1 * obj->centre );
+      * translate( -1 * scene->centre );
 
   // model-view transform (i.e. OCS-to-VCS)
 
@@ -99,11 +122,20 @@ void display()
 
   // model-view-projection transform (i.e. OCS-to-CCS)
 
-  float n = (eyePosition - obj->centre).length() - obj->radius;
-  float f = (eyePosition - obj->centre).length() + obj->radius;
+  float n = (eyePosition - scene->centre).length() - scene->radius;
+  float f = (eyePosition - scene->centre).length() + scene->radius;
+
+  mat4 P = perspective( fovy, windowWidth / (float) windowHeight, n, f );
+
+  mat4 MVP = P * MV;
+
+  sceneToClip = MVP;
 
-  mat4 MVP = perspective( fovy, windowWidth / (float) windowHeight, n, f )
-           * MV;
+  // Find the instances in the frustum and choose each model's level
+  // of detail from its size on the screen.  At distance 1, P scales
+  // heights by P[1][1] into [-1,1], which spans windowHeight pixels.
+
+  scene->cull( MVP, P[1][1] * windowHeight / 2.0 );
 
   // Light direction in VCS is above, to the right, and behind the
   // eye.  That's in direction (1,1,1) since the view direction is
@@ -114,13 +146,27 @@ void display()
 
   // Draw the objects
 
-  renderer->render( obj, M, MV, MVP, lightDir );
+  renderer->render( scene, M, MV, MVP, lightDir );
 
   // Output status message
 
-  char buffer[1000];
   renderer->makeStatusMessage( buffer );
 
+  if (scene->models.size() == 1 && scene->models[0]->model->numLODs > 1)
+    sprintf( buffer + strlen(buffer), ", level of detail %d", scene->models[0]->model->lod );
+
+  if (scene->numInstances() > 1)
+    sprintf( buffer + strlen(buffer), ", %d of %d instances drawn", scene->numInstancesDrawn, scene->numInstancesDrawn + scene->numInstancesCulled );
+
+  if (scene->numGroupsCulled > 0)
+    sprintf( buffer + strlen(buffer), ", %d of %d groups drawn", scene->numGroupsDrawn, scene->numGroupsDrawn + scene->numGroupsCulled );
+
+  if (browser != NULL)
+    sprintf( buffer + strlen(buffer), ", model %d of %d", browser->current + 1, browser->numModels() );
+
+  if (loading)
+    sprintf( buffer + strlen(buffer), ", loading %d%%", (int) (100 * scene->loadProgress()) );
+
   render_text( buffer, 10, 10, window );
   // Show zoom at mouse
 
@@ -150,6 +196,30 @@ void windowSizeCallback( GLFWwindow* window, int width, int height )
 
 
 
+// The torso model uses a different projection matrix
+
+bool isTorsoFile( char *filename )
+
+{
+  return strlen(filename) >= 9 && strcmp( &filename[strlen(filename)-9], "torso.obj" ) == 0;
+}
+
+
+// Show the browser's current model, which may still be loading
+
+void showBrowsedModel()
+
+{
+  scene = browser->currentScene();
+  isTorso = isTorsoFile( browser->currentFilename() );
+  loading = true;
+  cameraSet = false;
+
+  glfwSetWindowTitle( window, browser->currentFilename() );
+}
+
+
+
 // Handle a key press
 
 
@@ -163,6 +233,39 @@ void keyCallback( GLFWwindow* window, int key, int scancode, int action, int mod
     case 'P':
       sleeping = !sleeping;
       break;
+    case 'M':
+      scene->memoryReport();
+      break;
+    case 'T':
+      renderer->timingReport();
+      break;
+    case 'E':
+      renderer->toggleFused();
+      cout << (renderer->fused ? "Fused edge detection and shading (passes 2 and 3)" : "Separate edge detection and shading passes") << endl;
+      break;
+    case 'O':
+      if (mods & GLFW_MOD_SHIFT)
+	renderer->setOutlineWidth( renderer->outlineWidth + 1 ); // uppercase O
+      else
+	renderer->setOutlineWidth( renderer->outlineWidth - 1 ); // lowercase o
+      cout << "outline width = " << renderer->outlineWidth << endl;
+      break;
+    case 'H':
+      renderer->toggleHalfResOutline();
+      cout << "outline passes at " << (renderer->halfResOutline ? "half" : "full") << " resolution" << endl;
+      break;
+    case 'N':
+      if (browser != NULL) {
+	browser->next();
+	showBrowsedModel();
+      }
+      break;
+    case 'B':
+      if (browser != NULL) {
+	browser->previous();
+	showBrowsedModel();
+      }
+      break;
     case 'D':
       renderer->incDebug();
       if (renderer->debug == 0)
@@ -191,25 +294,78 @@ void keyCallback( GLFWwindow* window, int key, int scancode, int action, int mod
       break;
     case GLFW_KEY_SLASH: // also a question mark
       cout << "p     - pause" << endl
+	   << "m     - print the memory used by each model" << endl
 	   << "d     - cycle debug views" << endl
+	   << "t     - print the time of each rendering pass" << endl
+	   << "e     - toggle fused passes 2 and 3, to compare their time with 't'" << endl
+	   << "O     - widen outlines (separable dilation of the edges)" << endl
+	   << "o     - narrow outlines (0 = pass 3's own outlines)" << endl
+	   << "h     - toggle half-resolution outline passes" << endl
 	   << "F     - increase factor" << endl
 	   << "f     - decrease factor" << endl
 	   << "up    - move farther" << endl
 	   << "down  - move closer" << endl
 	   << "left  - zoom out" << endl
 	   << "right - zoom in" << endl
-	   << "left mouse - show zoomed pixels" << endl;
+	   << "n     - next model in the directory" << endl
+	   << "b     - previous model in the directory" << endl
+	   << "left mouse - show zoomed pixels, and with -p print the triangle under the mouse" << endl;
     }
 }
 
 
+// Print the triangle under the mouse.  The ray through the mouse is
+// found by taking the mouse position on the near and far planes back
+// to the scene's coordinates.
+
+void pickTriangle()
+
+{
+  double xpos, ypos;
+  glfwGetCursorPos( window, &xpos, &ypos );
+
+  float x = 2 * xpos / windowWidth - 1;
+  float y = 1 - 2 * ypos / windowHeight;
+
+  mat4 clipToScene = inverse( sceneToClip );
+
+  vec4 nearPoint = clipToScene * vec4( x, y, -1, 1 );
+  vec4 farPoint  = clipToScene * vec4( x, y,  1, 1 );
+
+  vec3 origin = (1 / nearPoint.w) * vec3( nearPoint.x, nearPoint.y, nearPoint.z );
+  vec3 dir    = ((1 / farPoint.w) * vec3( farPoint.x, farPoint.y, farPoint.z ) - origin).normalize();
+
+  SceneHit hit;
+
+  auto start = std::chrono::steady_clock::now();
+  bool found = scene->raycast( origin, dir, hit );
+  float micros = std::chrono::duration<float, std::micro>( std::chrono::steady_clock::now() - start ).count();
+
+  char buffer[1000];
+
+  if (!found)
+    sprintf( buffer, "Nothing under the mouse (%.1f us)", micros );
+  else {
+    wfHit &h = hit.hit;
+    sprintf( buffer, "%s instance %d: group '%s', material '%s', triangle %d, barycentrics (%.3f, %.3f, %.3f), %.4g from the near plane (%.1f us)",
+	     hit.model->filename, hit.instance, h.group->name, h.group->material->name, h.triangle,
+	     1 - h.u - h.v, h.u, h.v, h.t, micros );
+  }
+
+  cout << buffer << endl;
+}
+
+
 // Mouse callback
 
 void mouseButtonCallback( GLFWwindow* window, int button, int action, int mods )
 
 {
-  if (button == GLFW_MOUSE_BUTTON_LEFT)
+  if (button == GLFW_MOUSE_BUTTON_LEFT) {
     showZoom = (action == GLFW_PRESS);
+    if (action == GLFW_PRESS && wfModel::buildRaycastBVHs && cameraSet)
+      pickTriangle();
+  }
 }
 
 
@@ -229,11 +385,57 @@ void errorCallback( int error, const char* description )
 int main( int argc, char **argv )
 
 {
-  if (argc < 2) {
-    cerr << "Usage: " << argv[0] << " scene.obj" << endl;
+  // Options
+
+  int argi = 1;
+
+  while (argi < argc && argv[argi][0] == '-') {
+    if (strcmp( argv[argi], "-c" ) == 0)
+      wfModel::useMeshCache = true;
+    else if (strcmp( argv[argi], "-o" ) == 0)
+      wfModel::optimizeMeshes = true;
+    else if (strcmp( argv[argi], "-q" ) == 0)
+      wfModel::quantizeVertices = true;
+    else if (strcmp( argv[argi], "-l" ) == 0)
+      wfModel::generateLODs = true;
+    else if (strcmp( argv[argi], "-t" ) == 0)
+      wfTexture::useTextureCache = true;
+    else if (strcmp( argv[argi], "-n" ) == 0)
+      wfModel::generateNormals = true;
+    else if (strcmp( argv[argi], "-r" ) == 0)
+      releaseCPUData = true;
+    else if (strcmp( argv[argi], "-p" ) == 0)
+      wfModel::buildRaycastBVHs = true;
+    else if (strcmp( argv[argi], "-b" ) == 0 && argi+1 < argc)
+      browserBudgetMB = atoi( argv[++argi] );
+    else if (strcmp( argv[argi], "-f" ) == 0 && argi+1 < argc)
+      frameBudgetMs = atof( argv[++argi] );
+    else {
+      cerr << "Unknown option " << argv[argi] << endl;
+      argi = argc;
+    }
+    argi++;
+  }
+
+  if (argi != argc-1) {
+    cerr << "Usage: " << argv[0] << " [-c] [-o] [-q] [-l] [-t] [-n] [-r] [-p] [-b MB] [-f ms] scene.obj|scene.scene|directory" << endl
+	 << "  -c  cache the model's mesh in scene.obj.cache for faster loading" << endl
+	 << "  -o  reorder the mesh for the vertex cache and to reduce overdraw" << endl
+	 << "  -q  send compact, quantized vertices to the GPU" << endl
+	 << "  -l  build levels of detail and draw the one suited to the model's size" << endl
+	 << "  -t  cache texture maps with their mipmaps in .ktx files for faster loading" << endl
+	 << "  -n  build smooth vertex normals for models that have none" << endl
+	 << "  -r  free the model's CPU copy of its mesh and textures once it's loaded" << endl
+	 << "  -p  build a BVH for each model, so that clicking prints the triangle under the mouse" << endl
+	 << "  -b  keep up to MB megabytes of browsed models in OpenGL (default " << browserBudgetMB << ")" << endl
+	 << "  -f  lower the G-buffer's resolution as needed to draw each frame in ms milliseconds" << endl
+	 << "A .scene file places several models, each any number of times (see scene.h)." << endl
+	 << "For a directory, n and b step through its .obj and .scene files (see modelBrowser.h)." << endl;
     exit(1);
   }
 
+  char *objFilename = argv[argi];
+
   // Set up GLFW
 
   if (!glfwInit()) {
@@ -288,22 +490,34 @@ int main( int argc, char **argv )
 
   initFont( "src/FreeSans.ttf", 20 ); // 20 = font height in pixels
 
-  // Set up world objects
+  // Set up world objects.  The models are loaded in the background and
+  // are drawn as their groups arrive.
+
+  struct stat fileInfo;
+
+  if (stat( objFilename, &fileInfo ) == 0 && (fileInfo.st_mode & S_IFDIR)) {
+
+    browser = new ModelBrowser( objFilename, browserBudgetMB * 1024 * 1024LL );
+    browser->releaseCPUData = releaseCPUData;
 
-  obj = new wfModel( argv[1], MIPMAP_LINEAR );
+    showBrowsedModel();
 
-  isTorso = (strlen(argv[1]) >= 9 && strcmp( &argv[1][strlen(argv[1])-9] , "torso.obj" ) == 0);
+  } else {
 
-  // Point camera to the model
+    scene = new Scene( MIPMAP_LINEAR );
 
-  const float initEyeDistance = 5.0;
+    if (strlen(objFilename) >= 6 && strcmp( &objFilename[strlen(objFilename)-6], ".scene" ) == 0)
+      scene->read( objFilename );
+    else
+      scene->addModel( objFilename );
 
-  eyePosition = (initEyeDistance * obj->radius) * vec3(0,0,1);
-  fovy = 2 * atan2( 1, initEyeDistance );
+    isTorso = isTorsoFile( objFilename );
+  }
 
   // Set up renderer
 
   renderer = new Renderer( windowWidth, windowHeight, window );
+  renderer->frameBudgetMs = frameBudgetMs;
 
   // Main loop
 
@@ -325,6 +539,31 @@ int main( int argc, char **argv )
     if (!sleeping)
       theta += elapsedSeconds * 0.3;
 
+    // Send more of the model to OpenGL
+
+    if (browser != NULL)
+      loading = !browser->continueLoading(); // also loads the neighbouring models
+    else if (loading) {
+      loading = !scene->continueLoading();
+      if (!loading) {
+	if (releaseCPUData)
+	  scene->releaseCPUData();
+	scene->memoryReport();
+      }
+    }
+
+    // Point camera to the model once its size is known
+
+    if (!cameraSet && scene->extentsKnown()) {
+
+      const float initEyeDistance = 5.0;
+
+      eyePosition = (initEyeDistance * scene->radius) * vec3(0,0,1);
+      fovy = 2 * atan2( 1, initEyeDistance );
+
+      cameraSet = true;
+    }
+
     // Clear, display, and check for events
 
     glClearColor( 1, 1, 1, 1 );
@@ -15,312 +15,696 @@
 #endif
 
 #include "wavefront.h"
+#include "mappedFile.h"
+#include "scan.h"
+#include "parallel.h"
+#include "meshOptimize.h"
+#include "quantize.h"
+#include "meshSimplify.h"
+
+#include <climits>
+#include <algorithm>
 
 
 bool          wfModel::newGroupWithNewMaterial = false;
 bool          wfModel::verticesAreCW = false;
+bool          wfModel::useMeshCache = false;
+bool          wfModel::optimizeMeshes = false;
+bool          wfModel::quantizeVertices = false;
+bool          wfModel::generateLODs = false;
+bool          wfModel::generateNormals = false;
+float         wfModel::creaseAngle = 60;
+bool          wfModel::buildRaycastBVHs = false;
 
 unsigned char wfMaterial::defaultTexmap[] = { 255, 255, 255, 255, 255, 255,
 					      255, 255, 255, 255, 255, 255 };
 
 
-/* Read a Wavefront model into this structure.  See ObjectFile.html
- * for a description of the Wavefront file format.  This code is from
- * the Nate Robins GLM library.
- */
+// Face vertex formats
 
-void wfModel::read( char *filename )
+enum { FACE_V, FACE_VT, FACE_VN, FACE_VTN };
+
+
+// Scan one face vertex, which can be one of v, v/t, v//n, or v/t/n.
+// Returns the format, or -1 if there are no more vertices on the
+// line.  Fields that are absent are left unchanged.
+
+static int scanFaceVertex( const char *&p, const char *end, int &v, int &t, int &n )
 
 {
-  FILE* file;
-  char  buf[1000];
-  float x, y, z;
-  wfGroup    *currentGroup;
-  wfMaterial *currentMaterial;
-  int   nextGroupNum = 0;
+  if (!scanInt( p, end, v ))
+    return -1;
 
-  // Counts of different vertex formats
+  if (p == end || *p != '/')
+    return FACE_V;
 
-  int numVTN = 0;
-  int numVT = 0;
-  int numVN = 0;
-  int numV = 0;
+  p++;
 
-  /* init */
+  if (p < end && *p == '/') {
+    p++;
+    scanInt( p, end, n );
+    return FACE_VN;
+  }
 
-  vertices.clear();
-  normals.clear();
-  texcoords.clear();
-  facetnorms.clear();
-  materials.clear();
-  groups.clear();
+  scanInt( p, end, t );
 
-  pathname = strdup(filename);
+  if (p == end || *p != '/')
+    return FACE_VT;
 
-  groups.add( new wfGroup( "default" ) );
-  currentGroup = groups[0];
+  p++;
+  scanInt( p, end, n );
+  return FACE_VTN;
+}
 
-  materials.add( new wfMaterial( "default" ) );
-  currentMaterial = materials[0];
 
-  currentGroup->material = currentMaterial;
+/* Commands in an OBJ file that change the parser state.  They are
+ * recorded while chunks of the file are parsed in parallel, and are
+ * replayed in file order when the chunks are merged.
+ */
 
-  /* open the file */
+enum { CMD_GROUP,		/* g name */
+       CMD_USEMTL,		/* usemtl name */
+       CMD_MTLLIB,		/* mtllib filename */
+       CMD_TRANSFORM,		/* transform followed by 16 values */
+       CMD_UNKNOWN,		/* unrecognized command (to be reported) */
+       CMD_EMPTY_FACE };	/* face without vertices (to be reported) */
+
+
+class ObjCommand {
+ public:
+  int    type;
+  int    line;			/* line number within the chunk */
+  int    firstTriangle;		/* number of chunk triangles before this command */
+  char  *arg;			/* name, or NULL if none */
+  float *values;		/* the 16 values of a transform */
+};
 
-  file = fopen(filename, "r");
-  if (!file) {
-    cerr << "wfModel::read() failed: can't open data file '" << filename << "'." << endl;
-    exit(-1);
+
+/* A chunk of an OBJ file, which starts and ends on line boundaries,
+ * and everything that is parsed from it.
+ *
+ * Face indices are global (they count the vertices from the start of
+ * the file) so triangles need no fix-up when chunks are merged.  But
+ * a face may only refer to vertices that precede it, and how many
+ * vertices precede the chunk isn't known until the earlier chunks
+ * have been parsed.  So each chunk records the worst case and the
+ * check is completed when the chunks are merged.
+ */
+
+
+class ObjChunk {
+
+  void addCommand( int type, char *arg, float *values = NULL ) {
+    ObjCommand cmd;
+    cmd.type = type;
+    cmd.line = numLines;
+    cmd.firstTriangle = numTriangles();
+    cmd.arg = arg;
+    cmd.values = values;
+    commands.add( cmd );
+  }
+
+  void checkVindex( int v, int vertexBase, int lineBase );
+
+  void addTriangle( GLuint *v, GLuint *t, GLuint *n ) {
+    for (int k=0; k<3; k++) {
+      vindices.add( v[k] );
+      tindices.add( t[k] );
+      nindices.add( n[k] );
+    }
+  }
+
+ public:
+  const char *start, *end;	/* chunk of the file */
+
+  int numLines;
+
+  seq<vec3>        vertices;
+  seq<vec3>        normals;
+  seq<vec3>        texcoords;
+  seq<GLuint>      vindices;	/* three of each per triangle, as in wfGroup */
+  seq<GLuint>      nindices;
+  seq<GLuint>      tindices;
+  seq<ObjCommand>  commands;
+
+  int numVTN, numVT, numVN, numV; /* counts of different face formats */
+
+  int  maxVertexExcess;	/* max of (vertex index - chunk vertices before face) */
+  bool negativeVertex;	/* some vertex index is negative */
+
+  ObjChunk() {}
+
+  ~ObjChunk() {
+    for (int i=0; i<commands.size(); i++) {
+      free( commands[i].arg );
+      delete [] commands[i].values;
+    }
+  }
+
+  void parse( int vertexBase = -1, int lineBase = 0 );
+
+  int numTriangles() {
+    return vindices.size() / 3;
+  }
+
+  bool hasBadVertex( int vertexBase ) {
+    return negativeVertex || maxVertexExcess >= vertexBase;
   }
+};
+
+
+// Record how far vertex index v is beyond the vertices of this chunk.
+// If the number of vertices before the chunk is known (i.e. vertexBase
+// >= 0), check the index immediately and stop if it's bad.
+
+void ObjChunk::checkVindex( int v, int vertexBase, int lineBase )
+
+{
+  int excess = v - vertices.size();
+
+  if (excess > maxVertexExcess)
+    maxVertexExcess = excess;
+
+  if (v < 0)
+    negativeVertex = true;
+
+  if (vertexBase >= 0 && (v < 0 || v >= vertexBase + vertices.size())) {
+    cerr << "error on line " << lineBase + numLines
+	 << ": vertex index " << v+1 << " is too large.  There are only "
+	 << vertexBase + vertices.size() << " vertices." << endl;
+    abort();
+  }
+}
+
+
+// Parse the chunk.  This is called from several threads at once, so
+// it changes nothing outside the chunk.
+
+void ObjChunk::parse( int vertexBase, int lineBase )
+
+{
+  char  buf[1000];
+  float x = 0, y = 0, z = 0;
+
+  const char *p = start;
+
+  numLines = 0;
+  numVTN = numVT = numVN = numV = 0;
+  maxVertexExcess = INT_MIN;
+  negativeVertex = false;
+
+  /* count the vertices, normals, texcoords, and faces so that their
+     arrays are (usually) allocated only once */
+
+  int nv = 0, nvn = 0, nvt = 0, nf = 0;
+
+  for (const char *q = p; q < end; skipLine( q, end )) {
+    skipBlanks( q, end );
+    if (end - q > 1 && q[0] == 'v') {
+      if (isBlank(q[1]))
+	nv++;
+      else if (q[1] == 'n')
+	nvn++;
+      else if (q[1] == 't')
+	nvt++;
+    } else if (end - q > 1 && q[0] == 'f' && isBlank(q[1]))
+      nf++;
+  }
+
+  vertices.reserve( nv );
+  normals.reserve( nvn );
+  texcoords.reserve( nvt );
+
+  vindices.reserve( 3 * nf );	/* enough if all faces are triangles */
+  nindices.reserve( 3 * nf );
+  tindices.reserve( 3 * nf );
 
   /* process each line */
 
-  lineNum = 0;
+  while (p < end) {
 
-  while(fscanf(file, "%s", buf) != EOF) {
+    numLines++;
+
+    int cmdLen;
+    const char *cmd = scanToken( p, end, cmdLen );
+
+    if (cmdLen == 0) {			/* blank line */
+      skipLine( p, end );
+      continue;
+    }
 
-    lineNum++;
+    if (cmdLen >= 9 && strncmp( cmd, "transform", 9 ) == 0) {
 
-    if (strncmp( buf, "transform", 9 ) == 0) {
+      // The 16 values may be spread over several lines.  Chunks
+      // never start on a line of numbers, so all are in this chunk.
 
-      for (int r=0; r<4; r++)
-	for (int c=0; c<4; c++) {
-	  float val;
-	  fscanf( file, "%f", &val );
-	  objToWorldTransform[r][c] = val;
+      float *values = new float[16];
+
+      for (int i=0; i<16; i++) {
+	values[i] = 0;
+	while (atEndOfLine( p, end ) && p < end) {
+	  p++;
+	  numLines++;
 	}
+	scanFloat( p, end, values[i] );
+      }
+
+      addCommand( CMD_TRANSFORM, NULL, values );
 
     } else {
       int v = 0, n = 0, t = 0;
-      wfTriangle *tri, *prevTri;
+      int format;
+      GLuint vi[3], ti[3], ni[3];
 
-      switch(buf[0]) {
+      switch(cmd[0]) {
 
       case '#':				/* comment */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
 	break;
 
       case 's':				/* smoothing group ... ignore */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
 	break;
 
       case 'v':				/* v, vn, vt */
-	switch(buf[1]) {
+	switch(cmdLen > 1 ? cmd[1] : '\0') {
 
 	case '\0':			/* vertex */
-	  fscanf(file, "%f %f %f", &x, &y, &z );
+	  scanFloat( p, end, x );
+	  scanFloat( p, end, y );
+	  scanFloat( p, end, z );
 	  vertices.add( vec3(x,y,z) );
 	  break;
 
 	case 'n':				/* normal */
-	  fscanf(file, "%f %f %f", &x, &y, &z );
+	  scanFloat( p, end, x );
+	  scanFloat( p, end, y );
+	  scanFloat( p, end, z );
 	  normals.add( vec3(x,y,z).normalize() );
 	  break;
 
 	case 't':				/* texcoord */
-	  fscanf(file, "%f %f", &x, &y );
+	  scanFloat( p, end, x );
+	  scanFloat( p, end, y );
 	  texcoords.add( vec3(x,y,0) );
-	  fgets(buf, sizeof(buf), file); // skip rest of line
 	  break;
 	}
 	break;
 
       case 'm':			        /* mtllib filename */
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s %s", buf, buf);
-	mtllibname = strdup(buf);
-	readMaterialLibrary( buf );
+	if (scanString( p, end, buf, sizeof(buf) ))
+	  addCommand( CMD_MTLLIB, strdup(buf) );
 	break;
 
       case 'u':			        /* usemtl name */
-
-	if (newGroupWithNewMaterial) {
-	  char buffer[100];
-	  sprintf( buffer, "g%d", nextGroupNum++ );
-	  currentGroup = findGroup( buffer );
-	}
-      
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s %s", buf, buf);
-	currentGroup->material = currentMaterial = findMaterial( buf );
+	scanString( p, end, buf, sizeof(buf) );
+	addCommand( CMD_USEMTL, strdup(buf) );
 	break;
 
       case 'g':				/* group */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s", buf);
-	if (buf[0] == '\n')
-	  currentGroup = findGroup( "default" );
+	if (scanString( p, end, buf, sizeof(buf) ))
+	  addCommand( CMD_GROUP, strdup(buf) );
 	else
-	  currentGroup = findGroup( buf );
-	currentGroup->material = currentMaterial;
+	  addCommand( CMD_GROUP, NULL );
 	break;
 
       case 'f':				/* face */
 
-	fscanf(file, "%s", buf);
+	/* can be one of v, v//n, v/t, or v/t/n.  The first vertex
+	   determines the format of all vertices in the face. */
+
+	format = scanFaceVertex( p, end, v, t, n );
+
+	if (format < 0) {
+	  addCommand( CMD_EMPTY_FACE, NULL );
+	  break;
+	}
 
-	/* can be one of %d, %d//%d, %d/%d, or %d/%d/%d */
+	switch (format) {
+	case FACE_VN:  numVN++;  break;
+	case FACE_VTN: numVTN++; break;
+	case FACE_VT:  numVT++;  break;
+	case FACE_V:   numV++;   break;
+	}
 
-	tri = new wfTriangle();
+	/* First three vertices define a triangle.  Indices that are
+	   absent in this format are 0. */
 
-	if (strstr(buf, "//")) {	/* v//n */
+	for (int k=0; k<3; k++) {
 
-	  numVN++;
+	  if (k > 0)
+	    scanFaceVertex( p, end, v, t, n );
 
-	  /* First three vertices define a triangle */
+	  checkVindex( v-1, vertexBase, lineBase );
 
-	  sscanf(buf, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[0] = v; tri->nindices[0] = n;
-	    fscanf(file, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[1] = v; tri->nindices[1] = n;
-	    fscanf(file, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[2] = v; tri->nindices[2] = n;
+	  vi[k] = v-1;
+	  ti[k] = (format == FACE_VT || format == FACE_VTN ? t-1 : 0);
+	  ni[k] = (format == FACE_VN || format == FACE_VTN ? n-1 : 0);
+	}
 
-	    currentGroup->triangles.add( tri );
+	addTriangle( vi, ti, ni );
 
-	    /* More vertices (a convex polygon) are converted to a fan of triangles: */
+	/* More vertices (a convex polygon) are converted to a fan of triangles: */
 
-	    while(fscanf(file, "%d//%d", &v, &n) > 0) {
+	while (scanFaceVertex( p, end, v, t, n ) >= 0) {
 
-	      v--; checkVindex(v); n--;
+	  checkVindex( v-1, vertexBase, lineBase );
 
-	      prevTri = tri;
-	      tri = new wfTriangle();
+	  vi[1] = vi[2];
+	  ti[1] = ti[2];
+	  ni[1] = ni[2];
 
-	      tri->vindices[0] = prevTri->vindices[0];
-	      tri->nindices[0] = prevTri->nindices[0];
-	      tri->vindices[1] = prevTri->vindices[2];
-	      tri->nindices[1] = prevTri->nindices[2];
-	      tri->vindices[2] = v;
-	      tri->nindices[2] = n;
+	  vi[2] = v-1;
+	  ti[2] = (format == FACE_VT || format == FACE_VTN ? t-1 : 0);
+	  ni[2] = (format == FACE_VN || format == FACE_VTN ? n-1 : 0);
 
-	      currentGroup->triangles.add( tri );
-	    }
-	
-	} else if (sscanf(buf, "%d/%d/%d", &v, &t, &n) == 3) {  /* v/t/n */
+	  addTriangle( vi, ti, ni );
+	}
+	break;
 
-	  numVTN++;
+      default:
+	if (cmdLen >= (int) sizeof(buf))
+	  cmdLen = sizeof(buf)-1;
+	memcpy( buf, cmd, cmdLen );
+	buf[cmdLen] = '\0';
+	addCommand( CMD_UNKNOWN, strdup(buf) );
+	break;
+      }
+    }
 
-	  v--; checkVindex(v); n--; t--;
+    /* ignore anything else on the line */
 
-	  tri->vindices[0] = v;
-	  tri->tindices[0] = t;
-	  tri->nindices[0] = n;
-	  fscanf(file, "%d/%d/%d", &v, &t, &n);	v--; checkVindex(v); n--; t--;
-	  tri->vindices[1] = v;
-	  tri->tindices[1] = t;
-	  tri->nindices[1] = n;
-	  fscanf(file, "%d/%d/%d", &v, &t, &n);	v--; checkVindex(v); n--; t--;
-	  tri->vindices[2] = v;
-	  tri->tindices[2] = t;
-	  tri->nindices[2] = n;
+    skipLine( p, end );
+  }
+}
 
-	  currentGroup->triangles.add( tri );
-	
-	  while(fscanf(file, "%d/%d/%d", &v, &t, &n) > 0) {
 
-	    v--; checkVindex(v); n--; t--;
+/* A run of consecutive triangles in a chunk that all go into the same
+ * group.  The runs are found when the chunks are merged, so that each
+ * group's index arrays can be allocated once at their final size.
+ */
 
-	    prevTri = tri;
-	    tri = new wfTriangle();
 
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->tindices[0] = prevTri->tindices[0];
-	    tri->nindices[0] = prevTri->nindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->tindices[1] = prevTri->tindices[2];
-	    tri->nindices[1] = prevTri->nindices[2];
-	    tri->vindices[2] = v;
-	    tri->tindices[2] = t;
-	    tri->nindices[2] = n;
+class TriangleRun {
+ public:
+  int group;			/* index in wfModel::groups */
+  int chunk;
+  int start, stop;		/* triangles [start,stop) of the chunk */
+};
 
-	    currentGroup->triangles.add( tri );
-	  }
-	
-	} else if (sscanf(buf, "%d/%d", &v, &t) == 2) { /* v/t */
 
-	  numVT++;
+/* Read a Wavefront model into this structure.  See ObjectFile.html
+ * for a description of the Wavefront file format.  This code is from
+ * the Nate Robins GLM library.
+ *
+ * The file is memory-mapped and split at line boundaries into
+ * chunks, which are parsed in parallel.  The chunks are then merged
+ * in file order, so the result is the same as a serial parse.
+ */
 
-	  v--; checkVindex(v); t--;
+void wfModel::read( char *filename )
+
+{
+  MappedFile file;
+  wfGroup    *currentGroup;
+  wfMaterial *currentMaterial;
+  int   currentGroupIndex;
+  int   nextGroupNum = 0;
 
-	  tri->vindices[0] = v;
-	  tri->tindices[0] = t;
-	  fscanf(file, "%d/%d", &v, &t);	v--; checkVindex(v); t--;
-	  tri->vindices[1] = v;
-	  tri->tindices[1] = t;
-	  fscanf(file, "%d/%d", &v, &t);	v--; checkVindex(v); t--;
-	  tri->vindices[2] = v;
-	  tri->tindices[2] = t;
+  // Counts of different vertex formats
 
-	  currentGroup->triangles.add( tri );
+  int numVTN = 0;
+  int numVT = 0;
+  int numVN = 0;
+  int numV = 0;
 
-	  while(fscanf(file, "%d/%d", &v, &t) > 0) {
+  /* init */
 
-	    v--; checkVindex(v); t--;
+  vertices.clear();
+  normals.clear();
+  texcoords.clear();
+  facetnorms.clear();
+  materials.clear();
+  groups.clear();
 
-	    prevTri = tri;
-	    tri = new wfTriangle();
+  pathname = strdup(filename);
 
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->tindices[0] = prevTri->tindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->tindices[1] = prevTri->tindices[2];
-	    tri->vindices[2] = v;
-	    tri->tindices[2] = t;
+  groups.add( new wfGroup( "default" ) );
+  currentGroup = groups[0];
+  currentGroupIndex = 0;
 
-	    currentGroup->triangles.add( tri );
-	  }
-	
-	} else {	/* v */
+  materials.add( new wfMaterial( "default" ) );
+  currentMaterial = materials[0];
 
-	  numV++;
+  currentGroup->material = currentMaterial;
 
-	  sscanf(buf, "%d", &v); v--; checkVindex(v);
-	  tri->vindices[0] = v;
-	  fscanf(file, "%d", &v); v--; checkVindex(v);
-	  tri->vindices[1] = v;
-	  fscanf(file, "%d", &v); v--; checkVindex(v);
-	  tri->vindices[2] = v;
+  /* open the file */
 
-	  currentGroup->triangles.add( tri );
-	
-	  while(fscanf(file, "%d", &v) > 0) {
+  if (!file.open( filename )) {
+    cerr << "wfModel::read() failed: can't open data file '" << filename << "'." << endl;
+    exit(-1);
+  }
+
+  bytesToRead = file.size();
+
+  const char *data = file.data();
+  const char *end  = data + file.size();
+
+  /* Split the file into chunks.  A chunk never starts with a number
+     since that could be the continuation of a transform. */
+
+  const size_t minChunkSize = 1 << 20;
+
+  int numChunks = 4 * numThreads();
+  if (file.size() / minChunkSize < (size_t) numChunks)
+    numChunks = file.size() / minChunkSize;
+  if (numChunks < 1)
+    numChunks = 1;
+
+  ObjChunk *chunks = new ObjChunk[ numChunks ];
+
+  const char *p = data;
+
+  for (int c=0; c<numChunks; c++) {
+
+    chunks[c].start = p;
+
+    if (c == numChunks-1)
+      p = end;
+    else {
+      const char *q = data + file.size() * (c+1) / numChunks;
+      if (q > p) {
+	p = q-1;
+	skipLine( p, end );
+	for (;;) {
+	  const char *r = p;
+	  skipBlanks( r, end );
+	  if (r == end || !(isDigit(*r) || *r == '-' || *r == '+' || *r == '.'))
+	    break;
+	  skipLine( p, end );
+	}
+      }
+    }
+
+    chunks[c].end = p;
+  }
+
+  /* parse the chunks */
+
+  parallelForBlocks( numChunks, [&]( int c ) {
+    chunks[c].parse();
+    bytesRead += chunks[c].end - chunks[c].start;
+  } );
+
+  /* merge vertices, normals, and texcoords */
+
+  int nv = 0, nvn = 0, nvt = 0;
+
+  for (int c=0; c<numChunks; c++) {
+    nv  += chunks[c].vertices.size();
+    nvn += chunks[c].normals.size();
+    nvt += chunks[c].texcoords.size();
+  }
+
+  vertices.reserve( nv );
+  normals.reserve( nvn );
+  texcoords.reserve( nvt );
+
+  for (int c=0; c<numChunks; c++) {
+    for (int i=0; i<chunks[c].vertices.size(); i++)
+      vertices.add( chunks[c].vertices[i] );
+    for (int i=0; i<chunks[c].normals.size(); i++)
+      normals.add( chunks[c].normals[i] );
+    for (int i=0; i<chunks[c].texcoords.size(); i++)
+      texcoords.add( chunks[c].texcoords[i] );
+  }
+
+  /* find the runs of triangles in each group by replaying the
+     commands that change the current group and material */
+
+  seq<TriangleRun> runs;
+
+  int vertexBase = 0;
+  int lineBase = 0;
+
+  for (int c=0; c<numChunks; c++) {
+
+    ObjChunk &chunk = chunks[c];
+
+    // A bad vertex index?  Then re-parse the chunk with the index
+    // check enabled, which reports the first bad index and stops.
+
+    if (chunk.hasBadVertex( vertexBase )) {
+      ObjChunk check;
+      check.start = chunk.start;
+      check.end = chunk.end;
+      check.parse( vertexBase, lineBase );
+    }
+
+    int nextTriangle = 0;
+
+    for (int i=0; i<=chunk.commands.size(); i++) {
+
+      // Triangles that precede this command go in the current group
+
+      int stop = (i < chunk.commands.size() ? chunk.commands[i].firstTriangle : chunk.numTriangles());
+
+      if (stop > nextTriangle) {
+	TriangleRun run;
+	run.group = currentGroupIndex;
+	run.chunk = c;
+	run.start = nextTriangle;
+	run.stop  = stop;
+	runs.add( run );
+	nextTriangle = stop;
+      }
+
+      if (i == chunk.commands.size())
+	break;
+
+      ObjCommand &cmd = chunk.commands[i];
 
-	    v--; checkVindex(v);
+      lineNum = lineBase + cmd.line;
 
-	    prevTri = tri;
-	    tri = new wfTriangle();
+      switch (cmd.type) {
+
+      case CMD_TRANSFORM:
+	for (int r=0; r<4; r++)
+	  for (int c=0; c<4; c++)
+	    objToWorldTransform[r][c] = cmd.values[4*r+c];
+	break;
 
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->vindices[2] = v;
+      case CMD_MTLLIB:
+	mtllibname = strdup(cmd.arg);
+	readMaterialLibrary( cmd.arg );
+	break;
 
-	    currentGroup->triangles.add( tri );
-	  }
+      case CMD_USEMTL:
+	if (newGroupWithNewMaterial) {
+	  char buffer[100];
+	  sprintf( buffer, "g%d", nextGroupNum++ );
+	  currentGroup = findGroup( buffer );
+	  currentGroupIndex = groups.findIndex( currentGroup );
 	}
+	currentGroup->material = currentMaterial = findMaterial( cmd.arg );
 	break;
 
-      default:
-	cerr << "Warning: unrecognized Wavefront command on line " << lineNum << ": " << buf << endl;
+      case CMD_GROUP:
+	if (cmd.arg != NULL)
+	  currentGroup = findGroup( cmd.arg );
+	else
+	  currentGroup = findGroup( "default" );
+	currentGroupIndex = groups.findIndex( currentGroup );
+	currentGroup->material = currentMaterial;
+	break;
+
+      case CMD_UNKNOWN:
+	cerr << "Warning: unrecognized Wavefront command on line " << lineNum << ": " << cmd.arg << endl;
+	break;
+
+      case CMD_EMPTY_FACE:
+	cerr << "Warning: face with no vertices on line " << lineNum << endl;
 	break;
       }
     }
+
+    numVTN += chunk.numVTN;
+    numVT  += chunk.numVT;
+    numVN  += chunk.numVN;
+    numV   += chunk.numV;
+
+    vertexBase += chunk.vertices.size();
+    lineBase   += chunk.numLines;
+  }
+
+  /* allocate each group's index arrays, then copy the runs into them */
+
+  int *groupSize = new int[ groups.size() ];
+
+  for (int g=0; g<groups.size(); g++)
+    groupSize[g] = 0;
+
+  for (int r=0; r<runs.size(); r++)
+    groupSize[ runs[r].group ] += runs[r].stop - runs[r].start;
+
+  for (int g=0; g<groups.size(); g++) {
+    groups[g]->vindices.reserve( 3 * groupSize[g] );
+    groups[g]->nindices.reserve( 3 * groupSize[g] );
+    groups[g]->tindices.reserve( 3 * groupSize[g] );
+  }
+
+  delete [] groupSize;
+
+  for (int r=0; r<runs.size(); r++) {
+
+    wfGroup  *group = groups[ runs[r].group ];
+    ObjChunk &chunk = chunks[ runs[r].chunk ];
+
+    int first = 3 * runs[r].start;
+    int n = 3 * (runs[r].stop - runs[r].start);
+
+    group->vindices.append( &chunk.vindices[first], n );
+    group->nindices.append( &chunk.nindices[first], n );
+    group->tindices.append( &chunk.tindices[first], n );
+
+    // Free each chunk's indices after its last run, so that not
+    // all indices are stored twice
+
+    if (r == runs.size()-1 || runs[r+1].chunk != runs[r].chunk) {
+      chunk.vindices.clear();
+      chunk.nindices.clear();
+      chunk.tindices.clear();
+    }
   }
 
+  delete [] chunks;
+
   // Determine a consistent format for each vertex
 
   hasVertexNormals   = (numVTN > 0 || numVN > 0);
   hasVertexTexCoords = (numVTN > 0 || numVT > 0);
 
-  // Compute all face normals
+  // Compute all face normals.  Facet normals are numbered in group
+  // order, so find where each group's normals start, then compute
+  // them in parallel.
 
+  int numFacets = 0;
   for (int g=0; g<groups.size(); g++)
-    for (int i=0; i<groups[g]->triangles.size(); i++) {
+    numFacets += groups[g]->numTriangles();
+
+  facetnorms.resize( numFacets );
+
+  int firstFacet = 0;
+
+  for (int g=0; g<groups.size(); g++) {
+
+    wfGroup *group = groups[g];
 
-      wfTriangle &tri = *groups[g]->triangles[i];
+    group->findex.resize( group->numTriangles() );
 
-      vec3 d01 = vertices[ tri.vindices[1] ] - vertices[ tri.vindices[0] ];
-      vec3 d02 = vertices[ tri.vindices[2] ] - vertices[ tri.vindices[0] ];
+    parallelFor( group->numTriangles(), [&]( int i ) {
+
+      vec3 &v0 = vertices[ group->vindices[3*i] ];
+      vec3 d01 = vertices[ group->vindices[3*i+1] ] - v0;
+      vec3 d02 = vertices[ group->vindices[3*i+2] ] - v0;
       vec3 n;
 
       if (verticesAreCW)
@@ -328,47 +712,339 @@ void wfModel::read( char *filename )
       else
 	n = (d01 ^ d02).normalize();
 
-      tri.findex = facetnorms.size();
-      facetnorms.add( n );
-    }
+      group->findex[i] = firstFacet + i;
+      facetnorms[ firstFacet + i ] = n;
+    } );
 
-  // Find bounding box
+    firstFacet += group->numTriangles();
+  }
 
-  min = vec3(MAXFLOAT,MAXFLOAT,MAXFLOAT);
-  max = vec3(-MAXFLOAT,-MAXFLOAT,-MAXFLOAT);
+  // Without vertex normals the model can only be drawn with facet
+  // normals, so build smooth ones from the facet normals if asked to
 
-  vec3 sum(0,0,0);
-  for (int i=0; i<vertices.size(); i++) {
-    sum = sum + vertices[i];
-    if (vertices[i].x < min.x)
-      min.x = vertices[i].x;
-    if (vertices[i].y < min.y)
-      min.y = vertices[i].y;
-    if (vertices[i].z < min.z)
-      min.z = vertices[i].z;
-    if (vertices[i].x > max.x)
-      max.x = vertices[i].x;
-    if (vertices[i].y > max.y)
-      max.y = vertices[i].y;
-    if (vertices[i].z > max.z)
-      max.z = vertices[i].z;
+  if (!hasVertexNormals && generateNormals) {
+    buildVertexNormals();
+    hasVertexNormals = true;
   }
-  centre = 0.5 * (min + max);
-  radius = 0.5 * (max - min).length();
-}
 
+  // Find each group's bounding box, for culling
 
-void wfModel::readMaterialLibrary( char *name )
+  parallelForBlocks( groups.size(), [&]( int g ) {
 
-{
-  FILE* file;
-  char  buf[1000];
-  wfMaterial *currentMaterial;
-  int i;
+    wfGroup *group = groups[g];
 
-  /* prepend path to the directory of the model file */
+    vec3 lo(MAXFLOAT,MAXFLOAT,MAXFLOAT);
+    vec3 hi(-MAXFLOAT,-MAXFLOAT,-MAXFLOAT);
 
-  char *dir = new char[ strlen( pathname )+1 ];
+    for (int i=0; i<group->vindices.size(); i++) {
+      vec3 &v = vertices[ group->vindices[i] ];
+      if (v.x < lo.x) lo.x = v.x;
+      if (v.y < lo.y) lo.y = v.y;
+      if (v.z < lo.z) lo.z = v.z;
+      if (v.x > hi.x) hi.x = v.x;
+      if (v.y > hi.y) hi.y = v.y;
+      if (v.z > hi.z) hi.z = v.z;
+    }
+
+    group->min = lo;
+    group->max = hi;
+  } );
+
+  // Find bounding box as a parallel reduction over blocks of vertices
+
+  const int numBlocks = 4 * numThreads();
+
+  vec3 *blockMin = new vec3[ numBlocks ];
+  vec3 *blockMax = new vec3[ numBlocks ];
+
+  parallelForBlocks( numBlocks, [&]( int b ) {
+
+    vec3 lo(MAXFLOAT,MAXFLOAT,MAXFLOAT);
+    vec3 hi(-MAXFLOAT,-MAXFLOAT,-MAXFLOAT);
+
+    int stop = (int) ((long long) vertices.size() * (b+1) / numBlocks);
+
+    for (int i = (int) ((long long) vertices.size() * b / numBlocks); i<stop; i++) {
+      vec3 &v = vertices[i];
+      if (v.x < lo.x) lo.x = v.x;
+      if (v.y < lo.y) lo.y = v.y;
+      if (v.z < lo.z) lo.z = v.z;
+      if (v.x > hi.x) hi.x = v.x;
+      if (v.y > hi.y) hi.y = v.y;
+      if (v.z > hi.z) hi.z = v.z;
+    }
+
+    blockMin[b] = lo;
+    blockMax[b] = hi;
+  } );
+
+  min = vec3(MAXFLOAT,MAXFLOAT,MAXFLOAT);
+  max = vec3(-MAXFLOAT,-MAXFLOAT,-MAXFLOAT);
+
+  for (int b=0; b<numBlocks; b++) {
+    if (blockMin[b].x < min.x) min.x = blockMin[b].x;
+    if (blockMin[b].y < min.y) min.y = blockMin[b].y;
+    if (blockMin[b].z < min.z) min.z = blockMin[b].z;
+    if (blockMax[b].x > max.x) max.x = blockMax[b].x;
+    if (blockMax[b].y > max.y) max.y = blockMax[b].y;
+    if (blockMax[b].z > max.z) max.z = blockMax[b].z;
+  }
+
+  delete [] blockMin;
+  delete [] blockMax;
+
+  centre = 0.5 * (min + max);
+  radius = 0.5 * (max - min).length();
+}
+
+
+/* Build smooth vertex normals from the facet normals.
+ *
+ * The normal at a triangle corner is the sum of the facet normals of
+ * the triangles around its vertex, each weighted by the triangle's
+ * angle at the vertex, so that a vertex's normal doesn't depend on how
+ * finely the surface around it is split into triangles.  Only
+ * triangles whose facet normal is within creaseAngle of the corner's
+ * own facet normal are included, so sharp edges stay sharp: a vertex
+ * on a crease gets one normal for each side.
+ *
+ * Most vertices aren't on a crease, and for those all of the corners
+ * get the same sum, which is found once.  Only at other vertices is
+ * each pair of corners compared, which takes time quadratic in the
+ * number of corners.
+ *
+ * Each vertex gathers from the corners around it, so vertices are done
+ * in parallel without locks.  The corners around each vertex are found
+ * by counting the corners of each vertex (with atomic increments) and
+ * then placing each corner in its vertex's range.
+ *
+ * The corners are given normal indices, which replace nindices.
+ * Corners of a vertex with the same normal share one index, so they
+ * are welded into one vertex by buildBuffers().
+ */
+
+
+void wfModel::buildVertexNormals()
+
+{
+  struct timeb startTime, endTime;
+  ftime( &startTime );
+
+  int numVerts = vertices.size();
+  int numCorners = 3 * facetnorms.size();
+
+  // Facets are numbered in group order, so corner 3f+k of facet f is
+  // corner k of triangle f-firstFacet[g] of group g.
+
+  int *firstFacet = new int[ groups.size() ];
+
+  firstFacet[0] = 0;
+  for (int g=1; g<groups.size(); g++)
+    firstFacet[g] = firstFacet[g-1] + groups[g-1]->numTriangles();
+
+  // Find each corner's vertex and angle, and count the corners of each
+  // vertex
+
+  GLuint *cornerVertex = new GLuint[ numCorners ];
+  float  *cornerAngle  = new float[ numCorners ];
+
+  std::atomic<int> *vertexCount = new std::atomic<int>[ numVerts ];
+
+  parallelFor( numVerts, [&]( int i ) {
+    vertexCount[i] = 0;
+  } );
+
+  for (int g=0; g<groups.size(); g++) {
+
+    wfGroup *group = groups[g];
+
+    parallelFor( group->numTriangles(), [&]( int i ) {
+
+      int c = 3 * (firstFacet[g] + i);
+
+      for (int k=0; k<3; k++) {
+
+	GLuint v = group->vindices[3*i+k];
+
+	vec3 e1 = vertices[ group->vindices[3*i+(k+1)%3] ] - vertices[v];
+	vec3 e2 = vertices[ group->vindices[3*i+(k+2)%3] ] - vertices[v];
+
+	float len = sqrt( e1.squaredLength() * e2.squaredLength() );
+	float cosAngle = (len > 0 ? (e1 * e2) / len : 1);
+
+	if (cosAngle > 1)
+	  cosAngle = 1;
+	else if (cosAngle < -1)
+	  cosAngle = -1;
+
+	cornerVertex[c+k] = v;
+	cornerAngle[c+k] = acos( cosAngle ); // 0 for degenerate triangles, which have no facet normal
+
+	vertexCount[v]++;
+      }
+    } );
+  }
+
+  // Place the corners of each vertex in a range of vertexCorners[].
+  // vertexStart[v] is the start of vertex v's range.  It's used as the
+  // next free position while filling the range, which moves it to the
+  // end, which is the start of vertex v+1's range.
+
+  int *vertexStart = new int[ numVerts+1 ];
+
+  vertexStart[0] = 0;
+  for (int v=0; v<numVerts; v++)
+    vertexStart[v+1] = vertexStart[v] + vertexCount[v];
+
+  parallelFor( numVerts, [&]( int v ) {
+    vertexCount[v] = vertexStart[v];
+  } );
+
+  int *vertexCorners = new int[ numCorners ];
+
+  parallelFor( numCorners, [&]( int c ) {
+    vertexCorners[ vertexCount[ cornerVertex[c] ]++ ] = c;
+  } );
+
+  delete [] vertexCount;
+  delete [] cornerVertex;
+
+  // Sum the normals at each vertex.  The corners are sorted first so
+  // that the sums, and so the normals, don't depend on the order in
+  // which threads placed them.  Corners with the same sum (all of
+  // them, if the vertex isn't on a crease) share a normal.
+  //
+  // cornerNormal[c] is the index of corner c's normal among those of
+  // its vertex, and numNormals[v] is the number of normals of vertex v.
+
+  float cosCrease = cos( creaseAngle * M_PI / 180.0 );
+  float cosHalfCrease = cos( creaseAngle / 2 * M_PI / 180.0 );
+
+  vec3 *cornerSum    = new vec3[ numCorners ];
+  int  *cornerNormal = new int[ numCorners ];
+  int  *numNormals   = new int[ numVerts ];
+
+  parallelFor( numVerts, [&]( int v ) {
+
+    int *first = &vertexCorners[ vertexStart[v] ];
+    int  n     = vertexStart[v+1] - vertexStart[v];
+
+    std::sort( first, first+n );
+
+    // If all facet normals are within creaseAngle/2 of their sum, they
+    // are all within creaseAngle of each other, so each corner's sum
+    // is the whole sum, added in the same order as below
+
+    vec3 allSum(0,0,0);
+
+    for (int j=0; j<n; j++)
+      if (cornerAngle[first[j]] > 0)
+	allSum = allSum + cornerAngle[first[j]] * facetnorms[ first[j]/3 ];
+
+    bool smooth = (allSum.squaredLength() > 0);
+
+    if (smooth) {
+      vec3 dir = allSum.normalize();
+      for (int j=0; smooth && j<n; j++)
+	if (facetnorms[ first[j]/3 ] * dir < cosHalfCrease)
+	  smooth = false;
+    }
+
+    if (smooth) {
+      for (int i=0; i<n; i++) {
+	cornerSum[first[i]] = allSum;
+	cornerNormal[first[i]] = 0;
+      }
+      numNormals[v] = 1;
+      return;
+    }
+
+    // Otherwise, compare each pair of corners
+
+    numNormals[v] = 0;
+
+    for (int i=0; i<n; i++) {
+
+      vec3 &fn = facetnorms[ first[i]/3 ];
+      vec3 sum(0,0,0);
+
+      for (int j=0; j<n; j++) {
+	vec3 &other = facetnorms[ first[j]/3 ];
+	if (cornerAngle[first[j]] > 0 && (i == j || fn * other >= cosCrease))
+	  sum = sum + cornerAngle[first[j]] * other;
+      }
+
+      cornerSum[first[i]] = sum;
+
+      int j;
+      for (j=0; j<i; j++)
+	if (cornerSum[first[j]] == sum)
+	  break;
+
+      cornerNormal[first[i]] = (j < i ? cornerNormal[first[j]] : numNormals[v]++);
+    }
+  } );
+
+  delete [] cornerAngle;
+
+  // Number the normals of all vertices, then store them and each
+  // corner's normal index
+
+  int *firstNormal = numNormals; // replaced in place by its running sum
+
+  int total = 0;
+  for (int v=0; v<numVerts; v++) {
+    int n = numNormals[v];
+    firstNormal[v] = total;
+    total += n;
+  }
+
+  normals.resize( total );
+
+  parallelFor( numVerts, [&]( int v ) {
+    for (int i=vertexStart[v]; i<vertexStart[v+1]; i++) {
+      int c = vertexCorners[i];
+      vec3 &sum = cornerSum[c];
+      normals[ firstNormal[v] + cornerNormal[c] ] = (sum.squaredLength() > 0 ? sum.normalize() : vec3(0,0,1));
+      cornerNormal[c] += firstNormal[v];
+    }
+  } );
+
+  for (int g=0; g<groups.size(); g++) {
+
+    wfGroup *group = groups[g];
+
+    parallelFor( 3 * group->numTriangles(), [&]( int i ) {
+      group->nindices[i] = cornerNormal[ 3 * firstFacet[g] + i ];
+    } );
+  }
+
+  delete [] firstFacet;
+  delete [] vertexStart;
+  delete [] vertexCorners;
+  delete [] cornerSum;
+  delete [] cornerNormal;
+  delete [] numNormals;
+
+  ftime( &endTime );
+
+  cout << "Vertex normals: " << total << " normals built for " << numVerts << " vertices in "
+       << (endTime.time + endTime.millitm / 1000.0) - (startTime.time + startTime.millitm / 1000.0)
+       << " s" << endl;
+}
+
+
+void wfModel::readMaterialLibrary( char *name )
+
+{
+  FILE* file;
+  char  buf[1000];
+  wfMaterial *currentMaterial;
+  int i;
+
+  /* prepend path to the directory of the model file */
+
+  char *dir = new char[ strlen( pathname )+1 ];
 
   strcpy( dir, pathname );
 
@@ -378,714 +1054,1934 @@ void wfModel::readMaterialLibrary( char *name )
   else
     dir[0] = '\0';
 
-  char *filename = new char[ strlen(dir) + strlen(name) + 1 ];
+  char *filename = new char[ strlen(dir) + strlen(name) + 1 ];
+
+  strcpy(filename, dir);
+  strcat(filename, name);
+
+  /* open the file */
+
+  file = fopen(filename, "r");
+  if (!file) {
+    cerr << "wfModel::readMaterialLibrary() couldn't open file '" << filename << "'" << endl;
+    exit(-1);
+  }
+
+  /* set the default material */
+
+  if (materials.size() == 0)
+    materials.add( new wfMaterial("default") );
+
+  currentMaterial = materials[0];
+
+  /* now, read in the data */
+
+  while(fscanf(file, "%s", buf) != EOF) {
+    switch(buf[0]) {
+
+    case '#':				/* comment */
+      /* eat up rest of line */
+      fgets(buf, sizeof(buf), file);
+      break;
+
+    case 'n':				/* newmtl */
+      fgets(buf, sizeof(buf), file);
+      sscanf(buf, "%s %s", buf, buf);
+      for (i=0; i<materials.size(); i++)
+	if (strcmp(materials[i]->name, buf) == 0)
+	  break;
+      if (i<materials.size())
+	currentMaterial = materials[ i ];
+      else {
+	materials.add( new wfMaterial(buf) );
+	currentMaterial = materials[ materials.size()-1 ];
+      }
+      break;
+
+    case 'N':			        /* Ns */ 
+      fscanf(file, "%f", &currentMaterial->shininess);
+      /* wavefront shininess is from [0, 1000], so scale for OpenGL */
+      //currentMaterial->shininess /= 1000.0;
+      //currentMaterial->shininess *= 128.0;
+      break;
+
+    case 'K':
+      switch(buf[1]) {
+	
+      case 'd':
+	fscanf( file, "%f %f %f",
+		&currentMaterial->diffuse[0],
+		&currentMaterial->diffuse[1],
+		&currentMaterial->diffuse[2] );
+	break;
+	
+      case 's':
+	fscanf( file, "%f %f %f",
+		&currentMaterial->specular[0],
+		&currentMaterial->specular[1],
+		&currentMaterial->specular[2] );
+	break;
+	
+      case 'a':
+	fscanf( file, "%f %f %f",
+		&currentMaterial->ambient[0],
+		&currentMaterial->ambient[1],
+		&currentMaterial->ambient[2]);
+	break;
+	
+      default:
+	/* eat up rest of line */
+	fgets(buf, sizeof(buf), file);
+	break;
+      }
+      break;
+
+    case 'm':			/* map_Kd filename */
+      fgets(buf, sizeof(buf), file);
+      sscanf(buf, "%s %s", buf, buf);
+
+      {
+	// prepend path to the directory of the model file
+
+	char *dir = new char[ strlen(pathname)+1 ];
+	strcpy( dir, pathname );
+
+	char *s = strrchr(dir, '/');
+	if (s != NULL) s[1] = '\0'; else dir[0] = '\0';
+
+	char *filename = new char[ strlen(dir) + strlen(buf) + 1 ];
+
+	strcpy(filename, dir);
+	strcat(filename, buf);
+
+	// load the texture
+
+	currentMaterial->loadTexmap( filename );
+	delete [] dir;
+	delete [] filename;
+      }
+
+      break;
+      
+    default:
+      /* eat up rest of line */
+      fgets(buf, sizeof(buf), file);
+      break;
+    }
+  }
+
+  delete [] dir;
+  delete [] filename;
+}
+
+
+/* set the material's ppm, pgm, or png texture map, shared with other
+ * materials that use the same image.  The image is read later, by
+ * wfModel::decodeTextures().
+ */
+
+
+void wfMaterial::loadTexmap( char *filename )
+
+{
+  if (filename != texmapFilename) {
+    free( texmapFilename );
+    texmapFilename = strdup( filename );
+  }
+
+  if (texture != NULL)
+    releaseTexture( texture );
+
+  texture = acquireTexture( filename );
+}
+
+
+wfMaterial* wfModel::findMaterial( char *name )
+
+{
+  int i;
+
+  for (i=0; i<materials.size(); i++)
+    if (strcmp( name, materials[i]->name ) == 0)
+      break;
+
+  if (i < materials.size())
+    return materials[i];
+
+  cerr << "Error: Can't find material '" << name << "'" << endl;
+  return materials[0];
+}
+
+
+wfGroup* wfModel::findGroup( char *name )
+
+{
+  int i;
+
+  for (i=0; i<groups.size(); i++)
+    if (strcmp( name, groups[i]->name ) == 0)
+      break;
+
+  if (i < groups.size())
+    return groups[i];
+
+  // create a new group of this name
+
+  groups.add( new wfGroup(name) );
+  return groups[ groups.size() - 1 ];
+}
+
+
+class VertexSignature {
+public:
+  unsigned int sig[3];
+  bool operator == (const VertexSignature p) const {
+    return sig[0] == p.sig[0] && sig[1] == p.sig[1] && sig[2] == p.sig[2];
+  }
+};
+
+
+/* An open-addressing hash table that maps each distinct vertex
+ * signature to the index of its vertex in the OpenGL vertex buffer.
+ * Collisions are resolved by linear probing and the table is doubled
+ * whenever it becomes half full, so lookups stay O(1) on average.
+ */
+
+
+class VertexTable {
+
+  struct Slot {
+    VertexSignature vs;
+    GLuint          index;	/* index of vertex, or EMPTY if slot is unused */
+  };
+
+  static const GLuint EMPTY = 0xffffffff;
+
+  Slot        *slots;
+  unsigned int capacity;	/* always a power of two */
+  unsigned int count;
+
+  static unsigned int hash( const VertexSignature &vs ) {
+    unsigned int h = vs.sig[0] * 0x9E3779B1u;
+    h ^= vs.sig[1] * 0x85EBCA77u;
+    h ^= vs.sig[2] * 0xC2B2AE3Du;
+    h ^= h >> 15;
+    return h;
+  }
+
+  void allocate( unsigned int n ) {
+    capacity = n;
+    slots = new Slot[ capacity ];
+    for (unsigned int i=0; i<capacity; i++)
+      slots[i].index = EMPTY;
+  }
+
+  void grow();
+
+ public:
+
+  VertexTable( unsigned int expectedSize ) {
+    unsigned int n = 16;
+    while (n < 2 * expectedSize)
+      n *= 2;
+    allocate( n );
+    count = 0;
+  }
+
+  ~VertexTable() {
+    delete [] slots;
+  }
+
+  GLuint findOrAdd( const VertexSignature &vs, GLuint nextIndex );
+};
+
+
+// Return the vertex index stored with signature 'vs'.  If there is
+// none, store 'nextIndex' with 'vs' and return 'nextIndex'.
+
+GLuint VertexTable::findOrAdd( const VertexSignature &vs, GLuint nextIndex )
+
+{
+  unsigned int mask = capacity - 1;
+  unsigned int i = hash( vs ) & mask;
+
+  while (slots[i].index != EMPTY) {
+    if (slots[i].vs == vs)
+      return slots[i].index;
+    i = (i+1) & mask;
+  }
+
+  slots[i].vs = vs;
+  slots[i].index = nextIndex;
+  count++;
+
+  if (2 * count > capacity)
+    grow();
+
+  return nextIndex;
+}
+
+
+// Double the table size and re-insert all occupied slots
+
+void VertexTable::grow()
+
+{
+  Slot *oldSlots = slots;
+  unsigned int oldCapacity = capacity;
+
+  allocate( 2 * oldCapacity );
+
+  unsigned int mask = capacity - 1;
+
+  for (unsigned int j=0; j<oldCapacity; j++)
+    if (oldSlots[j].index != EMPTY) {
+      unsigned int i = hash( oldSlots[j].vs ) & mask;
+      while (slots[i].index != EMPTY)
+	i = (i+1) & mask;
+      slots[i] = oldSlots[j];
+    }
+
+  delete [] oldSlots;
+}
+
+
+
+// Build each group's OpenGL vertex and index buffers.
+//
+// Note that positions, normals, and texture coordinates can all be
+// indexed differently in a Wavefront file.  But OpenGL permits only
+// one index per vertex, and the OpenGL vertex encapsulates all
+// attributes, including position, normal, and texture coordinates.
+//
+// So we have to create *another* array of vertices where each vertex
+// stores position, normal, and texture coordinates and the face
+// indices index into this new array.
+//
+// Groups are built in parallel.  Each is optimized and given levels
+// of detail if requested, then passed to groupBuilt() so that it can
+// be sent to OpenGL while other groups are still being built.
+
+void wfModel::buildBuffers()
+
+{
+  int *missesBefore = new int[ groups.size() ];
+  int *missesAfter  = new int[ groups.size() ];
+  int *numClusters  = new int[ groups.size() ];
+
+  struct timeb startTime, endTime;
+  ftime( &startTime );
+
+  parallelForBlocks( groups.size(), [&]( int i ) {
+
+    weldGroup( groups[i] );
+
+    if (optimizeMeshes)
+      optimizeGroup( groups[i], missesBefore[i], missesAfter[i], numClusters[i] );
+
+    if (generateLODs)
+      buildLODs( groups[i] );
+
+    groupBuilt( i );
+  } );
+
+  ftime( &endTime );
+
+  // Report the vertex cache optimization: the average cache miss
+  // ratio (ACMR) and average transform to vertex ratio (ATVR) before
+  // and after
+
+  if (optimizeMeshes) {
+
+    int totalBefore = 0, totalAfter = 0, totalClusters = 0;
+    int totalTriangles = 0, totalVertices = 0;
+
+    for (int i=0; i<groups.size(); i++) {
+      totalBefore    += missesBefore[i];
+      totalAfter     += missesAfter[i];
+      totalClusters  += numClusters[i];
+      totalTriangles += groups[i]->lodNumIndices[0] / 3;
+      totalVertices  += groups[i]->numVertices;
+    }
+
+    if (totalTriangles > 0)
+      cout << "Mesh optimization (" << VERTEX_CACHE_SIZE << "-vertex FIFO cache): "
+	   << "ACMR " << totalBefore / (float) totalTriangles << " -> " << totalAfter / (float) totalTriangles << ", "
+	   << "ATVR " << totalBefore / (float) totalVertices << " -> " << totalAfter / (float) totalVertices << ", "
+	   << totalClusters << " overdraw clusters" << endl;
+  }
+
+  delete [] numClusters;
+  delete [] missesAfter;
+  delete [] missesBefore;
+
+  // Report the triangles in each level of detail
+
+  if (generateLODs) {
+
+    int numTriangles[ MAX_LODS ];
+    int maxLODs = 1;
+
+    for (int l=0; l<MAX_LODS; l++)
+      numTriangles[l] = 0;
+
+    for (int i=0; i<groups.size(); i++) {
+      for (int l=0; l<MAX_LODS; l++)
+	numTriangles[l] += groups[i]->lodNumIndices[ l < groups[i]->numLODs ? l : groups[i]->numLODs-1 ] / 3;
+      if (groups[i]->numLODs > maxLODs)
+	maxLODs = groups[i]->numLODs;
+    }
+
+    cout << "Levels of detail:";
+    for (int l=0; l<maxLODs; l++)
+      cout << (l > 0 ? "," : "") << " " << numTriangles[l];
+    cout << " triangles (groups built in "
+	 << (endTime.time - startTime.time) + (endTime.millitm - startTime.millitm) / 1000.0 << " s)" << endl;
+  }
+}
+
+
+// Build one group's vertex and index buffers
+
+void wfModel::weldGroup( wfGroup *thisGroup )
+
+{
+  int numTriangles = thisGroup->numTriangles();
+
+  if (numTriangles == 0)
+    return;
+
+  // The number of distinct vertices is not known in advance, so the
+  // vertex buffer starts small and is doubled as needed.  Most meshes
+  // have about half as many vertices as triangles.
+
+  unsigned int vertexCapacity = numTriangles/2 + 16;
+
+  GLfloat *vertexBuffer = new GLfloat[ vertexCapacity * vertexSize ];
+  GLuint *faceIndexBuffer = new GLuint[ numTriangles * 3 ];
+
+  unsigned int nVerts = 0;
+  int nFaces = 0;
+
+  VertexTable vertTable( numTriangles/2 + 16 );
+
+  for (int j=0; j<numTriangles; j++) {
+
+    for (int k=0; k<3; k++) {
+
+      // Find an already-stored vertex with this signature
+
+      VertexSignature vs;
+
+      vs.sig[0] = thisGroup->vindices[3*j+k];
+      vs.sig[1] = thisGroup->nindices[3*j+k];
+      vs.sig[2] = thisGroup->tindices[3*j+k];
+
+      GLuint l = vertTable.findOrAdd( vs, nVerts );
+
+      if (l == nVerts) {	// none found ... create a new vertex
+
+	if (nVerts == vertexCapacity) {
+	  GLfloat *newBuffer = new GLfloat[ 2 * vertexCapacity * vertexSize ];
+	  memcpy( newBuffer, vertexBuffer, nVerts * vertexSize * sizeof(GLfloat) );
+	  delete [] vertexBuffer;
+	  vertexBuffer = newBuffer;
+	  vertexCapacity *= 2;
+	}
+
+	* (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ vs.sig[0] ];
+	if (hasVertexNormals)
+	  * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ vs.sig[1] ];
+	if (hasVertexTexCoords) {
+	  if (hasVertexNormals)
+	    * (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ vs.sig[2] ];
+	  else
+	    * (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ vs.sig[2] ];
+	}
+
+	nVerts++;
+      }
+
+      // Store this vertex index
+
+      faceIndexBuffer[ nFaces * 3 + k ] = l;
+    }
+
+    nFaces++;
+  }
+
+  thisGroup->vertexBuffer = vertexBuffer;
+  thisGroup->indexBuffer  = faceIndexBuffer;
+  thisGroup->numVertices  = nVerts;
+  thisGroup->numIndices   = nFaces * 3;
+  thisGroup->numLODs      = 1;
+  thisGroup->lodNumIndices[0] = nFaces * 3;
+}
+
+
+#define LOD_REDUCTION     4	/* each level of detail has 1/LOD_REDUCTION of the triangles of the one before */
+#define LOD_MIN_REDUCTION 0.8	/* stop when a level has more than this fraction of the triangles of the one before */
+
+
+// Add simplified levels of detail to a group's index buffer (see
+// meshSimplify.h).  Each level continues the simplification of the
+// one before.  A group gets fewer than MAX_LODS levels if it can't
+// be simplified enough.
+
+void wfModel::buildLODs( wfGroup *g )
+
+{
+  if (g->numIndices == 0)
+    return;
+
+  MeshSimplifier simplifier( g->indexBuffer, g->numIndices, g->vertexBuffer, g->numVertices, vertexSize );
+
+  GLuint *levels[ MAX_LODS ];
+  int totalIndices = g->numIndices;
+
+  while (g->numLODs < MAX_LODS) {
+
+    int prevNumIndices = g->lodNumIndices[ g->numLODs-1 ];
+    int n = simplifier.simplify( (prevNumIndices / 3 / LOD_REDUCTION) * 3 );
+
+    if (n == 0 || n > LOD_MIN_REDUCTION * prevNumIndices)
+      break;
+
+    GLuint *level = new GLuint[ n ];
+    memcpy( level, simplifier.indices(), n * sizeof(GLuint) );
+
+    if (optimizeMeshes) {
+      seq<int> clusterStarts;
+      reorderForVertexCache( level, n, g->numVertices, VERTEX_CACHE_SIZE, clusterStarts );
+    }
+
+    levels[ g->numLODs ] = level;
+    g->lodNumIndices[ g->numLODs ] = n;
+    g->numLODs++;
+    totalIndices += n;
+  }
+
+  // Append the levels to the group's index buffer
+
+  if (g->numLODs > 1) {
+
+    GLuint *indexBuffer = new GLuint[ totalIndices ];
+    memcpy( indexBuffer, g->indexBuffer, g->numIndices * sizeof(GLuint) );
+
+    for (int l=1; l<g->numLODs; l++) {
+      memcpy( &indexBuffer[ g->lodStart(l) ], levels[l], g->lodNumIndices[l] * sizeof(GLuint) );
+      delete [] levels[l];
+    }
+
+    delete [] g->indexBuffer;
+    g->indexBuffer = indexBuffer;
+    g->numIndices = totalIndices;
+  }
+}
+
+
+// Choose the level of detail for the model when its radius projects
+// to 'projectedRadius' pixels: the most detailed level with at least
+// LOD_PIXELS_PER_TRIANGLE pixels per front-facing triangle.
+
+#define LOD_PIXELS_PER_TRIANGLE 4
+
+void wfModel::selectLOD( float projectedRadius )
+
+{
+  float pixels = M_PI * projectedRadius * projectedRadius;
+
+  lod = 0;
+
+  while (lod < numLODs-1 && pixels / (0.5 * lodNumTriangles[lod]) < LOD_PIXELS_PER_TRIANGLE)
+    lod++;
+}
+
+
+// Reorder a group's triangles and vertices for the vertex cache and
+// to reduce overdraw (see meshOptimize.h).  Returns the number of
+// vertices transformed before and after, and the number of overdraw
+// clusters.
+
+void wfModel::optimizeGroup( wfGroup *g, int &missesBefore, int &missesAfter, int &numClusters )
+
+{
+  missesBefore = countCacheMisses( g->indexBuffer, g->numIndices, g->numVertices, VERTEX_CACHE_SIZE );
+
+  // Keep the original triangle order if it was already better
+  // (e.g. a mesh exported as strips)
+
+  GLuint *originalIndices = new GLuint[ g->numIndices ];
+  memcpy( originalIndices, g->indexBuffer, g->numIndices * sizeof(GLuint) );
+
+  seq<int> clusterStarts;
+
+  reorderForVertexCache( g->indexBuffer, g->numIndices, g->numVertices, VERTEX_CACHE_SIZE, clusterStarts );
+  reorderForOverdraw( g->indexBuffer, g->numIndices, g->vertexBuffer, g->numVertices, vertexSize, VERTEX_CACHE_SIZE, clusterStarts );
+
+  missesAfter = countCacheMisses( g->indexBuffer, g->numIndices, g->numVertices, VERTEX_CACHE_SIZE );
+  numClusters = clusterStarts.size();
+
+  if (missesAfter > missesBefore) {
+    memcpy( g->indexBuffer, originalIndices, g->numIndices * sizeof(GLuint) );
+    missesAfter = missesBefore;
+    numClusters = 0;
+  }
+
+  delete [] originalIndices;
+
+  reorderVertices( g->vertexBuffer, g->numVertices, vertexSize, g->indexBuffer, g->numIndices );
+}
+
+
+// Fill in a group's quantizedBuffer with its vertices in the format
+// of quantize.h, and record the largest errors.  Positions are
+// quantized over the cube set up in startBuilding().
+
+void wfModel::quantizeGroup( wfGroup *group )
+
+{
+  int   stride = vertexStride();
+  float step = quantizedSize / QUANTIZED_POSITION_MAX;
+
+  GLubyte *buffer = new GLubyte[ group->numVertices * stride ];
+  memset( buffer, 0, group->numVertices * stride );
+
+  float positionError = 0;
+  float normalDot = 1;
+
+  for (int v=0; v<group->numVertices; v++) {
+
+    GLfloat *in  = &group->vertexBuffer[ v * vertexSize ];
+    GLubyte *out = &buffer[ v * stride ];
+
+    // position
+
+    GLushort *position = (GLushort *) &out[ QUANTIZED_POSITION_OFFSET ];
+    float    *lo       = &min.x;
+    float     error    = 0;
+
+    for (int k=0; k<3; k++) {
+      int q = (int) floor( (in[k] - lo[k]) / step + 0.5 );
+      if (q < 0) q = 0;
+      if (q > QUANTIZED_POSITION_MAX) q = QUANTIZED_POSITION_MAX;
+      position[k] = q;
+      float d = lo[k] + q * step - in[k];
+      error += d*d;
+    }
+
+    error = sqrt( error );
+    if (error > positionError)
+      positionError = error;
+
+    // normal
+
+    if (hasVertexNormals) {
+      vec3 n = vec3( &in[3] ).normalize();
+      GLbyte *normal = (GLbyte *) &out[ QUANTIZED_NORMAL_OFFSET ];
+      encodeOctahedral( n, normal[0], normal[1] );
+      float d = decodeOctahedral( normal[0], normal[1] ) * n;
+      if (d < normalDot)
+	normalDot = d;
+    }
+
+    // texture coordinates
+
+    if (hasVertexTexCoords) {
+      GLfloat  *t        = &in[ hasVertexNormals ? 6 : 3 ];
+      GLushort *texcoord = (GLushort *) &out[ QUANTIZED_TEXCOORD_OFFSET ];
+      texcoord[0] = floatToHalf( t[0] );
+      texcoord[1] = floatToHalf( t[1] );
+    }
+  }
+
+  group->quantizedBuffer = buffer;
+
+  loadMutex.lock();
+
+  if (positionError > maxPositionError)
+    maxPositionError = positionError;
+  if (normalDot < minNormalDot)
+    minNormalDot = normalDot;
+
+  loadMutex.unlock();
+}
+
+
+/* The material parameters as they are laid out in the 'Material'
+ * uniform block (with std140 layout) of the shaders:
+ *
+ *   layout (std140) uniform Material {
+ *     vec4  kd;
+ *     vec4  ks;
+ *     vec4  Ia;
+ *     vec4  Ie;
+ *     float shininess;
+ *     int   texturing;
+ *   };
+ */
+
+#define MATERIAL_BINDING 0	/* uniform buffer binding point for materials */
+
+struct MaterialBlock {
+  GLfloat kd[4];
+  GLfloat ks[4];
+  GLfloat Ia[4];
+  GLfloat Ie[4];
+  GLfloat shininess;
+  GLint   texturing;
+  GLint   pad[2];
+};
+
+
+// Initialize an empty model
+
+void wfModel::init()
+
+{
+  texturesInitialized = false;
+  pathname = mtllibname = NULL;
+  objToWorldTransform = identity4();
+  modelTransform = identity4();
+  cacheFile = NULL;
+  VAOinitialized = false;
+  verticesQuantized = false;
+  numLODs = 1;
+  lod = 0;
+
+  loader = NULL;
+  loadState = LOAD_READING;
+  numGroupsSent = 0;
+  bytesRead = 0;
+  bytesToRead = 0;
+  trianglesToSend = 0;
+  trianglesSent = 0;
+  loaded = false;
+  cpuDataReleased = false;
+  cpuBytesReleased = 0;
+  bvh = NULL;
+  numGroupsDrawn = numGroupsCulled = 0;
+  instanceBufferID = 0;
+  numInstances = 0;
+  textureMode = MIPMAP_LINEAR;
+}
+
+
+// Free the model.  Its textures are released, so are freed if no
+// other model uses them.
+
+wfModel::~wfModel()
+
+{
+  if (loader != NULL) {
+    loader->join();
+    delete loader;
+  }
+
+  if (VAOinitialized) {
+    glDeleteVertexArrays( 1, &VAO );
+    glDeleteBuffers( 1, &vertexBufferID );
+    glDeleteBuffers( 1, &indexBufferID );
+    glDeleteBuffers( 1, &materialBuffer );
+    if (instanceBufferID != 0)
+      glDeleteBuffers( 1, &instanceBufferID );
+  }
+
+  for (int i=0; i<groups.size(); i++) {
+    if (cacheFile == NULL) {
+      delete [] groups[i]->vertexBuffer;
+      delete [] groups[i]->indexBuffer;
+    }
+    delete [] groups[i]->quantizedBuffer;
+    delete groups[i];
+  }
+
+  for (int i=0; i<materials.size(); i++)
+    delete materials[i];
+
+  delete bvh;
+  delete cacheFile;
+
+  free( pathname );
+  free( mtllibname );
+}
+
+
+// Read and build the model, either from the .obj file or from the
+// mesh cache.  This runs in the loader thread if the model is loaded
+// with startLoading().
+
+void wfModel::load( char *filename )
+
+{
+  if (useMeshCache && readCache( filename )) {
+    decodeTextures();
+    startBuilding();
+    parallelForBlocks( groups.size(), [&]( int i ) {
+      groupBuilt( i );
+    } );
+  }
+  else {
+    read( filename );
+    decodeTextures();
+    startBuilding();
+    buildBuffers();
+    if (useMeshCache)
+      writeCache( filename );
+  }
+
+  if (buildRaycastBVHs)
+    buildRaycastBVH();
+
+  loadState = LOAD_FINISHED;
+}
+
+
+// Start loading a model in a background thread.  continueLoading()
+// must then be called on the OpenGL thread (e.g. once per frame)
+// until it returns true.
+
+void wfModel::startLoading( char *filename, TextureMode textureMode )
+
+{
+  this->textureMode = textureMode;
+
+  char *name = strdup( filename );
+
+  loader = new std::thread( [this, name]() {
+    load( name );
+    free( name );
+  } );
+}
+
+
+// Called once the model's groups, materials, and extents are known,
+// before any group is built.  Sets up the quantization and lets
+// continueLoading() start sending groups to OpenGL.
+
+void wfModel::startBuilding()
+
+{
+  if (cacheFile == NULL) {
+    vertexSize = 3;
+
+    if (hasVertexNormals)
+      vertexSize += 3;
+
+    if (hasVertexTexCoords)
+      vertexSize += 2;
+  }
+
+  trianglesToSend = 0;
+
+  for (int i=0; i<groups.size(); i++)
+    trianglesToSend += (cacheFile != NULL ? groups[i]->lodNumIndices[0] / 3 : groups[i]->numTriangles());
+
+  // Positions are quantized over the model's bounding cube, so the
+  // transformation from [0,1]^3 back to model coordinates is added to
+  // objToWorldTransform.  The cube has the same scale on all axes so
+  // that normals can still be transformed by the modelview matrix.
+
+  modelTransform = objToWorldTransform;
+  verticesQuantized = quantizeVertices;
+
+  if (verticesQuantized) {
+
+    vec3 extent = max - min;
+
+    quantizedSize = extent.x;
+    if (extent.y > quantizedSize) quantizedSize = extent.y;
+    if (extent.z > quantizedSize) quantizedSize = extent.z;
+    if (quantizedSize == 0)
+      quantizedSize = 1;
+
+    objToWorldTransform = objToWorldTransform * translate( min ) * scale( quantizedSize, quantizedSize, quantizedSize );
+
+    maxPositionError = 0;
+    minNormalDot = 1;
+  }
+
+  loadState = LOAD_BUILDING;
+}
+
+
+// Make a built group available to continueLoading()
+
+void wfModel::groupBuilt( int i )
+
+{
+  if (verticesQuantized)
+    quantizeGroup( groups[i] );
+
+  loadMutex.lock();
+  builtGroups.add( i );
+  loadMutex.unlock();
+}
+
+
+#define SEND_SECONDS_PER_CALL 0.01 /* time continueLoading() spends sending groups when loading in the background */
+
+
+// Send the groups that have been built to OpenGL.  When loading in
+// the background, this stops after a while so that the caller can
+// draw a frame.  Returns true once the whole model is in OpenGL.
+
+bool wfModel::continueLoading()
+
+{
+  if (loaded)
+    return true;
+
+  // All groups have been built if the state is LOAD_FINISHED
+
+  int state = loadState;
+
+  if (state == LOAD_READING)
+    return false;
+
+  if (!VAOinitialized)
+    setupVAO();
+
+  struct timeb startTime, now;
+  ftime( &startTime );
+
+  for (;;) {
+
+    int i = -1;
+
+    loadMutex.lock();
+    if (numGroupsSent < builtGroups.size())
+      i = builtGroups[ numGroupsSent++ ];
+    loadMutex.unlock();
+
+    if (i < 0)
+      break;
+
+    sendGroup( i );
+
+    ftime( &now );
+
+    if (loader != NULL &&
+	(now.time - startTime.time) + (now.millitm - startTime.millitm) / 1000.0 > SEND_SECONDS_PER_CALL)
+      return false;
+  }
+
+  if (state != LOAD_FINISHED)
+    return false;
+
+  finishLoading();
+
+  return true;
+}
+
+
+// Fraction of the loading that is done.  Reading the .obj file and
+// sending the groups to OpenGL count equally.
+
+float wfModel::loadProgress()
+
+{
+  if (loaded)
+    return 1;
+
+  if (loadState == LOAD_READING)
+    return (bytesToRead > 0 ? 0.5 * bytesRead / (float) bytesToRead : 0);
+
+  return 0.5 + (trianglesToSend > 0 ? 0.5 * trianglesSent / (float) trianglesToSend : 0);
+}
+
+
+// Create the model's OpenGL objects: the vertex array object, with
+// vertex and index buffers that sendGroup() fills in, the material
+// uniform buffer, and the textures.
+
+void wfModel::setupVAO()
+
+{
+  glGenVertexArrays( 1, &VAO );
+  glBindVertexArray( VAO );
+
+  // Start with room for the whole model, assuming (as in weldGroup())
+  // that it has about half as many vertices as triangles.  The
+  // buffers are grown if needed and trimmed in finishLoading().
+
+  vertexCapacity = (trianglesToSend/2 + 16) * vertexStride();
+  indexCapacity = 3 * trianglesToSend * sizeof(GLuint);
+
+  glGenBuffers( 1, &indexBufferID );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, indexBufferID );
+  glBufferData( GL_ELEMENT_ARRAY_BUFFER, indexCapacity, NULL, GL_STATIC_DRAW );
+
+  glGenBuffers( 1, &vertexBufferID );
+  glBindBuffer( GL_ARRAY_BUFFER, vertexBufferID );
+  glBufferData( GL_ARRAY_BUFFER, vertexCapacity, NULL, GL_STATIC_DRAW );
+
+  setupAttributes();
+
+  glBindVertexArray( 0 );
+
+  numVerticesSent = 0;
+  numIndicesSent = 0;
+  trianglesSent = 0;
+  batches.clear();
+
+  numLODs = 1;
+  lod = 0;
+
+  VAOinitialized = true;
+
+  // Store the materials in a uniform buffer.  Each is bound
+  // separately with glBindBufferRange(), so each must start at a
+  // multiple of the uniform buffer offset alignment.
+
+  GLint alignment;
+  glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment );
+
+  materialStride = ((sizeof(MaterialBlock) + alignment - 1) / alignment) * alignment;
+
+  unsigned char *materialData = new unsigned char[ materials.size() * materialStride ];
+  memset( materialData, 0, materials.size() * materialStride );
+
+  for (int m=0; m<materials.size(); m++) {
+
+    wfMaterial    *mat = materials[m];
+    MaterialBlock *block = (MaterialBlock *) &materialData[ m * materialStride ];
+
+    memcpy( block->kd, mat->diffuse,  sizeof(block->kd) );
+    memcpy( block->ks, mat->specular, sizeof(block->ks) );
+    memcpy( block->Ia, mat->ambient,  sizeof(block->Ia) );
+    memcpy( block->Ie, mat->emissive, sizeof(block->Ie) );
+
+    block->shininess = mat->shininess;
+    block->texturing = (mat->texture != NULL);
+  }
+
+  glGenBuffers( 1, &materialBuffer );
+  glBindBuffer( GL_UNIFORM_BUFFER, materialBuffer );
+  glBufferData( GL_UNIFORM_BUFFER, materials.size() * materialStride, materialData, GL_STATIC_DRAW );
+  glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+
+  delete [] materialData;
+
+  initTextures( textureMode );
+}
+
+
+// Bytes per vertex in the OpenGL vertex buffer
+
+int wfModel::vertexStride()
+
+{
+  if (verticesQuantized)
+    return QUANTIZED_TEXCOORD_OFFSET + (hasVertexTexCoords ? 2 * sizeof(GLushort) : 0);
+  else
+    return vertexSize * sizeof(GLfloat);
+}
+
+
+// Define the vertex attributes in the bound VAO, from the bound
+// GL_ARRAY_BUFFER
+
+void wfModel::setupAttributes()
+
+{
+  int attribIndex = 0;
+  int stride = vertexStride();
+
+  if (verticesQuantized) {
+
+    glEnableVertexAttribArray( attribIndex );
+    glVertexAttribPointer( attribIndex, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (const GLvoid*) QUANTIZED_POSITION_OFFSET );
+    attribIndex++;
+
+    if (hasVertexNormals) {
+      glEnableVertexAttribArray( attribIndex );
+      glVertexAttribPointer( attribIndex, 2, GL_BYTE, GL_TRUE, stride, (const GLvoid*) QUANTIZED_NORMAL_OFFSET );
+      attribIndex++;
+    }
+
+    if (hasVertexTexCoords) {
+      glEnableVertexAttribArray( attribIndex );
+      glVertexAttribPointer( attribIndex, 2, GL_HALF_FLOAT, GL_FALSE, stride, (const GLvoid*) QUANTIZED_TEXCOORD_OFFSET );
+      attribIndex++;
+    }
+
+    return;
+  }
+
+  unsigned long int accumulatedOffset = 0;
+
+  // position = attribute 0
+
+  glEnableVertexAttribArray( attribIndex );
+  glVertexAttribPointer( attribIndex, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*) accumulatedOffset );
+  attribIndex++;
+  accumulatedOffset += 3 * sizeof( float );
+
+  // normals?
+
+  if (hasVertexNormals) {
+    glEnableVertexAttribArray( attribIndex );
+    glVertexAttribPointer( attribIndex, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*) accumulatedOffset );
+    attribIndex++;
+    accumulatedOffset += 3 * sizeof( float );
+  }
+
+  // texture coordinates?
+
+  if (hasVertexTexCoords) {
+    glEnableVertexAttribArray( attribIndex );
+    glVertexAttribPointer( attribIndex, 2, GL_FLOAT, GL_FALSE, stride, (const GLvoid*) accumulatedOffset );
+    attribIndex++;
+    accumulatedOffset += 2 * sizeof( float );
+  }
+}
+
+
+// Replace an OpenGL buffer with one of 'newCapacity' bytes, keeping
+// the first 'used' bytes.  The copy is done by OpenGL.
+
+void wfModel::resizeBuffer( GLuint &buffer, int &capacity, int used, int newCapacity )
+
+{
+  GLuint newBuffer;
+
+  glGenBuffers( 1, &newBuffer );
+  glBindBuffer( GL_COPY_WRITE_BUFFER, newBuffer );
+  glBufferData( GL_COPY_WRITE_BUFFER, newCapacity, NULL, GL_STATIC_DRAW );
+
+  if (used > 0) {
+    glBindBuffer( GL_COPY_READ_BUFFER, buffer );
+    glCopyBufferSubData( GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used );
+  }
+
+  glDeleteBuffers( 1, &buffer );
+
+  buffer = newBuffer;
+  capacity = newCapacity;
+}
+
+
+// Send a built group's vertices, and its indices for all levels of
+// detail, to the ends of the OpenGL buffers, and add a batch to draw
+// it.  The batches are merged by material in finishLoading().
+
+void wfModel::sendGroup( int i )
+
+{
+  wfGroup *group = groups[i];
+
+  if (group->numIndices == 0)
+    return;
+
+  int stride = vertexStride();
+
+  glBindVertexArray( VAO );
+
+  // vertices
+
+  int needed = (numVerticesSent + group->numVertices) * stride;
+
+  if (needed > vertexCapacity) {
+    resizeBuffer( vertexBufferID, vertexCapacity, numVerticesSent * stride, (needed > 2 * vertexCapacity ? needed : 2 * vertexCapacity) );
+    glBindBuffer( GL_ARRAY_BUFFER, vertexBufferID );
+    setupAttributes();
+  }
+
+  glBindBuffer( GL_ARRAY_BUFFER, vertexBufferID );
+  glBufferSubData( GL_ARRAY_BUFFER, numVerticesSent * stride, group->numVertices * stride,
+		   (verticesQuantized ? (const GLvoid *) group->quantizedBuffer : (const GLvoid *) group->vertexBuffer) );
+
+  // indices.  OpenGL ES 3.0 can't add a base vertex to the indices
+  // when drawing, so they are offset here to where the group's
+  // vertices are in the vertex buffer.
+
+  GLuint *indices = new GLuint[ group->numIndices ];
+
+  for (int j=0; j<group->numIndices; j++)
+    indices[j] = group->indexBuffer[j] + numVerticesSent;
+
+  needed = (numIndicesSent + group->numIndices) * sizeof(GLuint);
+
+  if (needed > indexCapacity)
+    resizeBuffer( indexBufferID, indexCapacity, numIndicesSent * sizeof(GLuint), (needed > 2 * indexCapacity ? needed : 2 * indexCapacity) );
+
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, indexBufferID );
+  glBufferSubData( GL_ELEMENT_ARRAY_BUFFER, numIndicesSent * sizeof(GLuint), group->numIndices * sizeof(GLuint), indices );
+
+  delete [] indices;
+
+  glBindVertexArray( 0 );
+
+  // batch, which uses the group's last level for any levels it
+  // doesn't have
+
+  wfBatch batch;
+  batch.material = group->material;
+  batch.materialIndex = materials.findIndex( group->material );
+
+  for (int l=0; l<MAX_LODS; l++) {
+    int level = (l < group->numLODs ? l : group->numLODs-1);
+    group->firstIndex[l] = numIndicesSent + group->lodStart( level );
+    batch.firstIndex[l] = group->firstIndex[l];
+    batch.numIndices[l] = group->lodNumIndices[level];
+  }
+
+  batch.firstGroup = drawOrder.size();
+  batch.numGroups = 1;
+  drawOrder.add( group );
+
+  batches.add( batch );
+
+  numVerticesSent += group->numVertices;
+  numIndicesSent  += group->numIndices;
+  trianglesSent   += group->lodNumIndices[0] / 3;
+}
+
+
+// Called once all groups have been sent to OpenGL.  Reorders the
+// index buffer by material, so that each material is drawn with a
+// single glDrawElements() for each level of detail, trims the vertex
+// buffer, and frees the group buffers.
+
+void wfModel::finishLoading()
+
+{
+  if (loader != NULL) {
+    loader->join();
+    delete loader;
+    loader = NULL;
+  }
+
+  // Find the model's levels of detail.  A group with fewer levels
+  // than the model uses its last level for the remaining ones.  The
+  // model has fewer levels if the groups' levels don't reduce the
+  // total enough.
+
+  numLODs = 0;
+
+  for (int l=0; l<MAX_LODS; l++) {
+
+    int numTriangles = 0;
+    bool anyNew = false;
+
+    for (int i=0; i<groups.size(); i++) {
+      wfGroup *thisGroup = groups[i];
+      numTriangles += thisGroup->lodNumIndices[ l < thisGroup->numLODs ? l : thisGroup->numLODs-1 ] / 3;
+      if (l < thisGroup->numLODs && l > 0)
+	anyNew = true;
+    }
+
+    if (l > 0 && (!anyNew || numTriangles > LOD_MIN_REDUCTION * lodNumTriangles[l-1]))
+      break;
+
+    lodNumTriangles[l] = numTriangles;
+    numLODs++;
+  }
+
+  if (lod >= numLODs)
+    lod = numLODs-1;
+
+  int totalIndices = 0;
+
+  for (int l=0; l<numLODs; l++)
+    totalIndices += 3 * lodNumTriangles[l];
+
+  // Copy the groups' indices to a new index buffer, ordered by
+  // material and then by level of detail, and find the batches
+
+  GLuint newIndexBufferID;
+
+  glGenBuffers( 1, &newIndexBufferID );
+  glBindBuffer( GL_COPY_WRITE_BUFFER, newIndexBufferID );
+  glBufferData( GL_COPY_WRITE_BUFFER, totalIndices * sizeof(GLuint), NULL, GL_STATIC_DRAW );
+  glBindBuffer( GL_COPY_READ_BUFFER, indexBufferID );
+
+  int numIndices = 0;
+
+  batches.clear();
+  drawOrder.clear();
+
+  for (int m=0; m<materials.size(); m++) {
+
+    wfBatch batch;
+    batch.material = materials[m];
+    batch.materialIndex = m;
+    batch.firstGroup = drawOrder.size();
+
+    for (int i=0; i<groups.size(); i++)
+      if (groups[i]->material == materials[m] && groups[i]->numIndices > 0)
+	drawOrder.add( groups[i] );
+
+    batch.numGroups = drawOrder.size() - batch.firstGroup;
+
+    for (int l=0; l<numLODs; l++) {
+
+      batch.firstIndex[l] = numIndices;
+
+      for (int i=0; i<groups.size(); i++)
+	if (groups[i]->material == materials[m] && groups[i]->numIndices > 0) {
 
-  strcpy(filename, dir);
-  strcat(filename, name);
+	  wfGroup *thisGroup = groups[i];
+	  int      count = thisGroup->lodNumIndices[ l < thisGroup->numLODs ? l : thisGroup->numLODs-1 ];
 
-  /* open the file */
+	  glCopyBufferSubData( GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+			       thisGroup->firstIndex[l] * sizeof(GLuint), numIndices * sizeof(GLuint), count * sizeof(GLuint) );
 
-  file = fopen(filename, "r");
-  if (!file) {
-    cerr << "wfModel::readMaterialLibrary() couldn't open file '" << filename << "'" << endl;
-    exit(-1);
+	  thisGroup->firstIndex[l] = numIndices;
+	  numIndices += count;
+	}
+
+      batch.numIndices[l] = numIndices - batch.firstIndex[l];
+    }
+
+    if (batch.numIndices[0] > 0)
+      batches.add( batch );
   }
 
-  /* set the default material */
+  glDeleteBuffers( 1, &indexBufferID );
 
-  if (materials.size() == 0)
-    materials.add( new wfMaterial("default") );
+  indexBufferID = newIndexBufferID;
+  indexCapacity = totalIndices * sizeof(GLuint);
 
-  currentMaterial = materials[0];
+  glBindVertexArray( VAO );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, indexBufferID );
 
-  /* now, read in the data */
+  // Trim the vertex buffer
 
-  while(fscanf(file, "%s", buf) != EOF) {
-    switch(buf[0]) {
+  int vertexBytes = numVerticesSent * vertexStride();
 
-    case '#':				/* comment */
-      /* eat up rest of line */
-      fgets(buf, sizeof(buf), file);
-      break;
+  if (vertexCapacity > vertexBytes) {
+    resizeBuffer( vertexBufferID, vertexCapacity, vertexBytes, vertexBytes );
+    glBindBuffer( GL_ARRAY_BUFFER, vertexBufferID );
+    setupAttributes();
+  }
 
-    case 'n':				/* newmtl */
-      fgets(buf, sizeof(buf), file);
-      sscanf(buf, "%s %s", buf, buf);
-      for (i=0; i<materials.size(); i++)
-	if (strcmp(materials[i]->name, buf) == 0)
-	  break;
-      if (i<materials.size())
-	currentMaterial = materials[ i ];
-      else {
-	materials.add( new wfMaterial(buf) );
-	currentMaterial = materials[ materials.size()-1 ];
-      }
-      break;
+  glBindVertexArray( 0 );
 
-    case 'N':			        /* Ns */ 
-      fscanf(file, "%f", &currentMaterial->shininess);
-      /* wavefront shininess is from [0, 1000], so scale for OpenGL */
-      //currentMaterial->shininess /= 1000.0;
-      //currentMaterial->shininess *= 128.0;
-      break;
+  // Free the group buffers.  Those in the cache are freed when it is
+  // unmapped.
 
-    case 'K':
-      switch(buf[1]) {
-	
-      case 'd':
-	fscanf( file, "%f %f %f",
-		&currentMaterial->diffuse[0],
-		&currentMaterial->diffuse[1],
-		&currentMaterial->diffuse[2] );
-	break;
-	
-      case 's':
-	fscanf( file, "%f %f %f",
-		&currentMaterial->specular[0],
-		&currentMaterial->specular[1],
-		&currentMaterial->specular[2] );
-	break;
-	
-      case 'a':
-	fscanf( file, "%f %f %f",
-		&currentMaterial->ambient[0],
-		&currentMaterial->ambient[1],
-		&currentMaterial->ambient[2]);
-	break;
-	
-      default:
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
-	break;
-      }
-      break;
+  for (int i=0; i<groups.size(); i++) {
 
-    case 'm':			/* map_Kd filename */
-      fgets(buf, sizeof(buf), file);
-      sscanf(buf, "%s %s", buf, buf);
+    if (cacheFile == NULL) {
+      delete [] groups[i]->vertexBuffer;
+      delete [] groups[i]->indexBuffer;
+    }
 
-      {
-	// prepend path to the directory of the model file
+    delete [] groups[i]->quantizedBuffer;
 
-	char *dir = new char[ strlen(pathname) ];
-	strcpy( dir, pathname );
+    groups[i]->vertexBuffer = NULL;
+    groups[i]->indexBuffer = NULL;
+    groups[i]->quantizedBuffer = NULL;
+  }
 
-	char *s = strrchr(dir, '/');
-	if (s != NULL) s[1] = '\0'; else dir[0] = '\0';
+  delete cacheFile;
+  cacheFile = NULL;
 
-	char *filename = new char[ strlen(dir) + strlen(buf) + 1 ];
+  // Report the precision lost to quantization
 
-	strcpy(filename, dir);
-	strcat(filename, buf);
+  if (verticesQuantized) {
 
-	// load the texture
+    cout << "Quantized vertices: " << vertexStride() << " bytes each instead of " << vertexSize * sizeof(GLfloat)
+	 << ", max position error " << maxPositionError << " (" << 100 * maxPositionError / radius << "% of radius)";
 
-	currentMaterial->loadTexmap( filename );
-	delete [] dir;
-	delete [] filename;
-      }
+    if (hasVertexNormals)
+      cout << ", max normal error " << acos( minNormalDot > 1 ? 1 : minNormalDot ) * 180 / M_PI << " degrees";
 
-      break;
-      
-    default:
-      /* eat up rest of line */
-      fgets(buf, sizeof(buf), file);
-      break;
-    }
+    cout << endl;
   }
 
-  delete [] dir;
-  delete [] filename;
+  loaded = true;
 }
 
 
-/* read a ppm texture map into the material
- */
-
+// Find the planes of the view frustum of a model-view-projection transformation
 
-void wfMaterial::loadTexmap( char *filename )
+static void frustumPlanes( mat4 &MVP, vec4 planes[6] )
 
 {
-  char *p = strrchr( filename, '.' );
-  if (p == NULL || strcmp( p, ".ppm" ) == 0)
-    texmap = readP6( filename );
-  else if (strcmp( p, ".png" ) == 0)
-    texmap = readPNG( filename );
-  else {
-    cerr << "Cannot read " << filename << ".  Only ppm and png files are handled." << endl;
-    texmap = NULL;
+  for (int i=0; i<3; i++) {
+    planes[2*i]   = MVP[3] + MVP[i];
+    planes[2*i+1] = MVP[3] - MVP[i];
   }
 }
 
 
-wfMaterial* wfModel::findMaterial( char *name )
+// Return true if a box is entirely outside one of the frustum planes.
+// A point p is inside the frustum if plane * (p,1) >= 0 for all
+// planes, since -w <= x,y,z <= w in clip coordinates, so only the box
+// corner farthest along the plane normal is tested.
+
+static bool boxOutsideFrustum( vec3 &min, vec3 &max, vec4 planes[6] )
 
 {
-  int i;
+  for (int i=0; i<6; i++) {
 
-  for (i=0; i<materials.size(); i++)
-    if (strcmp( name, materials[i]->name ) == 0)
-      break;
+    vec4 &p = planes[i];
 
-  if (i < materials.size())
-    return materials[i];
+    float d = p.x * (p.x > 0 ? max.x : min.x)
+            + p.y * (p.y > 0 ? max.y : min.y)
+            + p.z * (p.z > 0 ? max.z : min.z)
+            + p.w;
 
-  cerr << "Error: Can't find material '" << name << "'" << endl;
-  return materials[0];
+    if (d < 0)
+      return true;
+  }
+
+  return false;
 }
 
 
-wfGroup* wfModel::findGroup( char *name )
+// Draw the model, one batch per material, culling groups outside the
+// frustum of MVP if it isn't NULL.  The program's 'Material' uniform
+// block, if it has one, is bound to each batch's material.
+
+void wfModel::draw( GPUProgram * gpuProg, mat4 *MVP )
 
 {
-  int i;
+  drawBatches( gpuProg, MVP, 0 );
+}
 
-  for (i=0; i<groups.size(); i++)
-    if (strcmp( name, groups[i]->name ) == 0)
-      break;
 
-  if (i < groups.size())
-    return groups[i];
+/* Store the transformations of numInstances copies of the model for
+ * drawInstanced().  'columns' has 16 values for each instance: its
+ * transformation, after objToWorldTransform, column by column, as a
+ * mat4 attribute is read.  The transformations are in a per-instance
+ * vertex attribute at INSTANCE_ATTRIB (a mat4, so four locations), so
+ * the shader's M, MV, and MVP should not include objToWorldTransform.
+ */
 
-  // create a new group of this name
+void wfModel::setInstances( GLfloat *columns, int n )
 
-  groups.add( new wfGroup(name) );
-  return groups[ groups.size() - 1 ];
-}
+{
+  numInstances = 0;
 
+  if (!VAOinitialized || n == 0)
+    return;
 
-class VertexSignature {
-public:
-  unsigned int sig[3];
-  bool operator == (const VertexSignature p) {
-    return sig[0] == p.sig[0] && sig[1] == p.sig[1] && sig[2] == p.sig[2];
+  glBindVertexArray( VAO );
+
+  if (instanceBufferID == 0) {
+
+    glGenBuffers( 1, &instanceBufferID );
+    glBindBuffer( GL_ARRAY_BUFFER, instanceBufferID );
+
+    for (int c=0; c<4; c++) {
+      glVertexAttribPointer( INSTANCE_ATTRIB+c, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(GLfloat), (const GLvoid*) (4 * c * sizeof(GLfloat)) );
+      glVertexAttribDivisor( INSTANCE_ATTRIB+c, 1 );
+    }
   }
-};
+  else
+    glBindBuffer( GL_ARRAY_BUFFER, instanceBufferID );
+
+  // The buffer is refilled each frame, so let OpenGL give it new
+  // storage instead of waiting for the last frame's draws to finish
+  // with it
+
+  glBufferData( GL_ARRAY_BUFFER, 16 * n * sizeof(GLfloat), columns, GL_STREAM_DRAW );
 
+  glBindVertexArray( 0 );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
 
+  numInstances = n;
+}
+
+
+/* Draw the copies of the model given to setInstances() with one draw
+ * call per batch.  The instance buffer is in the VAO, so nothing is
+ * uploaded here, and the copies can be drawn in any number of passes.
+ */
 
-void wfModel::setupVAO( TextureMode textureMode )
+void wfModel::drawInstanced( GPUProgram * gpuProg )
 
 {
-  // Note that positions, normals, and texture coordinates can all be
-  // indexed differently in a Wavefront file.  But OpenGL permits only
-  // one index per vertex, and the OpenGL vertex encapsulates all
-  // attributes, including position, normal, and texture coordinates.
-  //
-  // So we have to create *another* array of vertices where each
-  // vertex stores position, normal, and texture coordinates and the
-  // face indices index into this new array.
+  if (numInstances == 0)
+    return;
 
-  unsigned int vertexSize = 3;
+  drawBatches( gpuProg, NULL, numInstances );
+}
 
-  if (hasVertexNormals)
-    vertexSize += 3;
 
-  if (hasVertexTexCoords)
-    vertexSize += 2;
+// Bind a program's Material block to MATERIAL_BINDING and return
+// true, or return false if the program has no Material block (or
+// doesn't use it, so that it was optimized away).  The binding is
+// part of the program's state, so this is looked up and set only the
+// first time a program is seen.
 
-  // Process each group separately
+static seq<GLuint> materialBlockPrograms; /* programs seen */
+static seq<bool>   materialBlockFound;	  /* whether each has the block */
 
-  for (int i=0; i<groups.size(); i++) {
+static bool bindMaterialBlock( GPUProgram *gpuProg )
 
-    wfGroup *thisGroup = groups[i];
+{
+  int i = materialBlockPrograms.findIndex( gpuProg->id() );
 
-    int numTriangles = thisGroup->triangles.size();
+  if (i >= 0)
+    return materialBlockFound[i];
 
-    if (numTriangles > 0) {
-      
-      GLfloat *vertexBuffer = new GLfloat[ numTriangles * 3 * vertexSize ];
-      GLuint *faceIndexBuffer = new GLuint[ numTriangles * 3 ];
+  GLuint blockIndex = glGetUniformBlockIndex( gpuProg->id(), "Material" );
+  bool   found = (blockIndex != GL_INVALID_INDEX);
 
-      unsigned int nVerts = 0;
-      int nFaces = 0;
+  if (found)
+    glUniformBlockBinding( gpuProg->id(), blockIndex, MATERIAL_BINDING );
 
-      VertexSignature *vertSig = new VertexSignature[ numTriangles * 3 ];
+  materialBlockPrograms.add( gpuProg->id() );
+  materialBlockFound.add( found );
 
-      for (int j=0; j<thisGroup->triangles.size(); j++) {
-      
-	wfTriangle *tri = thisGroup->triangles[j];
+  return found;
+}
 
-	for (int k=0; k<3; k++) {
 
-	  // Find an already-stored vertex with this signature (brute force)
+// Draw all batches, culling groups outside the frustum of MVP if it
+// isn't NULL, or draw numInstances copies of all batches if
+// numInstances > 0 (see drawInstanced()).
 
-	  VertexSignature vs;
+void wfModel::drawBatches( GPUProgram * gpuProg, mat4 *MVP, int numInstances )
 
-	  vs.sig[0] = tri->vindices[k];
-	  vs.sig[1] = tri->nindices[k];
-	  vs.sig[2] = tri->tindices[k];
+{
+  if (!VAOinitialized)
+    return;
 
-	  unsigned int l;
-	  for (l=0; l<nVerts; l++)
-	    if (vs == vertSig[l])
-	      break;
+  bool useMaterials = bindMaterialBlock( gpuProg );
 
-	  if (l == nVerts) {	// none found ... create a new vertex
-	    * (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ tri->vindices[k] ];
-	    if (hasVertexNormals)
-	      * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ tri->nindices[k] ];
-	    if (hasVertexTexCoords) {
-	      if (hasVertexNormals)
-		* (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ tri->tindices[k] ];
-	      else
-		* (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ tri->tindices[k] ];
-	    }
-	  
-	    vertSig[ nVerts ] = vs;
+  gpuProg->setInt( "objTexture", 0 );
+  gpuProg->setInt( "octahedralNormals", verticesQuantized && hasVertexNormals );
+  glActiveTexture( GL_TEXTURE0 );
 
-	    nVerts++;
-	  }
+  GLuint boundTexture = 0;
 
-	  // Store this vertex index
+  vec4 planes[6];
 
-	  faceIndexBuffer[ nFaces * 3 + k ] = l;
-	}
+  if (MVP != NULL)
+    findFrustumPlanes( *MVP, planes );
 
-	nFaces++;
-      }
+  numGroupsDrawn = numGroupsCulled = 0;
 
-      // Set up the VAO
+  glBindVertexArray( VAO );
 
-      glGenVertexArrays( 1, &thisGroup->VAO );
-      glBindVertexArray( thisGroup->VAO );
+  // Use the per-instance transformations only for instanced drawing.
+  // Otherwise the attribute is constant and is the identity.
 
-      GLuint bufferIDs[2];
-      glGenBuffers( 2, bufferIDs );
+  for (int c=0; c<4; c++)
+    if (numInstances > 0)
+      glEnableVertexAttribArray( INSTANCE_ATTRIB+c );
+    else {
+      glDisableVertexAttribArray( INSTANCE_ATTRIB+c );
+      glVertexAttrib4f( INSTANCE_ATTRIB+c, c == 0, c == 1, c == 2, c == 3 );
+    }
 
-      // store faces
+  for (int i=0; i<batches.size(); i++) {
 
-      glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, bufferIDs[0] );
-      glBufferData( GL_ELEMENT_ARRAY_BUFFER, nFaces * 3 * sizeof(GLuint), faceIndexBuffer, GL_STATIC_DRAW );
+    wfBatch &batch = batches[i];
 
-      // store vertices
+    // Set up material properties
 
-      glBindBuffer( GL_ARRAY_BUFFER, bufferIDs[1] );
-      glBufferData( GL_ARRAY_BUFFER, nVerts * vertexSize * sizeof(GLfloat), vertexBuffer, GL_STATIC_DRAW );
+    if (useMaterials)
+      glBindBufferRange( GL_UNIFORM_BUFFER, MATERIAL_BINDING, materialBuffer,
+			 batch.materialIndex * materialStride, sizeof(MaterialBlock) );
 
-      // define attributes
+    if (batch.material->texture != NULL && batch.material->texture->textureID != boundTexture) {
+      glBindTexture( GL_TEXTURE_2D, batch.material->texture->textureID );
+      boundTexture = batch.material->texture->textureID;
+    }
 
-      int attribIndex = 0;
-      unsigned long int accumulatedOffset = 0;
+    // Render
 
-      // position = attribute 0
+    if (numInstances > 0) {
+      glDrawElementsInstanced( GL_TRIANGLES, batch.numIndices[lod], GL_UNSIGNED_INT, (const GLvoid*) (batch.firstIndex[lod] * sizeof(GLuint)), numInstances );
+      numGroupsDrawn += batch.numGroups;
+      continue;
+    }
 
-      glEnableVertexAttribArray( attribIndex );
-      glVertexAttribPointer( attribIndex, 3, GL_FLOAT, GL_FALSE, vertexSize * sizeof(GLfloat), (const GLvoid*) accumulatedOffset );
-      attribIndex++;
-      accumulatedOffset += 3 * sizeof( float );
+    if (MVP == NULL) {
+      glDrawElements( GL_TRIANGLES, batch.numIndices[lod], GL_UNSIGNED_INT, (const GLvoid*) (batch.firstIndex[lod] * sizeof(GLuint)) );
+      numGroupsDrawn += batch.numGroups;
+      continue;
+    }
 
-      // normals?
+    // Draw only the groups in the frustum.  Consecutive visible
+    // groups are adjacent in the index buffer, so are drawn together.
 
-      if (hasVertexNormals) {
-	glEnableVertexAttribArray( attribIndex );
-	glVertexAttribPointer( attribIndex, 3, GL_FLOAT, GL_FALSE, vertexSize * sizeof(GLfloat), (const GLvoid*) accumulatedOffset );
-	attribIndex++;
-	accumulatedOffset += 3 * sizeof( float );
-      }
+    int first = 0, count = 0;
 
-      // texture coordinates?
+    for (int j=0; j<batch.numGroups; j++) {
 
-      if (hasVertexTexCoords) {
-	glEnableVertexAttribArray( attribIndex );
-	glVertexAttribPointer( attribIndex, 2, GL_FLOAT, GL_FALSE, vertexSize * sizeof(GLfloat), (const GLvoid*) accumulatedOffset );
-	attribIndex++;
-	accumulatedOffset += 2 * sizeof( float );
-      }
+      wfGroup *group = drawOrder[ batch.firstGroup + j ];
 
-      thisGroup->VAOinitialized = true;
+      if (boxOutsideFrustum( group->min, group->max, planes )) {
+	numGroupsCulled++;
+	continue;
+      }
 
-      delete [] vertexBuffer;
-      delete [] faceIndexBuffer;
-      delete [] vertSig;
+      numGroupsDrawn++;
 
-      glBindVertexArray( 0 );
+      if (count > 0 && first + count == group->firstIndex[lod])
+	count += group->lodIndices( lod );
+      else {
+	if (count > 0)
+	  glDrawElements( GL_TRIANGLES, count, GL_UNSIGNED_INT, (const GLvoid*) (first * sizeof(GLuint)) );
+	first = group->firstIndex[lod];
+	count = group->lodIndices( lod );
+      }
     }
+
+    if (count > 0)
+      glDrawElements( GL_TRIANGLES, count, GL_UNSIGNED_INT, (const GLvoid*) (first * sizeof(GLuint)) );
   }
 
-  initTextures( textureMode );
+  glBindVertexArray( 0 );
 }
 
 
-void wfModel::draw( GPUProgram * gpuProg )
-
-{
-  for (int i=0; i<groups.size(); i++)
-    if (groups[i]->VAOinitialized) {
-
-      // Set up material properties
+// Find the frustum planes in model coordinates, in which the group
+// bounding boxes are.  MVP transforms the vertex buffer positions,
+// which are in [0,1]^3 if they're quantized.
 
-      groups[i]->material->setMaterial( true, true, gpuProg );
+void wfModel::findFrustumPlanes( mat4 &MVP, vec4 planes[6] )
 
-      // Render
+{
+  mat4 T = MVP;
 
-      glBindVertexArray( groups[i]->VAO );
-      glDrawElements( GL_TRIANGLES, 3 * groups[i]->triangles.size(), GL_UNSIGNED_INT, 0 );
-      glBindVertexArray( 0 );
+  if (verticesQuantized)
+    T = T * scale( 1/quantizedSize, 1/quantizedSize, 1/quantizedSize ) * translate( -1 * min );
 
-      groups[i]->material->unsetMaterial( true, true, gpuProg );
-    }
+  frustumPlanes( T, planes );
 }
 
 
-void wfMaterial::setMaterial( bool useTextures, bool useMaterial, GPUProgram * gpuProg )
+// Return true if the whole model is outside the frustum of MVP, which
+// is as for draw()
+
+bool wfModel::outsideFrustum( mat4 &MVP )
 
 {
-  if (useMaterial) {
-    gpuProg->setVec3( "kd", vec3( &diffuse[0] ) );
-    gpuProg->setVec3( "ks", vec3( &specular[0] ) );
-    gpuProg->setVec3( "Ia", vec3( &ambient[0] ) );
-    gpuProg->setVec3( "Ie", vec3( &emissive[0] ) );
-    gpuProg->setFloat( "shininess", shininess );
-  } else {
-    gpuProg->setVec3( "kd", vec3(1,1,1) );
-    gpuProg->setVec3( "ks", vec3(0,0,0) );
-    gpuProg->setVec3( "Ia", vec3(0,0,0) );
-    gpuProg->setVec3( "Ie", vec3(0,0,0) );
-    gpuProg->setFloat( "shininess", 400 );
-  }
-
-  if (useTextures && texmap != NULL) {
-    glActiveTexture( GL_TEXTURE0 );
-    glBindTexture( GL_TEXTURE_2D, textureID );
-    gpuProg->setInt( "objTexture", 0 );
-    gpuProg->setInt( "texturing", 1 );
-  } else
-    gpuProg->setInt( "texturing", 0 );
+  vec4 planes[6];
 
+  findFrustumPlanes( MVP, planes );
+
+  return boxOutsideFrustum( min, max, planes );
 }
 
 
-void wfMaterial::unsetMaterial( bool useTextures, bool useMaterial, GPUProgram * gpuProg )
+// Build a BVH over the full level of detail of all groups, for
+// raycast().  This runs after the groups are built (in the loader
+// thread, while they're being sent to OpenGL), from each group's
+// vertexBuffer and indexBuffer, so the BVH's triangles are numbered
+// as in the index buffers.
 
-{
-  return;
+void wfModel::buildRaycastBVH()
 
-  if (useTextures && texmap != NULL) {
+{
+  bvhGroupStart.resize( groups.size() + 1 );
 
-    // Free texture unit 0
+  int numTriangles = 0;
 
-    glActiveTexture( GL_TEXTURE0 );
-    glBindTexture( GL_TEXTURE_2D, 0 );
+  for (int i=0; i<groups.size(); i++) {
+    bvhGroupStart[i] = numTriangles;
+    numTriangles += groups[i]->lodNumIndices[0] / 3;
   }
 
-  gpuProg->setInt( "texturing", 0 );
+  bvhGroupStart[ groups.size() ] = numTriangles;
 
-  glDisable(GL_BLEND);
+  vec3 *triangles = new vec3[ 3 * numTriangles ];
+
+  parallelForBlocks( groups.size(), [&]( int i ) {
+    wfGroup *group = groups[i];
+    vec3 *out = &triangles[ 3 * bvhGroupStart[i] ];
+    for (int j=0; j<group->lodNumIndices[0]; j++)
+      out[j] = vec3( &group->vertexBuffer[ group->indexBuffer[j] * vertexSize ] );
+  } );
+
+  bvh = new BVH( triangles, numTriangles );
+
+  delete [] triangles;
+
+  char buffer[1000];
+  sprintf( buffer, "Raycasting BVH: %d triangles, %d nodes, depth %d, built in %.3f s, %.2f MB",
+	   bvh->numTriangles, bvh->numNodes, bvh->depth, bvh->buildSeconds, bvh->bytes() / (1024.0 * 1024.0) );
+  cout << buffer << endl;
 }
 
 
-void wfMaterial::storeTexture( TextureMode textureMode )
+// Find the nearest triangle hit by the ray origin + t dir, t >= 0, in
+// model coordinates (i.e. before objToWorldTransform, so the same as
+// modelTransform transforms).  Returns false if nothing is hit, or
+// if there's no BVH or the model isn't loaded yet.
+
+bool wfModel::raycast( vec3 origin, vec3 dir, wfHit &hit )
 
 {
-  // Register it with OpenGL
+  if (!loaded || bvh == NULL) // bvh may still be being built until loaded
+    return false;
 
-  glActiveTexture( GL_TEXTURE0 );
-  glBindTexture( GL_TEXTURE_2D, textureID );
+  BVHHit h;
+
+  if (!bvh->raycast( origin, dir, h ))
+    return false;
 
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+  // Find the last group that starts at or before the triangle (empty
+  // groups start where the next one does)
 
-  glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+  int lo = 0, hi = groups.size()-1;
 
-  // set texture lookup mode
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (bvhGroupStart[mid] <= h.triangle)
+      lo = mid;
+    else
+      hi = mid-1;
+  }
 
-  if (textureMode == NEAREST) {
-    
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-    
-  } else if (textureMode == LINEAR) {
-    
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-    
-  } else if (textureMode == MIPMAP_NEAREST) {
-    
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST );
-    
-  } else if (textureMode == MIPMAP_LINEAR) {
-    
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+  hit.group = groups[lo];
+  hit.triangle = h.triangle - bvhGroupStart[lo];
+  hit.t = h.t;
+  hit.u = h.u;
+  hit.v = h.v;
 
-  } else {
+  return true;
+}
 
-    cerr << "Unknown texture mode: " << textureMode << endl; 
-    exit(1);
-  }
 
-  // Store the texture
+/* Initialize the textures by storing each with OpenGL.  A texture
+ * shared by several materials, or already stored for another model,
+ * is sent to OpenGL only once.
+ */
 
-  glTexImage2D( GL_TEXTURE_2D, 0, (hasAlpha ? GL_RGBA : GL_RGB), width, height, 0,
-		(hasAlpha ? GL_RGBA : GL_RGB), GL_UNSIGNED_BYTE, texmap );
 
-  // Build mipmaps
+void wfModel::initTextures( TextureMode textureMode )
 
-  glGenerateMipmap( GL_TEXTURE_2D );
+{
+  for (int i=0; i<materials.size(); i++) {
+    wfTexture *texture = materials[i]->texture;
+    if (texture != NULL && texture->store( textureMode )) {
+      char *name = strrchr( texture->path, '/' );
+      cout << "Texture " << (name != NULL ? name+1 : texture->path) << ": "
+	   << texture->width << "x" << texture->height << ", decoded in "
+	   << (int) (1000 * texture->decodeSeconds + 0.5) << " ms, uploaded in "
+	   << (int) (1000 * texture->uploadSeconds + 0.5) << " ms" << endl;
+    }
+  }
 }
 
 
-/* Initialize the textures by assigning each an OpenGL ID and storing
- * each with OpenGL.
+/* Read the images of all texture maps in parallel, one image per
+ * task.  An image used by several materials, or already read for
+ * another model, is read only once.  Materials whose image can't be
+ * read are left untextured.
  */
 
 
-void wfModel::initTextures( TextureMode textureMode )
+void wfModel::decodeTextures()
 
 {
-  // Assign IDs to any textures without IDs
+  seq<wfTexture*> textures;
 
-  for (int i=0; i<groups.size(); i++)
-    if (groups[i]->material->texmap != NULL && groups[i]->material->textureID == 0) {
-      glGenTextures(1, &(groups[i]->material->textureID) );
-    }
+  for (int i=0; i<materials.size(); i++)
+    if (materials[i]->texture != NULL && textures.findIndex( materials[i]->texture ) == -1)
+      textures.add( materials[i]->texture );
 
-  // Store the textures
+  if (textures.size() == 0)
+    return;
 
-  for (int i=0; i<groups.size(); i++)
-    if (groups[i]->material->texmap != NULL)
-      groups[i]->material->storeTexture( textureMode );
-}
+  struct timeb startTime, endTime;
+  ftime( &startTime );
 
+  parallelForBlocks( textures.size(), [&]( int i ) {
+    textures[i]->decode();
+  } );
 
+  ftime( &endTime );
+
+  for (int i=0; i<materials.size(); i++)
+    if (materials[i]->texture != NULL && materials[i]->texture->readFailed) { // couldn't be read
+      releaseTexture( materials[i]->texture );
+      materials[i]->texture = NULL;
+    }
+
+  cout << "Textures: " << textures.size() << " images decoded in "
+       << (endTime.time + endTime.millitm / 1000.0) - (startTime.time + startTime.millitm / 1000.0)
+       << " s" << endl;
+}
 
-/* Read a texture from a P6 PPM file
- */
 
+// Bytes allocated for a sequence, and how many of them are unused
 
-unsigned char *wfMaterial::readP6( char *filename )
+template <class T> static long long seqBytes( const seq<T> &s, long long &unused )
 
 {
-  char buffer[1000];
-  int i, xdim, ydim;
-  unsigned char *a, *b, *pa, *pb;
+  unused += (long long) (s.capacity() - s.size()) * sizeof(T);
+  return (long long) s.capacity() * sizeof(T);
+}
 
-  FILE *f = fopen( filename, "r" );
 
-  if (!f) {
-    cerr << "Open of `" << filename << "' failed.\n";
-    exit(1);
-  }
+/* Free everything that was needed only to build the model's OpenGL
+ * buffers: the vertex attributes and facet normals read from the
+ * file, each group's triangle indices, and the texture images, which
+ * OpenGL has its own copies of.  The model can still be drawn, but
+ * nothing that needs its triangles can be done afterward.
+ *
+ * This must be called on the OpenGL thread after loading is finished.
+ */
 
-  // first line
 
-  do {
-    i = 0;
-    do 
-      fread(&buffer[i],1,1,f);
-    while (buffer[i++] != '\n');
-  } while (buffer[0] == '#');
+void wfModel::releaseCPUData()
 
-  if (strncmp( buffer, "P6", 2 ) != 0) {
-    cerr << filename << " is not a P6 file.\n";
-    exit(1);
+{
+  if (!loaded) {
+    cerr << "wfModel::releaseCPUData() called before the model is loaded" << endl;
+    return;
   }
 
-  // second line
+  long long unused = 0;
+
+  cpuBytesReleased = seqBytes( vertices, unused ) + seqBytes( normals, unused )
+                   + seqBytes( texcoords, unused ) + seqBytes( facetnorms, unused );
 
-  do {
-    i = 0;
-    do 
-      fread(&buffer[i],1,1,f);
-    while (buffer[i++] != '\n');
-  } while (buffer[0] == '#');
-  buffer[i] = '\0';
-  sscanf( buffer, "%d %d", &xdim, &ydim );
+  for (int i=0; i<groups.size(); i++)
+    cpuBytesReleased += seqBytes( groups[i]->vindices, unused ) + seqBytes( groups[i]->nindices, unused )
+                      + seqBytes( groups[i]->tindices, unused ) + seqBytes( groups[i]->findex, unused );
 
-  width = xdim;
-  height = ydim;
+  for (int i=0; i<materials.size(); i++)
+    if (materials[i]->texture != NULL)
+      cpuBytesReleased += materials[i]->texture->cpuBytes();
 
-  // third line
+  vertices.clear();
+  normals.clear();
+  texcoords.clear();
+  facetnorms.clear();
 
-  do {
-    i = 0;
-    do 
-      fread(&buffer[i],1,1,f);
-    while (buffer[i++] != '\n');
-  } while (buffer[0] == '#');
-  if (strncmp( buffer, "255", 3 ) != 0) {
-    cerr << filename << " is not a 24-bit file.\n";
-    exit(1);
+  for (int i=0; i<groups.size(); i++) {
+    groups[i]->vindices.clear();
+    groups[i]->nindices.clear();
+    groups[i]->tindices.clear();
+    groups[i]->findex.clear();
   }
 
-  // read the data (stored top-to-bottom, left-to-right)
+  for (int i=0; i<materials.size(); i++)
+    if (materials[i]->texture != NULL)
+      materials[i]->texture->releaseImage();
 
-  a = new unsigned char[ xdim * ydim * 3 ];
-  fread( a, xdim*ydim*3, 1, f );
+  cpuDataReleased = true;
+}
 
-  // flip the image vertically (stored bottom-to-top, left-to-right)
 
-  b = new unsigned char[ xdim * ydim * 3 ];
+static void printBytes( const char *label, long long bytes )
 
-  for (int i=0; i<ydim; i++) {
-    pa = a + (i)*xdim*3;
-    pb = b + (ydim-1-i)*xdim*3;
-    for (int j=0; j<xdim*3; j++)
-      *(pb++) = *(pa++);
-  }
+{
+  char buffer[100];
+  sprintf( buffer, "  %-24s %10.2f MB", label, bytes / (1024.0 * 1024.0) );
+  cout << buffer << endl;
+}
 
-  delete [] a;
 
-  hasAlpha = false;
+// The textures used by the model, each once
 
-  fclose(f);
-  return b;
+void wfModel::findTextures( seq<wfTexture*> &textures )
+
+{
+  for (int i=0; i<materials.size(); i++)
+    if (materials[i]->texture != NULL && textures.findIndex( materials[i]->texture ) == -1)
+      textures.add( materials[i]->texture );
 }
 
 
+// Bytes in the model's OpenGL buffers
 
-// Read a PNG file.  Most of this code is taken from example.c, which
-// is provided with the libpng distribution.
+long long wfModel::gpuBufferBytes()
 
+{
+  if (!VAOinitialized)
+    return 0;
 
-#ifndef png_jmpbuf
-#  define png_jmpbuf(png_ptr) ((png_ptr)->jmpbuf)
-#endif
+  return vertexCapacity + indexCapacity + materials.size() * materialStride;
+}
 
 
-#define PNG_BYTES_TO_CHECK 8
+// Bytes the model holds in OpenGL, including its textures, even if
+// another model shares them
 
-unsigned char *wfMaterial::readPNG( char *filename )
+long long wfModel::gpuBytes()
 
 {
-  unsigned char *b;
-
-#ifndef HAVE_PNG
-  cerr << "Trying to read PNG file \"" << filename << "\", but the program wasn't compiled with -DHAVE_PNG." << endl;
-  exit(-1);
-  return b;
-#else
-
-  png_structp png_ptr;
-  png_infop info_ptr;
-  unsigned int sig_read = 0;
-  int bit_depth, color_type, interlace_type;
-  char header[PNG_BYTES_TO_CHECK];
-  
-  // Open file
-
-  FILE *fp = fopen(filename, "rb");
-  if (!fp) {
-    cerr << "Can't open PNG texture file '" << filename << "'." << endl;
-    exit(-1);
-  }
-
-  // Check header
-
-  fread( header, 1, PNG_BYTES_TO_CHECK, fp );
-  bool is_png = !png_sig_cmp( (png_byte*) &header[0], 0, PNG_BYTES_TO_CHECK);
-  if (!is_png) {
-    cerr << "Texture file '" << filename << "' is not in PNG format." << endl;
-    exit(-1);
-  }
+  seq<wfTexture*> textures;
 
-  /* Create and initialize the png_struct with the desired error handler
-   * functions.  If you want to use the default stderr and longjump method,
-   * you can supply NULL for the last three parameters.  We also supply the
-   * the compiler header file version, so that we know if the application
-   * was compiled with a compatible version of the library.  REQUIRED
-   */
+  findTextures( textures );
 
-  png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+  long long bytes = gpuBufferBytes();
 
-  if (png_ptr == NULL) {
-    cerr << "Can't initialize PNG file for reading: " << filename << endl;
-    fclose(fp);
-    exit(-1);
-  }
+  for (int i=0; i<textures.size(); i++)
+    bytes += textures[i]->gpuBytes();
 
-  /* Allocate/initialize the memory for image information.  REQUIRED. */
+  return bytes;
+}
 
-  info_ptr = png_create_info_struct(png_ptr);
-  if (info_ptr == NULL)
-    {
-      fclose(fp);
-      png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-      cerr << "Can't allocate memory to read PNG file: " << filename << endl;
-      exit(-1);
-    }
 
-  /* Set error handling if you are using the setjmp/longjmp method (this is
-   * the normal method of doing things with libpng).  REQUIRED unless you
-   * set up your own error handlers in the png_create_read_struct() earlier.
-   */
-
-  if (setjmp(png_jmpbuf(png_ptr))) {
-    /* Free all of the memory associated with the png_ptr and info_ptr */
-    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-    fclose(fp);
-    /* If we get here, we had a problem reading the file */
-    cerr << "Exception occurred while reading PNG file: " << filename << endl;
-    exit(-1);
-  }
+/* Report the memory held by the model on the CPU and in OpenGL.
+ * Textures may be shared with other models, in which case they are
+ * counted for each model.
+ */
 
-  /* Set up the input control if you are using standard C streams */
+void wfModel::memoryReport()
 
-  png_init_io(png_ptr, fp);
+{
+  long long unused = 0;
 
-  /* If we have already read some of the signature */
+  long long vertexBytes = seqBytes( vertices, unused ) + seqBytes( normals, unused ) + seqBytes( texcoords, unused );
+  long long facetBytes  = seqBytes( facetnorms, unused );
 
-  png_set_sig_bytes(png_ptr, PNG_BYTES_TO_CHECK);
+  long long indexBytes = 0;
+  long long groupBufferBytes = 0;
 
-  // Warning: the following does NOT convert grey to RGB:
+  for (int i=0; i<groups.size(); i++) {
 
-  png_read_png( png_ptr, info_ptr, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND, NULL );
+    wfGroup *group = groups[i];
 
-  
-  // Store in texmap
-  
-  int numChannels = png_get_channels(png_ptr, info_ptr);
+    indexBytes += seqBytes( group->vindices, unused ) + seqBytes( group->nindices, unused )
+                + seqBytes( group->tindices, unused ) + seqBytes( group->findex, unused );
 
-  if (png_get_bit_depth(png_ptr, info_ptr) != 8) {
-    cerr << "Can't handle PNG files with bit depth other than 8.  '" << filename
-	 << "' has " << png_get_bit_depth(png_ptr, info_ptr) << " bits per pixel." << endl;
-    exit(-1);
+    if (group->vertexBuffer != NULL && cacheFile == NULL)
+      groupBufferBytes += (long long) group->numVertices * vertexSize * sizeof(GLfloat);
+    if (group->indexBuffer != NULL && cacheFile == NULL)
+      groupBufferBytes += (long long) group->numIndices * sizeof(GLuint);
+    if (group->quantizedBuffer != NULL)
+      groupBufferBytes += (long long) group->numVertices * vertexStride();
   }
 
+  long long cacheBytes = (cacheFile != NULL ? cacheFile->size() : 0);
 
-  width = png_get_image_width(png_ptr,info_ptr);
-  height = png_get_image_height(png_ptr,info_ptr);
+  seq<wfTexture*> textures;
 
-  int imageSize;
+  findTextures( textures );
 
-  if (numChannels == 4)
-    imageSize = 4 * width * height;
-  else
-    imageSize = 3 * width * height;
-
-  b = pb = new unsigned char[ imageSize ];
-
-  for (int r=(int)info_ptr->height - 1; r >= 0; r--) {
-    png_bytep row = info_ptr->row_pointers[r];
-    int rowbytes = png_get_rowbytes(png_ptr, info_ptr);
-    for (int c=0; c < rowbytes; c++)
-      switch (numChannels) {
-      case 1:
-	*(pb)++ = row[c];
-	*(pb)++ = row[c];
-	*(pb)++ = row[c];
-	break;
-      case 2:
-	cerr << "Can't handle a two-channel PNG file: " << filename << endl;
-	exit(-1);
-	break;
-      case 3:
-      case 4:
-	*(pb)++ = row[c];
-	break;
-      }
+  long long cpuTextureBytes = 0;
+  long long gpuTextureBytes = 0;
+
+  for (int i=0; i<textures.size(); i++) {
+    cpuTextureBytes += textures[i]->cpuBytes();
+    gpuTextureBytes += textures[i]->gpuBytes();
   }
 
-  hasAlpha = (numChannels == 4);
+  long long bufferBytes = gpuBufferBytes();
 
-  // Clean up PNG stuff
+  long long bvhBytes = (bvh != NULL ? bvh->bytes() : 0);
 
-  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-  fclose(fp);
+  cout << "Memory used by " << (pathname != NULL ? pathname : "model")
+       << (cpuDataReleased ? " (CPU data released)" : "") << ":" << endl;
 
-  return b;
-#endif
-}
+  printBytes( "vertex attributes", vertexBytes );
+  printBytes( "facet normals", facetBytes );
+  printBytes( "triangle indices", indexBytes );
+  printBytes( "  spare capacity", unused );
+  printBytes( "group buffers", groupBufferBytes );
+  printBytes( "mesh cache (mapped)", cacheBytes );
+  printBytes( "texture images", cpuTextureBytes );
+  printBytes( "raycasting BVH", bvhBytes );
+  printBytes( "CPU total", vertexBytes + facetBytes + indexBytes + groupBufferBytes + cacheBytes + cpuTextureBytes + bvhBytes );
+  printBytes( "OpenGL buffers", bufferBytes );
+  printBytes( "OpenGL textures", gpuTextureBytes );
+  printBytes( "OpenGL total", bufferBytes + gpuTextureBytes );
 
+  if (cpuDataReleased)
+    printBytes( "released (not in totals)", cpuBytesReleased );
+}
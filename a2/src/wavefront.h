@@ -15,21 +15,25 @@
 #include "shadeMode.h"
 #include "gpuProgram.h"
 #include "linalg.h"
+#include "textureCache.h"
+#include "bvh.h"
 
+#include <thread>
+#include <mutex>
+#include <atomic>
 
-/* A material with lighting properties and perhaps a texture map
- */
+
+#define MAX_LODS 4		/* most levels of detail per model, including the full model */
+#define INSTANCE_ATTRIB 3	/* first of the four attribute locations of the per-instance mat4 */
 
 
-enum { NEAREST, LINEAR, MIPMAP_NEAREST, MIPMAP_LINEAR };
-typedef int TextureMode;
+/* A material with lighting properties and perhaps a texture map.
+ * Texture maps are shared between materials (see textureCache.h).
+ */
 
 
 class wfMaterial {
 
-  unsigned char *readP6( char *filename ); /* read a P6 PPM file */
-  unsigned char *readPNG( char *filename ); /* read a P6 PPM file */
-
   static unsigned char defaultTexmap[];
 
  public:
@@ -40,10 +44,8 @@ class wfMaterial {
   GLfloat emissive[4];		/* emmissive component */
   GLfloat shininess;		/* specular exponent */
 
-  GLubyte *texmap;		/* texture map */
-  unsigned int width, height;   /* texmap dimensions */
-  GLuint  textureID;		/* the OpenGL ID for this texture */
-  bool    hasAlpha;		/* texmap has alpha component */
+  wfTexture *texture;		/* texture map, or NULL */
+  char    *texmapFilename;	/* file from which texture was read, or NULL */
 
   wfMaterial() {}
 
@@ -56,70 +58,97 @@ class wfMaterial {
     specular[0] = 0.3; specular[1] = 0.3; specular[2] = 0.3; specular[3] = 1.0;
     emissive[0] = 0.0; emissive[1] = 0.0; emissive[2] = 0.0; emissive[3] = 1.0;
     shininess = 200;
-    texmap = NULL;
-    textureID = 0;
-    width = height = 0;
+    texture = NULL;
+    texmapFilename = NULL;
   }
 
   ~wfMaterial() {
     delete [] name;
+    free( texmapFilename );
+    if (texture != NULL)
+      releaseTexture( texture );
   }
 
-  void loadTexmap( char *filename );   /* read a ppm texture map */
-  void storeTexture( TextureMode tm ); /* record texture with OpenGL */
-  void setMaterial( bool useTex, bool useMat, GPUProgram * gpuProg ); /* set the current OpenGL context */
-  void unsetMaterial( bool useTextures, bool useMaterial, GPUProgram * gpuProg );
-};
-
-
-/* A triangle with vertices, vertex normals, texture coordinates, and
- * a face normal
- */
-
-
-class wfTriangle {
- public:
-  GLuint vindices[3];		/* array of triangle vertex indices */
-  GLuint nindices[3];		/* array of triangle normal indices */
-  GLuint tindices[3];		/* array of triangle texcoord indices*/
-  GLuint findex;		/* index of triangle facet normal */
+  void loadTexmap( char *filename );   /* read a ppm, pgm, or png texture map */
 };
 
 
 /* A group of triangles sharing the same material
+ *
+ * The triangles are stored as flat arrays of indices.  Triangle i has
+ * vertices vindices[3i..3i+2], with normals nindices[3i..3i+2] and
+ * texture coordinates tindices[3i..3i+2] (which are 0 if the file
+ * doesn't provide them), and facet normal findex[i].
  */
 
 
 class wfGroup {
  public:
   char             *name;	/* name of this group */
-  seq<wfTriangle*> triangles;	/* triangles of this group */
+  seq<GLuint>      vindices;	/* triangle vertex indices */
+  seq<GLuint>      nindices;	/* triangle normal indices */
+  seq<GLuint>      tindices;	/* triangle texcoord indices */
+  seq<GLuint>      findex;	/* triangle facet normal indices */
   wfMaterial       *material;	/* material for group */
-  GLuint           VAO;
-  bool             VAOinitialized;
+
+  GLfloat *vertexBuffer;	/* interleaved vertex attributes (until sent to OpenGL) */
+  GLubyte *quantizedBuffer;	/* vertexBuffer in the format of quantize.h, if quantizing */
+  GLuint  *indexBuffer;		/* three vertices per triangle (until sent to OpenGL) */
+  int      numVertices;
+  int      numIndices;		/* in indexBuffer, for all levels of detail */
+  int      numLODs;		/* levels of detail, stored one after another in indexBuffer */
+  int      lodNumIndices[MAX_LODS]; /* indices in each level of detail */
+  int      firstIndex[MAX_LODS]; /* start of each level in the model's OpenGL index buffer */
+  vec3     min, max;		/* bounding box, in model coordinates */
 
   wfGroup() {}
 
   wfGroup( char *gname ) {
     name = new char[ strlen(gname)+1 ];
     strcpy( name, gname );
-    VAOinitialized = false;
+    vertexBuffer = NULL;
+    quantizedBuffer = NULL;
+    indexBuffer = NULL;
+    numVertices = numIndices = 0;
+    numLODs = 1;
+    lodNumIndices[0] = 0;
   }
 
   ~wfGroup() {
     delete [] name;
   }
 
+  int numTriangles() const {
+    return vindices.size() / 3;
+  }
+
+  int lodIndices( int lod ) const { /* indices drawn for a level of detail of the model */
+    return lodNumIndices[ lod < numLODs ? lod : numLODs-1 ];
+  }
+
+  int lodStart( int lod ) const { /* start of a level of detail in indexBuffer */
+    int start = 0;
+    for (int i=0; i<lod; i++)
+      start += lodNumIndices[i];
+    return start;
+  }
+
   wfGroup( const wfGroup & source ) { // copy constructor
     name = strdup(source.name);
-    triangles = source.triangles;
+    vindices = source.vindices;
+    nindices = source.nindices;
+    tindices = source.tindices;
+    findex = source.findex;
     material = source.material;
   }
 
   wfGroup const &operator=( wfGroup const &src ) { // assignment operator
     if (this != &src) {
       name = strdup(src.name);
-      triangles = src.triangles;
+      vindices = src.vindices;
+      nindices = src.nindices;
+      tindices = src.tindices;
+      findex = src.findex;
       material = src.material;
     }
     return *this;
@@ -127,10 +156,93 @@ class wfGroup {
 };
 
 
+/* A triangle found by wfModel::raycast().  The triangle is the
+ * index of its three vertices in the group's indexBuffer (and is in
+ * the full level of detail).
+ */
+
+
+class wfHit {
+ public:
+  wfGroup *group;
+  int      triangle;		/* within the group */
+  float    t;			/* hit point is origin + t * dir */
+  float    u, v;		/* barycentric coordinates of the hit point (see BVHHit) */
+};
+
+
+/* A range of the model's index buffer that is drawn with one
+ * material.  All groups with the same material are contiguous in the
+ * index buffer, so are drawn together.  There is one such range for
+ * each level of detail.  The batch's groups are, in index buffer
+ * order, drawOrder[firstGroup..firstGroup+numGroups-1] of the model.
+ */
+
+
+class wfBatch {
+ public:
+  wfMaterial *material;
+  int         materialIndex;	/* index in the material uniform buffer */
+  int         firstIndex[MAX_LODS]; /* for each level of detail */
+  int         numIndices[MAX_LODS];
+  int         firstGroup;	/* in the model's drawOrder */
+  int         numGroups;
+};
+
+
 /* A model consisting of groups
+ *
+ * All groups share one OpenGL vertex buffer and one index buffer, and
+ * are drawn in batches of the same material.  The material parameters
+ * are in a uniform buffer, so a shader with a 'Material' uniform block
+ * (see pass1.vert) gets the parameters of each batch without any
+ * glUniform calls.
+ *
+ * If quantizeVertices is true, the vertices are sent to OpenGL in the
+ * compact format of quantize.h.  The positions are then relative to
+ * the model's bounding cube, and the objToWorldTransform includes the
+ * transformation back to model coordinates.
+ *
+ * If generateLODs is true, each group gets up to MAX_LODS-1 simplified
+ * levels of detail, each with about a quarter of the triangles of the
+ * one before.  They use the same vertices as the full model and are
+ * in the same index buffer, so changing 'lod' costs nothing.
+ *
+ * If generateNormals is true and the file has no vertex normals,
+ * smooth normals are built from the facet normals, split at edges
+ * sharper than creaseAngle (see buildVertexNormals()).
+ *
+ * If useMeshCache is true, the model's OpenGL vertex and index
+ * buffers are saved in a cache file next to the .obj file (e.g.
+ * teapot.obj.cache).  Later loads of an unchanged .obj file read the
+ * buffers directly from the cache, skipping the parsing and welding.
+ *
+ * If draw() is given the model-view-projection transformation, groups
+ * whose bounding boxes are outside the view frustum aren't drawn.
+ * The numbers of groups drawn and culled are in numGroupsDrawn and
+ * numGroupsCulled.
+ *
+ * If buildRaycastBVHs is true, a BVH over the triangles is built
+ * after the groups, so that raycast() can find the triangle that a
+ * ray hits (e.g. the one under the mouse).
+ *
+ * drawInstanced() draws many copies of the model, each with its own
+ * transformation, with one draw call per batch (see scene.h).  The
+ * transformations are given once per frame to setInstances().
+ *
+ * A model can be loaded in the background: startLoading() reads and
+ * builds the model in another thread, while continueLoading(), which
+ * must be called on the OpenGL thread, sends each group to OpenGL as
+ * soon as it is built.  The groups that have been sent can be drawn
+ * meanwhile.  The wfModel( filename, textureMode ) constructor does
+ * the same thing, but without another thread and without returning
+ * until the model is loaded.
  */
 
 
+class MappedFile;
+
+
 class wfModel {
   char*    pathname;		/* path to this model */
   char*    mtllibname;		/* name of the material library */
@@ -148,54 +260,137 @@ class wfModel {
 
   bool texturesInitialized;
 
+  int         vertexSize;	/* floats per vertex in the group vertex buffers */
+  MappedFile *cacheFile;	/* mesh cache that group buffers point into, or NULL */
+
+  GLuint      VAO;		/* vertex array object for all groups */
+  bool        verticesQuantized; /* VAO has the compact vertex format of quantize.h */
+  float       quantizedSize;	/* edge length of the cube over which positions are quantized */
+  float       maxPositionError;	/* largest quantization errors */
+  float       minNormalDot;
+  bool        VAOinitialized;
+  GLuint      vertexBufferID;	/* OpenGL vertex buffer for all groups */
+  GLuint      indexBufferID;	/* OpenGL index buffer for all groups */
+  int         vertexCapacity;	/* bytes allocated in vertexBufferID */
+  int         indexCapacity;	/* bytes allocated in indexBufferID */
+  int         numVerticesSent;	/* vertices sent to OpenGL so far */
+  int         numIndicesSent;	/* indices sent to OpenGL so far */
+  GLuint      materialBuffer;	/* uniform buffer with all materials */
+  GLuint      instanceBufferID;	/* per-instance transformations for drawInstanced(), or 0 */
+  int         numInstances;	/* in instanceBufferID */
+  int         materialStride;	/* bytes between materials in materialBuffer */
+  seq<wfBatch> batches;		/* what to draw */
+  seq<wfGroup*> drawOrder;	/* groups in index buffer order (see wfBatch) */
+  int         lodNumTriangles[MAX_LODS]; /* in each level of detail */
+  BVH        *bvh;		/* for raycast(), or NULL */
+  seq<int>    bvhGroupStart;	/* first BVH triangle of each group */
+
+  // Loading (see startLoading())
+
+  enum { LOAD_READING, LOAD_BUILDING, LOAD_FINISHED };
+
+  std::thread      *loader;	  /* thread that reads and builds the model, or NULL */
+  std::atomic<int>  loadState;	  /* LOAD_READING, LOAD_BUILDING, or LOAD_FINISHED */
+  std::mutex        loadMutex;	  /* protects builtGroups and the quantization errors */
+  seq<int>          builtGroups;  /* groups built, in the order they were built */
+  int               numGroupsSent; /* of builtGroups */
+  std::atomic<long long> bytesRead; /* of the .obj file */
+  std::atomic<long long> bytesToRead;
+  int               trianglesToSend;
+  int               trianglesSent;
+  bool              loaded;	  /* all groups are in OpenGL */
+  bool              cpuDataReleased; /* releaseCPUData() has been called */
+  long long         cpuBytesReleased; /* by releaseCPUData() */
+  TextureMode       textureMode;
+
+  void        init();
+  void        load( char *filename );                /* read and build the model (in the loader thread) */
+  void        startBuilding();
+  void        groupBuilt( int i );                   /* make a built group available to continueLoading() */
+  void        sendGroup( int i );                    /* send a built group to OpenGL */
+  void        finishLoading();
+  void        setupAttributes();
+  void        drawBatches( GPUProgram *gpuProg, mat4 *MVP, int numInstances );
+  void        findFrustumPlanes( mat4 &MVP, vec4 planes[6] );
+  int         vertexStride();                        /* bytes per vertex in vertexBufferID */
+  void        findTextures( seq<wfTexture*> &textures ); /* textures of all materials, without duplicates */
+  long long   gpuBufferBytes();                      /* bytes in the vertex, index, and material buffers */
+  void        resizeBuffer( GLuint &buffer, int &capacity, int used, int newCapacity );
+
   wfMaterial* findMaterial( char *name );            /* find a named material */
   wfGroup*    findGroup( char *name );               /* find a named group */
   void        readMaterialLibrary( char *filename ); /* read all materials */
+  void        decodeTextures();                      /* read all texture images (in parallel) */
+  void        buildRaycastBVH();                     /* build bvh from the built groups */
+
+  void        buildVertexNormals();                  /* smooth normals from facetnorms (see generateNormals) */
+  void        buildBuffers();                        /* fill in group vertex and index buffers */
+  void        weldGroup( wfGroup *group );           /* fill in one group's vertex and index buffers */
+  void        optimizeGroup( wfGroup *group, int &missesBefore, int &missesAfter, int &numClusters );
+  void        buildLODs( wfGroup *group );           /* add simplified levels of detail to a group's index buffer */
+  void        quantizeGroup( wfGroup *group );       /* fill in a group's quantized buffer */
+  bool        readCache( char *filename );           /* returns false if no valid cache */
+  void        writeCache( char *filename );
 
   int lineNum;
 
  public:
 
   mat4 objToWorldTransform;
+  mat4 modelTransform;		/* objToWorldTransform without the dequantization */
   vec3 centre;			/* centre of point cloud */
   float radius;			/* radius of point cloud */
   // Global vars controlling the rendering
 
   static bool newGroupWithNewMaterial; /* create a new group each time the material changes */
   static bool verticesAreCW;	       /* calculate opposite-to-usual face normals */
+  static bool useMeshCache;	       /* read and write the mesh cache file */
+  static bool optimizeMeshes;	       /* reorder triangles for the vertex cache and overdraw */
+  static bool quantizeVertices;	       /* send compact vertices to OpenGL (see quantize.h) */
+  static bool generateLODs;	       /* build simplified levels of detail (see buildLODs()) */
+  static bool generateNormals;	       /* build smooth vertex normals if the file has none */
+  static float creaseAngle;	       /* degrees between facets beyond which normals aren't smoothed */
+  static bool buildRaycastBVHs;	       /* build a BVH for raycast() */
+
+  int numLODs;			/* levels of detail (level 0 is the full model) */
+  int lod;			/* level of detail to draw */
+
+  int numGroupsDrawn;		/* by the last draw() */
+  int numGroupsCulled;
 
   vec3 min, max;		/* extents */
 
   wfModel() {
-    texturesInitialized = false;
-    pathname = mtllibname = NULL;
-    objToWorldTransform = identity4();
+    init();
   }
 
   wfModel( char *filename, TextureMode textureMode ) {
-    texturesInitialized = false;
-    pathname = mtllibname = NULL;
-    objToWorldTransform = identity4();
-    read( filename );
-    setupVAO( textureMode );
+    init();
+    this->textureMode = textureMode;
+    load( filename );
+    while (!continueLoading())
+      ;
   }
 
-  ~wfModel() {
-  }
+  ~wfModel();
 
   void read( char *filename );         /* instantiate this model from a file */
-  void draw( GPUProgram * gpuProg );
-  void setupVAO( TextureMode textureMode );
+  void draw( GPUProgram * gpuProg, mat4 *MVP = NULL ); /* cull groups outside the frustum if MVP is given */
+  void setInstances( GLfloat *columns, int n ); /* transformations of the copies drawn by drawInstanced() */
+  void drawInstanced( GPUProgram * gpuProg );  /* draw copies of the model */
+  bool outsideFrustum( mat4 &MVP );    /* the whole model is outside the frustum */
+  bool raycast( vec3 origin, vec3 dir, wfHit &hit ); /* nearest triangle hit, in model coordinates, once loaded */
+  void setupVAO();
+
+  void  startLoading( char *filename, TextureMode textureMode ); /* load in the background */
+  bool  continueLoading();             /* send built groups to OpenGL; returns true when all are sent */
+  bool  extentsKnown() { return loadState != LOAD_READING; } /* centre, radius, etc. are set */
+  float loadProgress();                /* fraction of loading done */
   void initTextures( TextureMode tm );        /* assign texture IDs and store all textures */
-
-  void checkVindex( int v ) {
-    if (v < 0 || v >= vertices.size()) {
-      cerr << "error on line " << lineNum
-	   << ": vertex index " << v+1 << " is too large.  There are only "
-	   << vertices.size() << " vertices." << endl;
-      abort();
-    }
-  }
+  void selectLOD( float projectedRadius );    /* set lod for a model of this radius in pixels */
+  void releaseCPUData();               /* free what isn't needed for drawing, once loaded */
+  void memoryReport();                 /* print the memory used on the CPU and in OpenGL */
+  long long gpuBytes();                /* memory used in OpenGL, including textures */
 };
 
 #endif